@@ -4,14 +4,60 @@
 #include "crypto.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <gcrypt.h>
 #include <stdint.h>
 
 #define GCRY_CIPHER GCRY_CIPHER_AES128   // Pick the cipher here
-#define GCRY_C_MODE GCRY_CIPHER_MODE_ECB // Pick the cipher mode here
+#define GCRY_KEY_LEN 16
+#define GCRY_BLK_LEN 16
 
-gcry_error_t gcry_error_handle;
-gcry_cipher_hd_t gcry_cipher_hd;
+static char gcry_key[GCRY_KEY_LEN];
+static char gcry_iv[GCRY_BLK_LEN];
+static int gcry_mode = CRYPTO_MODE_NONE;
+
+// Every thread gets its own handle, so the receive thread and the uloop
+// can encrypt and decrypt at the same time.
+static __thread gcry_cipher_hd_t gcry_cipher_hd;
+static __thread int gcry_cipher_ready;
+
+static void gcrypt_print_error(const char *func, gcry_error_t err) {
+    fprintf(stderr, "%s failed:  %s/%s\n", func, gcry_strsource(err), gcry_strerror(err));
+}
+
+static gcry_cipher_hd_t gcrypt_thread_handle() {
+    gcry_error_t err;
+
+    if (gcry_cipher_ready) {
+        return gcry_cipher_hd;
+    }
+
+    err = gcry_cipher_open(&gcry_cipher_hd, GCRY_CIPHER,
+                           gcry_mode == CRYPTO_MODE_GCM ? GCRY_CIPHER_MODE_GCM : GCRY_CIPHER_MODE_ECB, 0);
+    if (err) {
+        gcrypt_print_error("gcry_cipher_open", err);
+        return NULL;
+    }
+
+    err = gcry_cipher_setkey(gcry_cipher_hd, gcry_key, GCRY_KEY_LEN);
+    if (err) {
+        gcrypt_print_error("gcry_cipher_setkey", err);
+        gcry_cipher_close(gcry_cipher_hd);
+        return NULL;
+    }
+
+    if (gcry_mode != CRYPTO_MODE_GCM) {
+        err = gcry_cipher_setiv(gcry_cipher_hd, gcry_iv, GCRY_BLK_LEN);
+        if (err) {
+            gcrypt_print_error("gcry_cipher_setiv", err);
+            gcry_cipher_close(gcry_cipher_hd);
+            return NULL;
+        }
+    }
+
+    gcry_cipher_ready = 1;
+    return gcry_cipher_hd;
+}
 
 void gcrypt_init() {
     if (!gcry_check_version(GCRYPT_VERSION)) {
@@ -28,73 +74,107 @@ void gcrypt_init() {
     }
 }
 
-void gcrypt_set_key_and_iv(const char *key, const char *iv) {
-    size_t keylen = gcry_cipher_get_algo_keylen(GCRY_CIPHER);
-    size_t blklen = gcry_cipher_get_algo_blklen(GCRY_CIPHER);
-
-    gcry_error_handle = gcry_cipher_open(
-            &gcry_cipher_hd, // gcry_cipher_hd_t *
-            GCRY_CIPHER,   // int
-            GCRY_C_MODE,   // int
-            0);
-    if (gcry_error_handle) {
-        fprintf(stderr, "gcry_cipher_open failed:  %s/%s\n",
-                gcry_strsource(gcry_error_handle),
-                gcry_strerror(gcry_error_handle));
-        return;
+void gcrypt_set_key_and_iv(const char *key, const char *iv, int mode) {
+    // short keys are padded with zeros instead of reading past the string
+    memset(gcry_key, 0, sizeof(gcry_key));
+    memset(gcry_iv, 0, sizeof(gcry_iv));
+    if (key) {
+        strncpy(gcry_key, key, sizeof(gcry_key));
     }
-
-    gcry_error_handle = gcry_cipher_setkey(gcry_cipher_hd, key, keylen);
-    if (gcry_error_handle) {
-        fprintf(stderr, "gcry_cipher_setkey failed:  %s/%s\n",
-                gcry_strsource(gcry_error_handle),
-                gcry_strerror(gcry_error_handle));
-        return;
+    if (iv) {
+        strncpy(gcry_iv, iv, sizeof(gcry_iv));
     }
+    gcry_mode = mode;
+}
 
-    gcry_error_handle = gcry_cipher_setiv(gcry_cipher_hd, iv, blklen);
-    if (gcry_error_handle) {
-        fprintf(stderr, "gcry_cipher_setiv failed:  %s/%s\n",
-                gcry_strsource(gcry_error_handle),
-                gcry_strerror(gcry_error_handle));
-        return;
+size_t gcrypt_encrypt_len(size_t msg_length) {
+    switch (gcry_mode) {
+        case CRYPTO_MODE_ECB:
+            // trailing '\0' plus padding to the block length
+            return (msg_length + GCRY_BLK_LEN) & ~(size_t) (GCRY_BLK_LEN - 1);
+        case CRYPTO_MODE_GCM:
+            return CRYPTO_GCM_NONCE_LEN + msg_length + CRYPTO_GCM_TAG_LEN;
+        default:
+            return msg_length;
     }
 }
 
-// free out buffer after using!
-char *gcrypt_encrypt_msg(char *msg, size_t msg_length, int *out_length) {
-    if (0U != (msg_length & 0xfU))
-        msg_length += 0x10U - (msg_length & 0xfU);
-
-    char *out = malloc(msg_length);
-    gcry_error_handle = gcry_cipher_encrypt(gcry_cipher_hd, out, msg_length, msg, msg_length);
-    if (gcry_error_handle) {
-        fprintf(stderr, "gcry_cipher_encrypt failed:  %s/%s\n",
-                gcry_strsource(gcry_error_handle),
-                gcry_strerror(gcry_error_handle));
-        return NULL;
+int gcrypt_encrypt(const char *msg, size_t msg_length, char *out, size_t out_size) {
+    gcry_cipher_hd_t hd = gcrypt_thread_handle();
+    size_t out_length = gcrypt_encrypt_len(msg_length);
+    gcry_error_t err;
+
+    if (!hd || out_size < out_length) {
+        return -1;
+    }
+
+    if (gcry_mode == CRYPTO_MODE_GCM) {
+        char *nonce = out;
+        char *data = out + CRYPTO_GCM_NONCE_LEN;
+
+        // A nonce must never repeat under the key all nodes share. Counters restart with
+        // every thread, so the whole 96 bits are random, a repeat is expected after 2^48 messages.
+        gcry_create_nonce(nonce, CRYPTO_GCM_NONCE_LEN);
+
+        err = gcry_cipher_setiv(hd, nonce, CRYPTO_GCM_NONCE_LEN);
+        if (!err)
+            err = gcry_cipher_encrypt(hd, data, msg_length, msg, msg_length);
+        if (!err)
+            err = gcry_cipher_gettag(hd, data + msg_length, CRYPTO_GCM_TAG_LEN);
+    } else {
+        // legacy mode: the '\0' terminator is part of the ciphertext
+        memcpy(out, msg, msg_length);
+        memset(out + msg_length, 0, out_length - msg_length);
+        err = gcry_cipher_encrypt(hd, out, out_length, NULL, 0);
+    }
+
+    if (err) {
+        gcrypt_print_error("gcry_cipher_encrypt", err);
+        return -1;
     }
-    *out_length = msg_length;
-    return out;
+    return out_length;
 }
 
-// free out buffer after using!
-char *gcrypt_decrypt_msg(char *msg, size_t msg_length) {
-    if (0U != (msg_length & 0xfU))
-        msg_length += 0x10U - (msg_length & 0xfU);
-
-    char *out_buffer = malloc(msg_length);
-    gcry_error_handle = gcry_cipher_decrypt(gcry_cipher_hd, out_buffer, msg_length, msg, msg_length);
-    if (gcry_error_handle) {
-        fprintf(stderr, "gcry_cipher_encrypt failed:  %s/%s\n",
-                gcry_strsource(gcry_error_handle),
-                gcry_strerror(gcry_error_handle));
-        free(out_buffer);
-        return NULL;
+int gcrypt_decrypt(const char *msg, size_t msg_length, char *out, size_t out_size) {
+    gcry_cipher_hd_t hd = gcrypt_thread_handle();
+    size_t out_length;
+    gcry_error_t err;
+
+    if (!hd) {
+        return -1;
+    }
+
+    if (gcry_mode == CRYPTO_MODE_GCM) {
+        if (msg_length < CRYPTO_GCM_NONCE_LEN + CRYPTO_GCM_TAG_LEN) {
+            return -1;
+        }
+        out_length = msg_length - CRYPTO_GCM_NONCE_LEN - CRYPTO_GCM_TAG_LEN;
+        if (out_size < out_length + 1) {
+            return -1;
+        }
+
+        const char *data = msg + CRYPTO_GCM_NONCE_LEN;
+        err = gcry_cipher_setiv(hd, msg, CRYPTO_GCM_NONCE_LEN);
+        if (!err)
+            err = gcry_cipher_decrypt(hd, out, out_length, data, out_length);
+        if (!err)
+            err = gcry_cipher_checktag(hd, data + out_length, CRYPTO_GCM_TAG_LEN);
+    } else {
+        if (msg_length == 0 || (msg_length & (GCRY_BLK_LEN - 1)) || out_size < msg_length + 1) {
+            return -1;
+        }
+        err = gcry_cipher_decrypt(hd, out, msg_length, msg, msg_length);
+        out_length = strnlen(out, msg_length);
     }
-    char *out = malloc(strlen(out_buffer) + 1);
-    strcpy(out, out_buffer);
-    free(out_buffer);
-    return out;
+
+    if (err) {
+        gcrypt_print_error("gcry_cipher_decrypt", err);
+        return -1;
+    }
+    out[out_length] = '\0';
+    return out_length;
 }
 
+void gcrypt_random(void *buf, size_t len) {
+    gcry_create_nonce(buf, len);
+}
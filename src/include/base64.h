@@ -0,0 +1,31 @@
+#ifndef DAWN_BASE64_H
+#define DAWN_BASE64_H
+
+#include <stddef.h>
+
+// Output sizes including the '\0' terminator written by the codec.
+#define DAWN_B64_ENCODE_LEN(_len) ((((_len) + 2) / 3) * 4 + 1)
+#define DAWN_B64_DECODE_LEN(_len) ((((_len) + 3) / 4) * 3 + 1)
+
+/**
+ * Encode a buffer with base64 including padding.
+ * Compatible with the libubox b64_encode.
+ * @param src
+ * @param src_len
+ * @param dst
+ * @param dst_size - at least DAWN_B64_ENCODE_LEN(src_len).
+ * @return length of the encoded string or -1 if dst is too small.
+ */
+int dawn_b64_encode(const void *src, size_t src_len, char *dst, size_t dst_size);
+
+/**
+ * Decode a base64 string of known length.
+ * @param src
+ * @param src_len
+ * @param dst
+ * @param dst_size - at least DAWN_B64_DECODE_LEN(src_len).
+ * @return length of the decoded data or -1 if the input is invalid or dst is too small.
+ */
+int dawn_b64_decode(const char *src, size_t src_len, void *dst, size_t dst_size);
+
+#endif //DAWN_BASE64_H
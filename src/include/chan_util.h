@@ -0,0 +1,47 @@
+#ifndef DAWN_CHAN_UTIL_H
+#define DAWN_CHAN_UTIL_H
+
+#include <stdint.h>
+
+// Samples kept per interface, a power of two.
+#define CHAN_UTIL_WINDOW 32
+
+// Histogram of the window over the utilization range 0..255, a power of two.
+#define CHAN_UTIL_BINS 32
+
+// Samples above this percentile of the window are clamped before they enter the average.
+#define CHAN_UTIL_CLAMP_PERCENTILE 90
+
+// Channel utilization of one interface: window of the last samples and a moving average.
+struct chan_util_estimator {
+    uint8_t ring[CHAN_UTIL_WINDOW];
+    uint8_t hist[CHAN_UTIL_BINS];
+    int head;
+    int num;
+    int32_t ewma;       // fixed point, 8 fractional bits
+};
+
+/**
+ * Add a sample, the cost does not depend on the window size.
+ * @param e
+ * @param sample - utilization 0..255.
+ * @param period - number of samples the average roughly spans.
+ */
+void chan_util_add(struct chan_util_estimator *e, int sample, int period);
+
+/**
+ * Get a percentile of the samples in the window.
+ * @param e
+ * @param percentile - 0..100.
+ * @return the upper bound of the histogram bin, 0 if there are no samples.
+ */
+int chan_util_percentile(struct chan_util_estimator *e, int percentile);
+
+/**
+ * Get the smoothed utilization.
+ * @param e
+ * @return utilization 0..255.
+ */
+int chan_util_value(struct chan_util_estimator *e);
+
+#endif //DAWN_CHAN_UTIL_H
@@ -3,6 +3,16 @@
 
 #include <stdlib.h>
 
+// values of the use_symm_enc option
+enum {
+    CRYPTO_MODE_NONE,
+    CRYPTO_MODE_ECB,    // legacy AES-128-ECB with static iv
+    CRYPTO_MODE_GCM,    // AES-128-GCM with a fresh nonce per message
+};
+
+#define CRYPTO_GCM_NONCE_LEN 12
+#define CRYPTO_GCM_TAG_LEN 16
+
 /**
  * Initialize gcrypt.
  * Has to be called before using the other functions!
@@ -10,29 +20,48 @@
 void gcrypt_init();
 
 /**
- * Set the Key and the iv.
+ * Set the Key, the iv and the cipher mode.
+ * Has to be called before any thread encrypts or decrypts.
  * @param key
- * @param iv
+ * @param iv - only used by CRYPTO_MODE_ECB.
+ * @param mode - CRYPTO_MODE_ECB or CRYPTO_MODE_GCM.
  */
-void gcrypt_set_key_and_iv(const char *key, const char *iv);
+void gcrypt_set_key_and_iv(const char *key, const char *iv, int mode);
 
 /**
- * Function that encrypts the message.
- * Free the string after using it!
- * @param msg
+ * Size of the buffer needed to encrypt a message.
  * @param msg_length
- * @param out_length
- * @return the encrypted string.
+ * @return
+ */
+size_t gcrypt_encrypt_len(size_t msg_length);
+
+/**
+ * Function that encrypts the message into a caller supplied buffer.
+ * In GCM mode the output is nonce, ciphertext and tag.
+ * @param msg
+ * @param msg_length - length without the '\0' terminator.
+ * @param out
+ * @param out_size - at least gcrypt_encrypt_len(msg_length).
+ * @return length of the encrypted message or -1.
  */
-char *gcrypt_encrypt_msg(char *msg, size_t msg_length, int *out_length);
+int gcrypt_encrypt(const char *msg, size_t msg_length, char *out, size_t out_size);
 
 /**
- * FUnction that decrypts a message.
- * Free the string after using it!
+ * Function that decrypts a message into a caller supplied buffer.
+ * The output is '\0' terminated. In GCM mode messages failing the authentication are rejected.
  * @param msg
  * @param msg_length
- * @return the decrypted string.
+ * @param out
+ * @param out_size - at least msg_length + 1.
+ * @return length of the decrypted message or -1.
+ */
+int gcrypt_decrypt(const char *msg, size_t msg_length, char *out, size_t out_size);
+
+/**
+ * Fill a buffer with unpredictable bytes.
+ * @param buf
+ * @param len
  */
-char *gcrypt_decrypt_msg(char *msg, size_t msg_length);
+void gcrypt_random(void *buf, size_t len);
 
 #endif //DAWN_CRYPTO_H
@@ -62,6 +62,11 @@ struct probe_metric_s {
     int min_kick_count;
     int chan_util_avg_period;
     int kicking;
+    int rssi_update_delta;
+    int chan_util_update_delta;
+    int use_btm;
+    int kick_rate;
+    int kick_target_rate;
 };
 
 struct time_config_s {
@@ -73,6 +78,9 @@ struct time_config_s {
     time_t update_tcp_con;
     time_t denied_req_threshold;
     time_t update_chan_util;
+    time_t tcp_heartbeat;
+    time_t max_update_silence;
+    time_t reconcile_clients;
 };
 
 struct network_config_s {
@@ -87,6 +95,12 @@ struct network_config_s {
     int use_symm_enc;
     int collision_domain;
     int bandwidth;
+    int gossip_fanout;
+    int gossip_ttl;
+    int ssid_subscriptions;
+    int peer_bulk_rate;
+    int peer_control_rate;
+    int recv_workers;
 };
 
 struct network_config_s network_config;
@@ -112,6 +126,8 @@ typedef struct probe_entry_s {
     int deny_counter;
     uint8_t max_supp_datarate;
     uint8_t min_supp_datarate;
+    uint32_t sent_signal;   // signal last sent to the other nodes
+    time_t sent_time;
 } probe_entry;
 
 typedef struct auth_entry_s {
@@ -228,6 +244,35 @@ void client_array_insert(client entry);
 
 client client_array_delete(client entry);
 
+void client_array_delete_station(uint8_t bssid_addr[], uint8_t client_addr[]);
+
+/**
+ * Check if a client is connected to an ap.
+ * The client array has to be locked by the caller.
+ * @param bssid_addr
+ * @param client_addr
+ * @return
+ */
+int is_connected(uint8_t bssid_addr[], uint8_t client_addr[]);
+
+void client_array_touch_bssid(uint8_t bssid_addr[]);
+
+void client_array_remove_bssid_before(uint8_t bssid_addr[], time_t before);
+
+/**
+ * Count the stations connected to an ap.
+ * @param bssid_addr
+ * @return
+ */
+int client_array_count_bssid(uint8_t bssid_addr[]);
+
+/**
+ * Add the stations of an ap as "clients" table, in the layout of a "clients" message.
+ * @param b
+ * @param bssid_addr
+ */
+void client_array_add_table(struct blob_buf *b, uint8_t bssid_addr[]);
+
 void print_client_array();
 
 void print_client_entry(client entry);
@@ -240,6 +285,40 @@ ap ap_array_get_ap(uint8_t bssid_addr[]);
 
 int build_hearing_map_sort_client(struct blob_buf *b);
 
+// Blob bytes of a sync reply chunk. Nested as JSON string and encrypted it grows about twice,
+// which keeps every chunk well below TCP_FRAME_MAX_LEN.
+#define SYNC_CHUNK_LEN (64 * 1024)
+
+// Summary of what the database holds about an ap, used to reconcile with a peer.
+struct sync_digest {
+    uint8_t bssid_addr[ETH_ALEN];
+    uint32_t clients;
+    uint32_t probes;
+    uint8_t local;      // ap of the node the digest is from
+};
+
+/**
+ * Build the digests of all known aps.
+ * The own aps are always included and marked, the peer does not send them back.
+ * @param b
+ * @return
+ */
+int build_sync_digest(struct blob_buf *b);
+
+/**
+ * Build the client tables and probes of all aps whose digest differs from the given ones.
+ * The aps of the requesting node are skipped, it knows them from hostapd.
+ * The reply is handed to send in chunks of about SYNC_CHUNK_LEN, an ap with more stations
+ * than fit into one chunk is continued in the next ones.
+ * @param b - buffer the chunks are built in.
+ * @param digests - digests of the requesting node.
+ * @param num_digests
+ * @param send - called with every chunk.
+ * @return number of aps added.
+ */
+int build_sync_data(struct blob_buf *b, struct sync_digest *digests, int num_digests,
+                    void (*send)(struct blob_buf *b));
+
 int build_network_overview(struct blob_buf *b);
 
 int probe_array_set_all_probe_count(uint8_t client_addr[], uint32_t probe_count);
@@ -255,9 +334,84 @@ int ap_get_collision_count(int col_domain);
 // ---------------- Global variables ----------------
 char *sort_string;
 
+// Default of max_update_silence, refreshes are sent at least this often (seconds).
+#define UPDATE_SILENCE_DEFAULT 30
+
 // ---------------- Functions -------------------
+/**
+ * Longest time an unchanged rssi or channel utilization is not sent to the other nodes.
+ * @return seconds
+ */
+time_t update_silence();
+
 int better_ap_available(uint8_t bssid_addr[], uint8_t client_addr[], int automatic_kick);
 
+/**
+ * Find the aps of the same ssid a client most likely roams to, ranked by the probe metric.
+ * The probe array has to be locked by the caller.
+ * @param client_addr
+ * @param own_bssid_addr - ap the client is leaving.
+ * @param bssids - filled with the candidates, best first.
+ * @param max
+ * @return number of candidates.
+ */
+int probe_array_best_bssids(uint8_t client_addr[], uint8_t own_bssid_addr[], uint8_t bssids[][ETH_ALEN], int max);
+
+/**
+ * Score of a client at an ap by the probe metric.
+ * The probe array has to be locked by the caller.
+ * @param bssid_addr
+ * @param client_addr
+ * @return the score, 0 if the ap did not hear the client.
+ */
+int probe_array_score(uint8_t bssid_addr[], uint8_t client_addr[]);
+
+/* Verdict cache */
+
+// ---------------- Defines -------------------
+// Clients whose decision inputs are cached, a power of two, and aps tracked per client.
+#define VERDICT_CACHE_LEN 512
+#define VERDICT_MAX_APS 8
+// Most stale verdicts recomputed per refresh run.
+#define VERDICT_REFRESH_MAX 64
+
+// ---------------- Structs ----------------
+// Decision inputs of a client at an ap.
+struct verdict {
+    uint8_t maclisted;
+    uint8_t known;      // the client probed the ap
+    int counter;        // probe counter of the client at the ap
+};
+
+// ---------------- Global variables ----------------
+pthread_mutex_t verdict_mutex;
+
+// ---------------- Functions -------------------
+/**
+ * Look up whether a client is maclisted and has probed an ap.
+ * Answered from the verdict cache, which mirrors the probe array.
+ * On a miss the probe array is searched once and the result is cached.
+ * @param bssid_addr
+ * @param client_addr
+ * @param v
+ */
+void verdict_lookup(uint8_t bssid_addr[], uint8_t client_addr[], struct verdict *v);
+
+/**
+ * better_ap_available without automatic kick, cached until the probes of the client,
+ * its connection or the aps change in a way that can change the result.
+ * @param bssid_addr
+ * @param client_addr
+ * @return see better_ap_available.
+ */
+int better_ap_available_cached(uint8_t bssid_addr[], uint8_t client_addr[]);
+
+/**
+ * Recompute stale verdicts that were asked for before, so the next request of
+ * the client is answered from the cache. Called when the uloop is idle.
+ */
+void verdict_cache_refresh();
+
 /* List stuff */
 
 typedef struct node {
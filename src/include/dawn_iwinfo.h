@@ -6,9 +6,62 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "datastorage.h"
+
+#define IWINFO_IFNAME_LEN 64
+
+// Local interface as seen by libiwinfo, looked up once when dawn subscribes to it.
+struct iwinfo_iface {
+    char ifname[IWINFO_IFNAME_LEN];
+    const struct iwinfo_ops *iw;
+    uint8_t bssid_addr[ETH_ALEN];
+    char ssid[SSID_MAX_LEN + 1];
+    int freq;
+    int band;   // 2, 5 or 6 (GHz), 0 if the frequency is unknown
+    int ht;
+    int vht;
+
+    // channel survey, see iwinfo_survey_all
+    uint64_t last_channel_time;
+    uint64_t last_channel_time_busy;
+    int chan_util;      // -1 if the last survey failed
+};
+
+/**
+ * Add an interface to the registry or refresh its entry.
+ * Resolves the iwinfo backend and queries bssid, ssid, frequency and capabilities once.
+ * The entry is only valid until the next interface is registered or removed.
+ * @param ifname
+ * @return the registry entry or NULL if there is no backend.
+ */
+struct iwinfo_iface *iwinfo_iface_register(const char *ifname);
+
+/**
+ * Remove an interface from the registry.
+ * @param ifname
+ */
+void iwinfo_iface_unregister(const char *ifname);
+
+/**
+ * Find a registered interface by its bssid.
+ * The entry is only valid until the next interface is registered or removed.
+ * @param bssid_addr
+ * @return the registry entry or NULL.
+ */
+struct iwinfo_iface *iwinfo_iface_get_by_bssid(uint8_t *bssid_addr);
+
+// Number of stations of all local interfaces the station cache holds, a power of two.
+#define STA_CACHE_LEN 2048
+
+/**
+ * Drop the station snapshot, the next query dumps the assoclists of all interfaces again.
+ * Called once per client update, so a sweep over all stations needs one dump per interface.
+ */
+void iwinfo_sta_cache_invalidate();
+
 /**
  * Get RSSI using the mac adress of the client.
- * Function uses libiwinfo and searches through all interfaces that are existing.
+ * Answered from the station snapshot of all interfaces.
  * @param client_addr - mac adress of the client
  * @return The RSSI of the client if successful. INT_MIN if client was not found.
  */
@@ -16,7 +69,7 @@ int get_rssi_iwinfo(__uint8_t *client_addr);
 
 /**
  * Get expected throughut using the mac adress of the client.
- * Function uses libiwinfo and searches through all interfaces that are existing.
+ * Answered from the station snapshot of all interfaces.
  * @param client_addr - mac adress of the client
  * @return
  * + The expected throughput of the client if successful.
@@ -27,7 +80,7 @@ int get_expected_throughput_iwinfo(uint8_t *client_addr);
 
 /**
  * Get rx and tx bandwidth using the mac of the client.
- * Function uses libiwinfo and searches through all interfaces that are existing.
+ * Answered from the station snapshot of all interfaces.
  * @param client_addr - mac adress of the client
  * @param rx_rate - float pointer for returning the rx rate
  * @param tx_rate - float pointer for returning the tx rate
@@ -35,15 +88,38 @@ int get_expected_throughput_iwinfo(uint8_t *client_addr);
  */
 int get_bandwidth_iwinfo(__uint8_t *client_addr, float *rx_rate, float *tx_rate);
 
+/**
+ * Check if a client is associated with an interface.
+ * Dumps the assoclist of the interface, the station cache is not used.
+ * @param ifname
+ * @param client_addr
+ * @return 1 if associated, 0 if not, -1 if the assoclist is not available.
+ */
+int iwinfo_iface_has_station(const char *ifname, uint8_t *client_addr);
+
 /**
  * Function checks if two bssid adresses have the same essid.
- * Function uses libiwinfo and searches through all interfaces that are existing.
+ * Function uses the interface registry, so only local interfaces are found.
  * @param bssid_addr
  * @param bssid_addr_to_compares
  * @return 1 if the bssid adresses have the same essid.
  */
 int compare_essid_iwinfo(__uint8_t *bssid_addr, __uint8_t *bssid_addr_to_compare);
 
+/**
+ * Read the channel survey of all registered interfaces.
+ * Interfaces on the same frequency share a radio, so it is only read once per frequency.
+ * The frequency of each interface is refreshed as well, it changes on DFS and ACS channel switches.
+ */
+void iwinfo_survey_all();
+
+/**
+ * Channel utilization of an interface measured by the last iwinfo_survey_all.
+ * @param ifname
+ * @return utilization 0..255, -1 if unknown.
+ */
+int iwinfo_iface_chan_util(const char *ifname);
+
 /**
  * Function returns the expected throughput using the interface and the client address.
  * @param ifname
@@ -0,0 +1,35 @@
+#ifndef DAWN_DEDUP_H
+#define DAWN_DEDUP_H
+
+#include <stdint.h>
+
+// Number of senders tracked at once, the least recently heard one is replaced.
+#define DEDUP_MAX_SENDERS 64
+
+// Messages that are this far behind the newest one of the sender are considered duplicates.
+#define DEDUP_WINDOW 64
+
+// Independent sequence spaces of a sender. Messages of one stream leave the sender in order,
+// but a stream may overtake another one, e.g. control messages queued behind bulk state.
+#define DEDUP_STREAMS 2
+
+/**
+ * Get the sequence number for the next message sent by this node on a stream.
+ * @param stream - 0..DEDUP_STREAMS-1.
+ * @return the sequence number, never 0.
+ */
+uint32_t dedup_next_seq(int stream);
+
+/**
+ * Check if a message was already received and remember it.
+ * Every stream of a sender has its own window.
+ * Messages of this node itself are always reported as duplicate.
+ * Thread safe.
+ * @param sender - node id of the origin.
+ * @param stream - stream the sequence number belongs to, unknown streams are treated as 0.
+ * @param seq - sequence number of the origin.
+ * @return 1 if the message has to be dropped, 0 otherwise.
+ */
+int dedup_check(uint32_t sender, int stream, uint32_t seq);
+
+#endif //DAWN_DEDUP_H
@@ -0,0 +1,21 @@
+#ifndef DAWN_GOSSIP_H
+#define DAWN_GOSSIP_H
+
+#define GOSSIP_TTL_DEFAULT 4
+
+/**
+ * Get the number of hops a new gossip message may travel.
+ * @return
+ */
+int gossip_ttl();
+
+/**
+ * Shuffle the first fanout entries of a candidate list so they are a random subset.
+ * @param candidates
+ * @param n
+ * @param fanout
+ * @return number of selected entries.
+ */
+int gossip_select(int *candidates, int n, int fanout);
+
+#endif //DAWN_GOSSIP_H
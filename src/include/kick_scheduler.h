@@ -0,0 +1,51 @@
+#ifndef DAWN_KICK_SCHEDULER_H
+#define DAWN_KICK_SCHEDULER_H
+
+#include <stdint.h>
+#include <libubox/blobmsg.h>
+
+#include "datastorage.h"
+
+// Clients waiting to be steered away, the ones with the smallest score gap fall out first.
+#define KICK_QUEUE_LEN 32
+
+// Aps whose kick budget is tracked, as source and as target.
+#define KICK_BUCKETS 64
+
+// Defaults of kick_rate and kick_target_rate (kicks per minute).
+#define KICK_RATE_DEFAULT 4
+#define KICK_TARGET_RATE_DEFAULT 2
+
+// Kicks an ap may do in a row after being idle.
+#define KICK_BURST 2
+
+// A kick is run every KICK_INTERVAL plus up to KICK_JITTER ms, so the nodes do not kick in lockstep.
+#define KICK_INTERVAL 1000
+#define KICK_JITTER 2000
+
+/**
+ * Queue a client to be steered away from its ap, or update its queue entry.
+ * Kicks are run from the uloop as the budgets of the own and the target ap allow,
+ * the largest score gap first.
+ * @param id - ubus id of the interface the client is connected to.
+ * @param bssid_addr - ap the client is connected to.
+ * @param client_addr
+ * @param target_addr - best ap the client is heard by.
+ * @param score_gap - score of the target minus the own score.
+ */
+void kick_queue_add(uint32_t id, uint8_t bssid_addr[], uint8_t client_addr[], uint8_t target_addr[], int score_gap);
+
+/**
+ * Drop a client from the queue, e.g. because its ap became the best again.
+ * @param client_addr
+ */
+void kick_queue_remove(uint8_t client_addr[]);
+
+/**
+ * Dump the queued kicks in the order they are run, with their estimated time until the kick.
+ * @param b
+ * @return
+ */
+int build_kick_queue_overview(struct blob_buf *b);
+
+#endif //DAWN_KICK_SCHEDULER_H
@@ -2,11 +2,46 @@
 #define __DAWN_NETWORKSOCKET_H
 
 #include <pthread.h>
+#include <stdint.h>
 
 pthread_mutex_t send_mutex;
 
+// random id of this daemon, used to recognize messages in the mesh
+uint32_t node_id;
+
+#define UDP_MSG_MAGIC 0xda3e
+#define UDP_MSG_VERSION 2
+
+// Largest datagram sent or received, messages above are split into fragments.
+#define UDP_MSG_MAX_LEN 2048
+#define UDP_MSG_MAX_FRAGS 64
+
+// Number of messages reassembled at the same time and the time (ms) a message may take to complete.
+#define UDP_REASM_SLOTS 16
+#define UDP_REASM_TIMEOUT 3000
+
+// Prefix of every datagram, all fields in network byte order.
+struct udp_msg_hdr {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t reserved;
+    uint32_t origin;    // node id of the sender
+    uint32_t seq;       // sequence number of the sender, shared by all fragments of a message
+    uint8_t frag_index;
+    uint8_t frag_count; // 1 for messages that fit into a single datagram
+    uint8_t reserved2[2];
+} __attribute__((packed));
+
+// Upper bound of the recv_workers option and of the messages waiting in a worker queue.
+#define UDP_RECV_WORKERS_MAX 16
+#define UDP_RECV_QUEUE_LEN 256
+
+#define UDP_FRAG_PAYLOAD_LEN (UDP_MSG_MAX_LEN - (int) sizeof(struct udp_msg_hdr))
+
 /**
  * Init a socket using the runopts.
+ * With recv_workers above 1 and encryption on, received messages are decrypted by that many threads
+ * and applied by a single handler thread.
  * @param _ip - ip to use.
  * @param _port - port to use.
  * @param _multicast_socket - if socket should be multicast or broadcast.
@@ -16,6 +51,7 @@ int init_socket_runopts(const char *_ip, int _port, int _multicast_socket);
 
 /**
  * Send message via network.
+ * Messages larger than a datagram are sent as fragments and reassembled by the receivers.
  * @param msg
  * @return
  */
@@ -1,24 +1,148 @@
 #ifndef DAWN_TCPSOCKET_H
 #define DAWN_TCPSOCKET_H
 
+#include <libubox/blobmsg.h>
 #include <libubox/ustream.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <time.h>
+
+#include "datastorage.h"
 
 #define ARRAY_NETWORK_LEN 50
 
+// Upper bound of pending bytes in a peer send queue per message class.
+// Bulk state is superseded by the next update, so it is dropped first.
+#define TCP_SEND_QUEUE_BULK_LIMIT (32 * 1024)
+#define TCP_SEND_QUEUE_CONTROL_LIMIT (128 * 1024)
+#define TCP_SEND_QUEUE_SLOTS 128
+
+// Queued frames are only handed to the socket while less than this is unsent,
+// so a control message never waits behind a large backlog of bulk state.
+#define TCP_WRITE_LOW_WATER (8 * 1024)
+
+// The bulk rate of a peer that can not keep up is halved at most once per interval (ms)
+// but not below the minimum (bytes/s). It grows back whenever the peer caught up.
+#define TCP_BULK_RATE_MIN 4096
+#define TCP_BULK_RATE_DECREASE_INTERVAL 1000
+
+// Largest frame payload accepted from a peer.
+#define TCP_FRAME_MAX_LEN (256 * 1024)
+
+// Reconnect backoff in ms, doubled after every failed attempt.
+#define TCP_BACKOFF_MIN 1000
+#define TCP_BACKOFF_MAX 60000
+
+#define TCP_CONNECT_TIMEOUT 5000
+#define TCP_HEARTBEAT_DEFAULT 2
+// Number of unanswered heartbeats after which a peer is considered dead.
+#define TCP_HEARTBEAT_MISS 3
+// Peers that are not connected and not announced via umdns for this many seconds are forgotten.
+#define TCP_PEER_EXPIRE 300
+
+enum {
+    TCP_MSG_BULK,       // probe and client state
+    TCP_MSG_CONTROL,    // deauth, setprobe and addmac notifications
+    TCP_MSG_CLASSES,
+};
+
+enum {
+    TCP_FRAME_DATA,
+    TCP_FRAME_PING,
+    TCP_FRAME_PONG,
+    TCP_FRAME_GOSSIP,   // data forwarded by the receivers until the ttl is used up
+    TCP_FRAME_SUBSCRIBE,    // list of ssid topics the sender serves
+};
+
+// Maximum number of ssid topics announced by a peer.
+#define TCP_MAX_TOPICS 16
+
+// Number of remote aps whose owning peer is remembered.
+#define TCP_MAX_BSSID_OWNERS 256
+
+// All fields in network byte order.
+struct tcp_frame_hdr {
+    uint32_t len;       // payload length
+    uint8_t type;
+    uint8_t ttl;        // remaining hops of gossip frames
+    uint8_t msg_class;  // TCP_MSG_BULK or TCP_MSG_CONTROL, every class has its own sequence numbers
+    uint8_t reserved;
+    uint32_t topic;     // ssid topic of the data, 0 for messages relevant to every peer
+    uint32_t origin;    // node id of the node that created the message
+    uint32_t seq;       // sequence number of the origin, 0 for link local frames
+} __attribute__((packed));
+
+// Frame shared by the send queues of all peers it goes to.
+struct tcp_msg {
+    int refs;
+    uint32_t len;       // header and payload
+    char data[];
+};
+
+// Send queue of one message class, limited by a token bucket.
+struct tcp_send_queue {
+    struct tcp_msg *slots[TCP_SEND_QUEUE_SLOTS];
+    int head;
+    int count;
+    uint32_t bytes;
+
+    uint32_t rate;      // bytes/s, 0 is unlimited
+    uint32_t max_rate;
+    int64_t tokens;
+    uint64_t last_refill;
+    uint64_t last_decrease;
+
+    // statistics
+    uint32_t sent;
+    uint32_t dropped;
+    uint32_t throttled;
+};
+
+struct tcp_rx_buf {
+    char *data;
+    int len;
+    int size;
+};
+
+enum {
+    TCP_CON_DISCONNECTED,
+    TCP_CON_CONNECTING,
+    TCP_CON_CONNECTED,
+};
+
 struct network_con_s {
     int sockfd;
     struct sockaddr_in sock_addr;
     struct ustream_fd s;
+    struct uloop_fd connect_fd;
+    struct uloop_timeout timer;
+    struct tcp_rx_buf rx;
+    int state;
+    time_t last_seen;
+    int backoff;
+    struct tcp_send_queue queue[TCP_MSG_CLASSES];
+    struct uloop_timeout drain_timer;
+
+    // health statistics
+    uint32_t connect_attempts;
+    uint32_t connect_failures;  // attempts that did not get connected
+    uint32_t disconnects;       // established connections that were lost
+    uint32_t pings_sent;
+    uint32_t pongs_received;
+    uint32_t pings_lost;
+    int pings_unanswered;
+    uint32_t rtt;
+    uint32_t srtt;
 };
 
-struct network_con_s network_array[ARRAY_NETWORK_LEN];
+struct network_con_s *network_array[ARRAY_NETWORK_LEN];
 
 pthread_mutex_t tcp_array_mutex;
 
 /**
- * Add tcp connection.
+ * Add a peer as connection candidate.
+ * The connection manager connects to the peer and reconnects with exponential backoff if it fails.
+ * Adding an already known peer only refreshes its announcement time.
  * @param ipv4
  * @param port
  * @return
@@ -35,9 +159,9 @@ int run_server(int port);
 /**
  * Insert tcp connection to tcp array.
  * @param entry
- * @return
+ * @return 1 if the connection was inserted, 0 if the address is already known.
  */
-int insert_to_tcp_array(struct network_con_s entry);
+int insert_to_tcp_array(struct network_con_s *entry);
 
 /**
  * Checks if a tcp address is already contained in the database.
@@ -47,10 +171,57 @@ int insert_to_tcp_array(struct network_con_s entry);
 int tcp_array_contains_address(struct sockaddr_in entry);
 
 /**
- * Send message via tcp to all other hosts.
+ * Queue message via tcp to all other hosts.
+ * The message is written asynchronously by the uloop. Every peer has a send queue per
+ * message class, control messages are sent before bulk state. The classes are limited
+ * to peer_control_rate and peer_bulk_rate, the bulk rate adapts to what the peer takes.
+ * If the send queue of a peer is above the limit of the message class the message is
+ * dropped for this peer.
+ * If gossip_fanout is set, bulk messages are only sent to that many random peers
+ * which forward them until the ttl is used up.
+ * Peers that announced their ssid topics only get messages of these topics.
+ * @param msg
+ * @param msg_class - TCP_MSG_BULK or TCP_MSG_CONTROL.
+ * @param topic - ssid topic of the message or 0.
+ */
+void send_tcp(char *msg, int msg_class, uint32_t topic);
+
+/**
+ * Send a message only to the peers owning the given aps.
+ * @param msg
+ * @param msg_class - TCP_MSG_BULK or TCP_MSG_CONTROL.
+ * @param bssids
+ * @param num_bssids
+ * @return number of peers the message was queued for, 0 if no owner is connected.
+ */
+int send_tcp_directed(char *msg, int msg_class, uint8_t bssids[][ETH_ALEN], int num_bssids);
+
+/**
+ * Remember the node that created the message currently handled as owner of an ap.
+ * Only valid while handling a tcp message, does nothing otherwise.
+ * @param bssid_addr
+ */
+void tcp_set_bssid_owner(uint8_t bssid_addr[]);
+
+/**
+ * Answer the peer whose message is currently handled.
+ * Only valid while handling a tcp message, does nothing otherwise.
  * @param msg
+ * @return 0 or -1 if the reply could not be sent, e.g. because it exceeds TCP_FRAME_MAX_LEN.
+ */
+int send_tcp_reply(char *msg);
+
+/**
+ * Announce the ssid topics of the local interfaces to all connected peers.
+ */
+void tcp_announce_topics();
+
+/**
+ * Dump the connection state and health statistics of all peers.
+ * @param b
+ * @return
  */
-void send_tcp(char *msg);
+int build_tcp_peer_overview(struct blob_buf *b);
 
 /**
  * Debug message.
@@ -35,7 +35,8 @@ void start_umdns_update();
 
 /**
  * Call umdns update to update the TCP connections.
- * @return
+ * Asynchronous, the peers found by the following browse are added from the uloop.
+ * @return 0 if the update was started.
  */
 int ubus_call_umdns();
 
@@ -72,6 +73,14 @@ int parse_to_assoc_req(struct blob_attr *msg, assoc_entry *assoc_req);
  */
 int parse_to_clients(struct blob_attr *msg, int do_kick, uint32_t id);
 
+/**
+ * Apply a client delta of another node to the database.
+ * Stations not contained in the delta are kept alive.
+ * @param msg - message to parse.
+ * @return
+ */
+int parse_to_clients_delta(struct blob_attr *msg);
+
 /**
  * Parse to hostapd notify.
  * Notify are such notifications like:
@@ -86,6 +95,7 @@ int parse_to_hostapd_notify(struct blob_attr *msg, hostapd_notify_entry *notify_
 
 /**
  * Kick client from hostapd interface.
+ * The call is asynchronous and does not wait for hostapd.
  * @param id - the ubus id.
  * @param client_addr - the client adress of the client to kick.
  * @param reason - the reason to kick the client.
@@ -96,6 +106,7 @@ void del_client_interface(uint32_t id, const uint8_t *client_addr, uint32_t reas
 
 /**
  * Kick client from all hostapd interfaces.
+ * The calls to all interfaces are in flight at once.
  * @param client_addr - the client adress of the client to kick.
  * @param reason - the reason to kick the client.
  * @param deauth - if the client should be deauthenticated.
@@ -111,7 +122,9 @@ void del_client_all_interfaces(const uint8_t *client_addr, uint32_t reason, uint
 int ubus_send_probe_via_network(struct probe_entry_s probe_entry);
 
 /**
- * Update the hostapd sockets.
+ * Rescan the hostapd sockets.
+ * New interfaces are normally attached right away by the hostapd_dir watch and the
+ * ubus object events, so while the watch is active this runs only every minute.
  * @param t
  */
 void update_hostapd_sockets(struct uloop_timeout *t);
@@ -129,6 +142,49 @@ void add_client_update_timer(time_t time);
  */
 int handle_network_msg(char *msg);
 
+/**
+ * Collect the ssid topics of the local hostapd interfaces.
+ * Reads the published snapshot of the interfaces, so it is safe from the network threads.
+ * @param topics
+ * @param max
+ * @return number of topics.
+ */
+int get_local_ssid_topics(uint32_t *topics, int max);
+
+/**
+ * Collect the bssids of the local hostapd interfaces.
+ * Reads the published snapshot of the interfaces, so it is safe from the network threads.
+ * @param bssids
+ * @param max
+ * @return number of bssids.
+ */
+int get_local_bssids(uint8_t bssids[][ETH_ALEN], int max);
+
+/**
+ * Check if a bssid belongs to a local hostapd interface.
+ * Reads the published snapshot of the interfaces, so it is safe from the network threads.
+ * @param bssid_addr
+ * @return
+ */
+int is_local_bssid(uint8_t bssid_addr[]);
+
+/**
+ * Check if a local hostapd interface serves the ssid.
+ * Reads the published snapshot of the interfaces, so it is safe from the network threads.
+ * @param ssid
+ * @return
+ */
+int serves_ssid(const char *ssid);
+
+/**
+ * Wrap a message into the network format.
+ * Free the string after using it!
+ * @param msg
+ * @param method
+ * @return the json string.
+ */
+char *build_network_msg(struct blob_attr *msg, char *method);
+
 /**
  * Send message via network.
  * @param msg
@@ -137,6 +193,20 @@ int handle_network_msg(char *msg);
  */
 int send_blob_attr_via_network(struct blob_attr *msg, char *method);
 
+// Number of aps a control message about a roaming client is sent to.
+#define NOTIFY_MAX_TARGETS 3
+
+/**
+ * Send message only to the nodes owning the given aps.
+ * Falls back to sending to all nodes if no owner is known or the transport can not address single nodes.
+ * @param msg
+ * @param method
+ * @param bssids
+ * @param num_bssids
+ * @return
+ */
+int send_blob_attr_to_bssids(struct blob_attr *msg, char *method, uint8_t bssids[][ETH_ALEN], int num_bssids);
+
 /**
  * Add mac to a list that contains addresses of clients that can not be controlled.
  * @param buf
@@ -148,10 +218,34 @@ void blobmsg_add_macaddr(struct blob_buf *buf, const char *name, const uint8_t *
 /**
  * Function to set the probe counter to the min probe request.
  * This allows that the client is able to connect directly without sending multiple probe requests to the Access Point.
+ * Only the aps the client most likely roams to are notified, the probe array has to be locked by the caller.
+ * @param client_addr
+ * @param bssid_addr - ap the client is kicked from.
+ * @return
+ */
+int send_set_probe(uint8_t client_addr[], uint8_t bssid_addr[]);
+
+// Number of candidates offered to a client in a BSS transition request.
+#define BTM_MAX_CANDIDATES 4
+
+/**
+ * Ask a client to roam with an 802.11v BSS transition request instead of kicking it.
+ * The candidates are the aps of the same ssid that heard the client, ranked by eval_probe_metric.
+ * If the client rejects the request or is still connected after a few seconds it is deauthenticated.
+ * The probe array has to be locked by the caller.
+ * @param id - ubus id of the interface the client is connected to.
  * @param client_addr
+ * @param bssid_addr - ap the client is steered away from.
+ * @return 0 if the request was sent or is still pending, -1 if the client has to be kicked right away.
+ */
+int send_bss_transition_request(uint32_t id, uint8_t client_addr[], uint8_t bssid_addr[]);
+
+/**
+ * Dump the roam statistics of the BSS transition requests and the pending requests.
+ * @param b
  * @return
  */
-int send_set_probe(uint8_t client_addr[]);
+int build_roam_overview(struct blob_buf *b);
 
 /**
  * Send control message to all hosts to add the mac to a don't control list.
@@ -0,0 +1,75 @@
+#ifndef DAWN_URINGSOCKET_H
+#define DAWN_URINGSOCKET_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <libubox/ustream.h>
+
+// Datagram buffers handed to the kernel for multishot receives, a power of two.
+#define URING_RECV_BUFS 256
+#define URING_RECV_BUF_LEN 2048
+
+// Largest batch of datagrams submitted at once.
+#define URING_SEND_ENTRIES 64
+
+// Receive buffers shared by all TCP connections, a power of two.
+#define URING_TCP_RECV_BUFS 64
+#define URING_TCP_RECV_BUF_LEN 4096
+
+// Requests of the TCP ring, the submissions of a uloop round for all connections.
+#define URING_TCP_ENTRIES 256
+
+// Connections driven by the TCP ring, a power of two, the ones beyond use the uloop.
+#define URING_TCP_CONNS 256
+
+// Bytes of a connection handed to the kernel with one send.
+#define URING_TCP_TX_LEN (16 * 1024)
+
+/**
+ * Set up the receive and the send ring for a datagram socket.
+ * The callers fall back to the socket calls if this fails, e.g. on older kernels.
+ * @param sock
+ * @return 0 if io_uring is used.
+ */
+int uring_socket_init(int sock);
+
+/**
+ * Receive the next datagram.
+ * Datagrams are received by a multishot request, so only waiting for new ones needs a syscall.
+ * Only to be called by one thread.
+ * Any failure but running out of buffers is taken as the ring being unusable, it is torn down
+ * and the caller has to receive with the socket calls from then on.
+ * @param buf
+ * @param size
+ * @return length of the datagram or -1 if the receive ring is gone.
+ */
+int uring_socket_recv(char *buf, size_t size);
+
+/**
+ * Send a batch of datagrams with a single submission.
+ * The caller serializes sending.
+ * @param msgs
+ * @param n - at most URING_SEND_ENTRIES.
+ * @return 0 or -1 if a datagram could not be sent.
+ */
+int uring_socket_sendmsgs(struct msghdr *msgs, int n);
+
+/**
+ * Set up the ring for the TCP connections, its completions are handled on the uloop.
+ * The callers fall back to ustream_fd if this fails.
+ * @return 0 if io_uring is used.
+ */
+int uring_tcp_init();
+
+/**
+ * Let the TCP ring drive a connected socket instead of a uloop fd.
+ * Data is received by a multishot request into buffers shared by all connections,
+ * the writes of all connections go out with one submission per uloop round.
+ * The stream is used and freed like one set up by ustream_fd_init, the caller still closes the fd.
+ * @param s - stream with the notify callbacks set.
+ * @param fd
+ * @return 0 or -1 if the stream has to be set up with ustream_fd_init.
+ */
+int uring_tcp_stream_init(struct ustream *s, int fd);
+
+#endif //DAWN_URINGSOCKET_H
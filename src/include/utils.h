@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <ctype.h>
+#include <stddef.h>
 
 #define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
 #define STR2MAC(a) &(a)[0], &(a)[1], &(a)[2], &(a)[3], &(a)[4], &(a)[5]
@@ -47,4 +48,29 @@ void write_mac_to_file(char *path, uint8_t addr[]);
  */
 int string_is_greater(uint8_t *str, uint8_t *str_2);
 
+/**
+ * Grow a buffer to at least needed bytes. The buffer never shrinks,
+ * so it stops allocating once it has seen the largest message.
+ * @param buf
+ * @param size
+ * @param needed
+ * @return the buffer or NULL if it could not be grown.
+ */
+char *reserve_buf(char **buf, size_t *size, size_t needed);
+
+/**
+ * FNV-1a hash of a buffer.
+ * @param data
+ * @param len
+ * @return
+ */
+uint32_t hash_fnv1a(const void *data, size_t len);
+
+/**
+ * Hash a ssid to a topic used for routing state between the nodes.
+ * @param ssid
+ * @return the topic, never 0.
+ */
+uint32_t ssid_topic(const char *ssid);
+
 #endif
\ No newline at end of file
@@ -81,6 +81,11 @@ int init_mutex() {
         fprintf(stderr, "Mutex init failed!\n");
         return 1;
     }
+
+    if (pthread_mutex_init(&verdict_mutex, NULL) != 0) {
+        fprintf(stderr, "Mutex init failed!\n");
+        return 1;
+    }
     return 0;
 }
 
@@ -105,7 +110,12 @@ int main(int argc, char **argv) {
 
     // init crypto
     gcrypt_init();
-    gcrypt_set_key_and_iv(net_config.shared_key, net_config.iv);
+    gcrypt_set_key_and_iv(net_config.shared_key, net_config.iv, net_config.use_symm_enc);
+
+    do {
+        gcrypt_random(&node_id, sizeof(node_id));
+    } while (!node_id);
+    srand(node_id);
 
     struct time_config_s time_config = uci_get_time_config();
     timeout_config = time_config; // TODO: Refactor...
@@ -0,0 +1,100 @@
+#include <pthread.h>
+
+#include "dedup.h"
+#include "networksocket.h"
+
+// Sliding window per sender and stream: the highest sequence number seen
+// and a bitmap of the DEDUP_WINDOW numbers below it. Bit n is set if
+// highest - n was received.
+struct dedup_sender {
+    uint32_t sender;
+    int stream;
+    uint32_t highest;
+    uint64_t window;
+    uint32_t last_used;
+};
+
+static struct dedup_sender dedup_senders[DEDUP_MAX_SENDERS];
+static int dedup_sender_last = -1;
+static uint32_t dedup_clock;
+static uint32_t dedup_seq[DEDUP_STREAMS];
+
+static pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int dedup_stream(int stream) {
+    return stream >= 0 && stream < DEDUP_STREAMS ? stream : 0;
+}
+
+uint32_t dedup_next_seq(int stream) {
+    uint32_t *next = &dedup_seq[dedup_stream(stream)];
+    uint32_t seq = __sync_add_and_fetch(next, 1);
+
+    // 0 marks frames without sequence number
+    if (!seq) {
+        seq = __sync_add_and_fetch(next, 1);
+    }
+    return seq;
+}
+
+static struct dedup_sender *dedup_get_sender(uint32_t sender, int stream) {
+    struct dedup_sender *lru = NULL;
+
+    for (int i = 0; i <= dedup_sender_last; i++) {
+        if (dedup_senders[i].sender == sender && dedup_senders[i].stream == stream) {
+            return &dedup_senders[i];
+        }
+        if (!lru || dedup_senders[i].last_used < lru->last_used) {
+            lru = &dedup_senders[i];
+        }
+    }
+
+    if (dedup_sender_last + 1 < DEDUP_MAX_SENDERS) {
+        lru = &dedup_senders[++dedup_sender_last];
+    }
+
+    lru->sender = sender;
+    lru->stream = stream;
+    lru->highest = 0;
+    lru->window = 0;
+    return lru;
+}
+
+int dedup_check(uint32_t sender, int stream, uint32_t seq) {
+    int dup = 0;
+
+    if (sender == node_id) {
+        return 1;
+    }
+
+    // message without identity, nothing to compare
+    if (!seq) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&dedup_mutex);
+
+    struct dedup_sender *entry = dedup_get_sender(sender, dedup_stream(stream));
+    entry->last_used = ++dedup_clock;
+
+    // serial number arithmetic, sequence numbers wrap around
+    int32_t diff = (int32_t) (seq - entry->highest);
+
+    if (entry->window == 0 || diff > 0) {
+        if (entry->window == 0 || diff >= DEDUP_WINDOW) {
+            entry->window = 1;
+        } else {
+            entry->window = (entry->window << diff) | 1;
+        }
+        entry->highest = seq;
+    } else if (-diff >= DEDUP_WINDOW) {
+        dup = 1;
+    } else if (entry->window & ((uint64_t) 1 << -diff)) {
+        dup = 1;
+    } else {
+        entry->window |= (uint64_t) 1 << -diff;
+    }
+
+    pthread_mutex_unlock(&dedup_mutex);
+
+    return dup;
+}
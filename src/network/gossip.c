@@ -0,0 +1,23 @@
+#include <stdlib.h>
+
+#include "gossip.h"
+#include "datastorage.h"
+
+int gossip_ttl() {
+    return network_config.gossip_ttl > 0 ? network_config.gossip_ttl : GOSSIP_TTL_DEFAULT;
+}
+
+int gossip_select(int *candidates, int n, int fanout) {
+    if (fanout > n) {
+        fanout = n;
+    }
+
+    // partial fisher-yates
+    for (int i = 0; i < fanout; i++) {
+        int j = i + rand() % (n - i);
+        int tmp = candidates[i];
+        candidates[i] = candidates[j];
+        candidates[j] = tmp;
+    }
+    return fanout;
+}
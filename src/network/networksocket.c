@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <libubox/blobmsg_json.h>
 
 #include "networksocket.h"
@@ -11,23 +13,102 @@
 #include "broadcastsocket.h"
 #include "ubus.h"
 #include "crypto.h"
+#include "utils.h"
+#include "base64.h"
+#include "dedup.h"
 
-/* Network Defines */
-#define MAX_RECV_STRING 2048
+#ifdef DAWN_IO_URING
+#include "uringsocket.h"
+#endif
 
 /* Network Attributes */
 int sock;
 struct sockaddr_in addr;
 const char *ip;
 unsigned short port;
-char recv_string[MAX_RECV_STRING + 1];
+char recv_string[UDP_MSG_MAX_LEN + 1];
 int recv_string_len;
 int multicast_socket;
+// io_uring is set up for the socket
+static int use_uring;
+// receiving falls back to recvfrom for good once the receive ring failed
+static int use_uring_recv;
+
+// Message of which not all fragments arrived yet.
+struct udp_reasm {
+    uint32_t origin;
+    uint32_t seq;
+    int frag_count;
+    int frags_received;
+    uint64_t received;      // bitmap of the fragment indices
+    int len;
+    char *data;
+    struct timespec started;
+};
+
+// only used by the receiving thread
+static struct udp_reasm reasm[UDP_REASM_SLOTS];
+
+// Message passed between the receiving thread, the decode workers and the handler.
+struct recv_item {
+    struct recv_item *next;
+    int len;
+    char data[];
+};
+
+struct recv_queue {
+    struct recv_item *head, *tail;
+    int len;
+    uint32_t dropped;
+};
+
+// One input queue per worker. All output queues share a lock, so the handler
+// can wait for any of them.
+static int recv_workers;
+static struct recv_queue recv_in[UDP_RECV_WORKERS_MAX];
+static struct recv_queue recv_out[UDP_RECV_WORKERS_MAX];
+static pthread_mutex_t recv_in_mutex[UDP_RECV_WORKERS_MAX];
+static pthread_cond_t recv_in_cond[UDP_RECV_WORKERS_MAX];
+static pthread_mutex_t recv_out_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recv_out_cond = PTHREAD_COND_INITIALIZER;
 
 void *receive_msg(void *args);
 
 void *receive_msg_enc(void *args);
 
+void *receive_msg_dispatch(void *args);
+
+void *receive_msg_worker(void *args);
+
+void *receive_msg_handler(void *args);
+
+static int start_recv_workers() {
+    pthread_t thread;
+
+    recv_workers = network_config.recv_workers;
+    if (recv_workers > UDP_RECV_WORKERS_MAX) {
+        recv_workers = UDP_RECV_WORKERS_MAX;
+    }
+
+    for (long i = 0; i < recv_workers; i++) {
+        pthread_mutex_init(&recv_in_mutex[i], NULL);
+        pthread_cond_init(&recv_in_cond[i], NULL);
+        if (pthread_create(&thread, NULL, receive_msg_worker, (void *) i)) {
+            fprintf(stderr, "Could not create decode worker!");
+            return -1;
+        }
+    }
+
+    if (pthread_create(&thread, NULL, receive_msg_handler, NULL) ||
+        pthread_create(&thread, NULL, receive_msg_dispatch, NULL)) {
+        fprintf(stderr, "Could not create receiving thread!");
+        return -1;
+    }
+
+    printf("Decoding received messages with %d workers\n", recv_workers);
+    return 0;
+}
+
 int init_socket_runopts(const char *_ip, int _port, int _multicast_socket) {
 
     port = _port;
@@ -41,8 +122,18 @@ int init_socket_runopts(const char *_ip, int _port, int _multicast_socket) {
         sock = setup_broadcast_socket(ip, port, &addr);
     }
 
+#ifdef DAWN_IO_URING
+    use_uring = uring_socket_init(sock) == 0;
+    use_uring_recv = use_uring;
+#endif
+
     pthread_t sniffer_thread;
-    if (network_config.use_symm_enc) {
+    // the workers only decrypt, plain messages would just take extra queue hops
+    if (network_config.recv_workers > 1 && network_config.use_symm_enc) {
+        if (start_recv_workers()) {
+            return -1;
+        }
+    } else if (network_config.use_symm_enc) {
         if (pthread_create(&sniffer_thread, NULL, receive_msg_enc, NULL)) {
             fprintf(stderr, "Could not create receiving thread!");
             return -1;
@@ -60,99 +151,433 @@ int init_socket_runopts(const char *_ip, int _port, int _multicast_socket) {
     return 0;
 }
 
+static long reasm_age_ms(struct udp_reasm *r, struct timespec *now) {
+    return (now->tv_sec - r->started.tv_sec) * 1000 + (now->tv_nsec - r->started.tv_nsec) / 1000000;
+}
+
+static void reasm_free(struct udp_reasm *r) {
+    free(r->data);
+    memset(r, 0, sizeof(*r));
+}
+
+// Find the buffer of a message. A sender only has one message in flight,
+// so a newer sequence number of the same sender replaces its old buffer.
+// Returns NULL for late or duplicated fragments of an older message.
+static struct udp_reasm *reasm_get(uint32_t origin, uint32_t seq, int frag_count) {
+    struct udp_reasm *r = NULL, *oldest = NULL;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int i = 0; i < UDP_REASM_SLOTS; i++) {
+        struct udp_reasm *cur = &reasm[i];
+
+        if (cur->data && reasm_age_ms(cur, &now) > UDP_REASM_TIMEOUT) {
+            printf("Dropping incomplete message %u of %x, got %d of %d fragments\n", cur->seq, cur->origin,
+                   cur->frags_received, cur->frag_count);
+            reasm_free(cur);
+        }
+
+        if (cur->data && cur->origin == origin) {
+            r = cur;
+            break;
+        }
+        if (!cur->data) {
+            if (!oldest || oldest->data) {
+                oldest = cur;
+            }
+        } else if (!oldest || (oldest->data && reasm_age_ms(cur, &now) > reasm_age_ms(oldest, &now))) {
+            oldest = cur;
+        }
+    }
+
+    // a free slot if there is one, otherwise the oldest message is given up
+    if (!r) {
+        r = oldest;
+    }
+
+    if (r->data && r->origin == origin) {
+        // serial number arithmetic like dedup_check, sequence numbers wrap around
+        int32_t diff = (int32_t) (seq - r->seq);
+
+        if (diff == 0 && r->frag_count == frag_count) {
+            return r;
+        }
+        // the message in progress is newer, a stale fragment must not evict it
+        if (diff <= 0) {
+            return NULL;
+        }
+    }
+
+    reasm_free(r);
+    r->data = malloc(frag_count * UDP_FRAG_PAYLOAD_LEN + 1);
+    if (!r->data) {
+        return NULL;
+    }
+    r->origin = origin;
+    r->seq = seq;
+    r->frag_count = frag_count;
+    r->started = now;
+    return r;
+}
+
+// Copy a fragment into its message. Returns the message once all fragments arrived.
+static char *reasm_add(struct udp_msg_hdr *hdr, char *payload, int len, int *msg_len) {
+    static char *complete;
+
+    if (hdr->frag_count > UDP_MSG_MAX_FRAGS || hdr->frag_index >= hdr->frag_count ||
+        len > UDP_FRAG_PAYLOAD_LEN || (hdr->frag_index < hdr->frag_count - 1 && len != UDP_FRAG_PAYLOAD_LEN)) {
+        return NULL;
+    }
+
+    struct udp_reasm *r = reasm_get(ntohl(hdr->origin), ntohl(hdr->seq), hdr->frag_count);
+    if (!r || (r->received & (1ULL << hdr->frag_index))) {
+        return NULL;
+    }
+
+    memcpy(r->data + hdr->frag_index * UDP_FRAG_PAYLOAD_LEN, payload, len);
+    r->received |= 1ULL << hdr->frag_index;
+    r->frags_received++;
+    if (hdr->frag_index == hdr->frag_count - 1) {
+        r->len = hdr->frag_index * UDP_FRAG_PAYLOAD_LEN + len;
+    }
+
+    if (r->frags_received < r->frag_count) {
+        return NULL;
+    }
+
+    // take over the buffer, the previous complete message is handled by now
+    free(complete);
+    complete = r->data;
+    complete[r->len] = '\0';
+    *msg_len = r->len;
+    r->data = NULL;
+    reasm_free(r);
+
+    return complete;
+}
+
+// Receive the next datagram and check its identity before anything is parsed.
+// Returns the payload once a message is complete or NULL if nothing is to be handled.
+static char *receive_datagram(int *payload_len, uint32_t *origin) {
+    struct udp_msg_hdr hdr;
+    char *payload;
+
+#ifdef DAWN_IO_URING
+    if (use_uring_recv) {
+        recv_string_len = uring_socket_recv(recv_string, UDP_MSG_MAX_LEN);
+        if (recv_string_len < 0) {
+            fprintf(stderr, "Falling back to recvfrom for the network socket\n");
+            use_uring_recv = 0;
+        }
+    }
+    if (!use_uring_recv)
+#endif
+    recv_string_len = recvfrom(sock, recv_string, UDP_MSG_MAX_LEN, 0, NULL, 0);
+    if (recv_string_len < 0) {
+        fprintf(stderr, "Could not receive message!");
+        return NULL;
+    }
+
+    if (recv_string_len < (int) sizeof(hdr)) {
+        return NULL;
+    }
+    recv_string[recv_string_len] = '\0';
+
+    memcpy(&hdr, recv_string, sizeof(hdr));
+    if (ntohs(hdr.magic) != UDP_MSG_MAGIC || hdr.version != UDP_MSG_VERSION) {
+        return NULL;
+    }
+
+    // multicast loopback, checked before fragments are buffered
+    if (ntohl(hdr.origin) == node_id) {
+        return NULL;
+    }
+
+    payload = recv_string + sizeof(hdr);
+    *payload_len = recv_string_len - sizeof(hdr);
+    if (hdr.frag_count > 1) {
+        payload = reasm_add(&hdr, payload, *payload_len, payload_len);
+        if (!payload) {
+            return NULL;
+        }
+    }
+
+    // rebroadcasts, only complete messages take part in the dedup window
+    if (dedup_check(ntohl(hdr.origin), 0, ntohl(hdr.seq))) {
+        return NULL;
+    }
+
+    *origin = ntohl(hdr.origin);
+    return payload;
+}
+
+// Base64 decode and decrypt a payload into a buffer of the calling thread.
+static char *decode_msg(char *payload, int payload_len, int *msg_len) {
+    static __thread char *dec_buf, *plain_buf;
+    static __thread size_t dec_size, plain_size;
+    size_t dec_len = DAWN_B64_DECODE_LEN(payload_len);
+
+    if (!reserve_buf(&dec_buf, &dec_size, dec_len) ||
+        !reserve_buf(&plain_buf, &plain_size, dec_len + 1)) {
+        return NULL;
+    }
+
+    int base64_dec_length = dawn_b64_decode(payload, payload_len, dec_buf, dec_size);
+    if (base64_dec_length < 0 ||
+        (*msg_len = gcrypt_decrypt(dec_buf, base64_dec_length, plain_buf, plain_size)) < 0) {
+        fprintf(stderr, "Dropping message that can not be decrypted!\n");
+        return NULL;
+    }
+    return plain_buf;
+}
+
+static struct recv_item *recv_item_new(const char *data, int len) {
+    struct recv_item *item = malloc(sizeof(*item) + len + 1);
+
+    if (!item) {
+        return NULL;
+    }
+    item->next = NULL;
+    item->len = len;
+    memcpy(item->data, data, len);
+    item->data[len] = '\0';
+    return item;
+}
+
+// Append to a queue, the caller holds its lock. Returns -1 if the queue is full.
+static int recv_queue_push(struct recv_queue *q, struct recv_item *item) {
+    if (q->len >= UDP_RECV_QUEUE_LEN) {
+        q->dropped++;
+        return -1;
+    }
+
+    if (q->tail) {
+        q->tail->next = item;
+    } else {
+        q->head = item;
+    }
+    q->tail = item;
+    q->len++;
+    return 0;
+}
+
+static struct recv_item *recv_queue_pop(struct recv_queue *q) {
+    struct recv_item *item = q->head;
+
+    if (item) {
+        q->head = item->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+        q->len--;
+    }
+    return item;
+}
+
 void *receive_msg(void *args) {
     while (1) {
-        if ((recv_string_len =
-                     recvfrom(sock, recv_string, MAX_RECV_STRING, 0, NULL, 0)) < 0) {
-            fprintf(stderr, "Could not receive message!");
+        int payload_len;
+        uint32_t origin;
+        char *payload = receive_datagram(&payload_len, &origin);
+
+        if (!payload) {
             continue;
         }
 
-        if (recv_string == NULL) {
-            return 0;
-        }
+        printf("NETRWORK RECEIVED NEW: %s\n", payload);
+        handle_network_msg(payload);
+    }
+}
+
+void *receive_msg_enc(void *args) {
+    while (1) {
+        int payload_len, msg_len;
+        uint32_t origin;
+        char *payload = receive_datagram(&payload_len, &origin);
+        char *msg;
 
-        if (strlen(recv_string) <= 0) {
-            return 0;
+        if (!payload || !(msg = decode_msg(payload, payload_len, &msg_len))) {
+            continue;
         }
-        recv_string[recv_string_len] = '\0';
 
-        printf("NETRWORK RECEIVED NEW: %s\n", recv_string);
-        handle_network_msg(recv_string);
+        printf("NETRWORK RECEIVED: %s\n", msg);
+        handle_network_msg(msg);
     }
 }
 
-void *receive_msg_enc(void *args) {
+// Receive and reassemble, then hand the messages to the workers.
+// All messages of a sender go to the same worker, so their order is kept.
+void *receive_msg_dispatch(void *args) {
     while (1) {
-        if ((recv_string_len =
-                     recvfrom(sock, recv_string, MAX_RECV_STRING, 0, NULL, 0)) < 0) {
-            fprintf(stderr, "Could not receive message!");
+        int payload_len;
+        uint32_t origin;
+        char *payload = receive_datagram(&payload_len, &origin);
+
+        if (!payload) {
             continue;
         }
 
-        if (recv_string == NULL) {
-            return 0;
+        struct recv_item *item = recv_item_new(payload, payload_len);
+        if (!item) {
+            continue;
+        }
+
+        int w = hash_fnv1a(&origin, sizeof(origin)) % recv_workers;
+        pthread_mutex_lock(&recv_in_mutex[w]);
+        if (recv_queue_push(&recv_in[w], item)) {
+            free(item);
+        } else {
+            pthread_cond_signal(&recv_in_cond[w]);
+        }
+        pthread_mutex_unlock(&recv_in_mutex[w]);
+    }
+}
+
+// Decode and decrypt the messages of one input queue.
+void *receive_msg_worker(void *args) {
+    int w = (int) (long) args;
+
+    while (1) {
+        pthread_mutex_lock(&recv_in_mutex[w]);
+        while (!recv_in[w].head) {
+            pthread_cond_wait(&recv_in_cond[w], &recv_in_mutex[w]);
+        }
+        struct recv_item *item = recv_queue_pop(&recv_in[w]);
+        pthread_mutex_unlock(&recv_in_mutex[w]);
+
+        struct recv_item *out = item;
+        if (network_config.use_symm_enc) {
+            int msg_len;
+            char *msg = decode_msg(item->data, item->len, &msg_len);
+
+            out = msg ? recv_item_new(msg, msg_len) : NULL;
+            free(item);
+            if (!out) {
+                continue;
+            }
         }
 
-        if (strlen(recv_string) <= 0) {
-            return 0;
+        pthread_mutex_lock(&recv_out_mutex);
+        if (recv_queue_push(&recv_out[w], out)) {
+            free(out);
+        } else {
+            pthread_cond_signal(&recv_out_cond);
         }
-        recv_string[recv_string_len] = '\0';
+        pthread_mutex_unlock(&recv_out_mutex);
+    }
+}
 
-        char *base64_dec_str = malloc(B64_DECODE_LEN(strlen(recv_string)));
-        int base64_dec_length = b64_decode(recv_string, base64_dec_str, B64_DECODE_LEN(strlen(recv_string)));
-        char *dec = gcrypt_decrypt_msg(base64_dec_str, base64_dec_length);
+// Only thread that applies received messages, taking turns between the workers.
+void *receive_msg_handler(void *args) {
+    int next = 0;
 
-        printf("NETRWORK RECEIVED: %s\n", dec);
-        free(base64_dec_str);
-        handle_network_msg(dec);
-        free(dec);
+    while (1) {
+        struct recv_item *item = NULL;
+
+        pthread_mutex_lock(&recv_out_mutex);
+        while (!item) {
+            for (int i = 0; i < recv_workers && !item; i++) {
+                item = recv_queue_pop(&recv_out[(next + i) % recv_workers]);
+                if (item) {
+                    next = (next + i + 1) % recv_workers;
+                }
+            }
+            if (!item) {
+                pthread_cond_wait(&recv_out_cond, &recv_out_mutex);
+            }
+        }
+        pthread_mutex_unlock(&recv_out_mutex);
+
+        printf("NETRWORK RECEIVED: %s\n", item->data);
+        handle_network_msg(item->data);
+        free(item);
     }
 }
 
-int send_string(char *msg) {
-    pthread_mutex_lock(&send_mutex);
-    size_t msglen = strlen(msg);
+// Prefix the payload with the message header and send it, split into fragments if needed.
+static int send_datagram(const char *payload, size_t len) {
+    int frag_count = len ? (len + UDP_FRAG_PAYLOAD_LEN - 1) / UDP_FRAG_PAYLOAD_LEN : 1;
+
+    if (frag_count > UDP_MSG_MAX_FRAGS) {
+        fprintf(stderr, "Message of %zu bytes is too large!\n", len);
+        return -1;
+    }
 
-    if (sendto(sock,
-               msg,
-               msglen,
-               0,
-               (struct sockaddr *) &addr,
-               sizeof(addr)) < 0) {
-        perror("sendto()");
+    struct udp_msg_hdr hdr[UDP_MSG_MAX_FRAGS];
+    struct iovec iov[UDP_MSG_MAX_FRAGS][2];
+    struct msghdr msg[UDP_MSG_MAX_FRAGS];
+    uint32_t seq = htonl(dedup_next_seq(0));
+
+    // all fragments are prepared up front, so they can be sent as one batch
+    for (int i = 0; i < frag_count; i++) {
+        size_t off = (size_t) i * UDP_FRAG_PAYLOAD_LEN;
+
+        hdr[i] = (struct udp_msg_hdr) {
+                .magic = htons(UDP_MSG_MAGIC),
+                .version = UDP_MSG_VERSION,
+                .origin = htonl(node_id),
+                .seq = seq,
+                .frag_index = i,
+                .frag_count = frag_count,
+        };
+        iov[i][0].iov_base = &hdr[i];
+        iov[i][0].iov_len = sizeof(hdr[i]);
+        iov[i][1].iov_base = (void *) (payload + off);
+        iov[i][1].iov_len = len - off < UDP_FRAG_PAYLOAD_LEN ? len - off : UDP_FRAG_PAYLOAD_LEN;
+        msg[i] = (struct msghdr) {
+                .msg_name = &addr,
+                .msg_namelen = sizeof(addr),
+                .msg_iov = iov[i],
+                .msg_iovlen = 2,
+        };
+    }
+
+    pthread_mutex_lock(&send_mutex);
+#ifdef DAWN_IO_URING
+    if (use_uring) {
+        int ret = uring_socket_sendmsgs(msg, frag_count);
         pthread_mutex_unlock(&send_mutex);
-        exit(EXIT_FAILURE);
+        return ret;
+    }
+#endif
+    for (int i = 0; i < frag_count; i++) {
+        if (sendmsg(sock, &msg[i], 0) < 0) {
+            perror("sendmsg()");
+            pthread_mutex_unlock(&send_mutex);
+            exit(EXIT_FAILURE);
+        }
     }
     pthread_mutex_unlock(&send_mutex);
 
     return 0;
 }
 
+int send_string(char *msg) {
+    return send_datagram(msg, strlen(msg));
+}
+
 int send_string_enc(char *msg) {
-    pthread_mutex_lock(&send_mutex);
+    static __thread char *enc_buf, *base64_buf;
+    static __thread size_t enc_size, base64_size;
 
-    int length_enc;
     size_t msglen = strlen(msg);
-    char *enc = gcrypt_encrypt_msg(msg, msglen + 1, &length_enc);
-
-    char *base64_enc_str = malloc(B64_ENCODE_LEN(length_enc));
-    size_t base64_enc_length = b64_encode(enc, length_enc, base64_enc_str, B64_ENCODE_LEN(length_enc));
-
-    if (sendto(sock,
-               base64_enc_str,
-               base64_enc_length, // very important to use actual length of string because of '\0' in encrypted msg
-               0,
-               (struct sockaddr *) &addr,
-               sizeof(addr)) < 0) {
-        perror("sendto()");
-        pthread_mutex_unlock(&send_mutex);
-        exit(EXIT_FAILURE);
+    size_t enc_len = gcrypt_encrypt_len(msglen);
+
+    if (!reserve_buf(&enc_buf, &enc_size, enc_len) ||
+        !reserve_buf(&base64_buf, &base64_size, DAWN_B64_ENCODE_LEN(enc_len))) {
+        return -1;
     }
-    free(base64_enc_str);
-    free(enc);
-    pthread_mutex_unlock(&send_mutex);
-    return 0;
+
+    int length_enc = gcrypt_encrypt(msg, msglen, enc_buf, enc_size);
+    if (length_enc < 0) {
+        return -1;
+    }
+    int base64_enc_length = dawn_b64_encode(enc_buf, length_enc, base64_buf, base64_size);
+
+    // only the socket is shared, encryption runs outside of the lock
+    // very important to use actual length of string because of '\0' in encrypted msg
+    return send_datagram(base64_buf, base64_enc_length);
 }
 
 void close_socket() {
@@ -1,52 +1,843 @@
 #include <libubox/usock.h>
 #include <libubox/ustream.h>
 #include <libubox/uloop.h>
-#include <libubox/utils.h> // base64 encoding
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include "tcpsocket.h"
 #include <arpa/inet.h>
 #include "ubus.h"
 #include "crypto.h"
+#include "utils.h"
+#include "gossip.h"
+#include "dedup.h"
+#include "networksocket.h"
+#ifdef DAWN_IO_URING
+#include "uringsocket.h"
+#endif
 
 // based on:
 // https://github.com/xfguo/libubox/blob/master/examples/ustream-example.c
 
-int tcp_array_insert(struct network_con_s entry);
+int tcp_array_insert(struct network_con_s *entry);
 
-int tcp_array_delete(struct sockaddr_in entry);
+struct network_con_s *tcp_array_delete(struct sockaddr_in entry);
 
 int tcp_array_contains_address_help(struct sockaddr_in entry);
 
-void print_tcp_entry(struct network_con_s entry);
+struct network_con_s *tcp_array_get_entry(struct sockaddr_in entry);
+
+void print_tcp_entry(struct network_con_s *entry);
+
+static void tcp_con_connect(struct network_con_s *con);
+
+static void tcp_con_disconnect(struct network_con_s *con);
 
 int tcp_entry_last = -1;
 
+// Topics announced by the peers, keyed by the address of their inbound connection.
+struct tcp_subscription {
+    in_addr_t addr;
+    uint32_t node_id;
+    int num_topics;
+    uint32_t topics[TCP_MAX_TOPICS];
+};
+
+static struct tcp_subscription tcp_subscriptions[ARRAY_NETWORK_LEN];
+static int tcp_subscription_last = -1;
+
+// Node that sent the client table of a remote ap.
+struct tcp_bssid_owner {
+    uint8_t bssid_addr[ETH_ALEN];
+    uint32_t node_id;
+    time_t time;
+};
+
+static struct tcp_bssid_owner tcp_bssid_owners[TCP_MAX_BSSID_OWNERS];
+static int tcp_bssid_owner_last = -1;
+
 static struct uloop_fd server;
+
+#ifdef DAWN_IO_URING
+// the connected sockets are driven by io_uring, connecting and accepting stay on the uloop
+static int use_uring_tcp;
+#endif
 struct client *next_client = NULL;
 
 struct client {
     struct sockaddr_in sin;
 
     struct ustream_fd s;
+    struct tcp_rx_buf rx;
     int ctr;
     int counter;
 };
 
+static const char *tcp_con_state_str[] = {
+        [TCP_CON_DISCONNECTED] = "disconnected",
+        [TCP_CON_CONNECTING] = "connecting",
+        [TCP_CON_CONNECTED] = "connected",
+};
+
+static uint64_t tcp_time_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int tcp_heartbeat_ms() {
+    if (timeout_config.tcp_heartbeat > 0) {
+        return timeout_config.tcp_heartbeat * 1000;
+    }
+    return TCP_HEARTBEAT_DEFAULT * 1000;
+}
+
+// Write a frame, the length of the header is filled in.
+static int tcp_write_frame_hdr(struct ustream *s, struct tcp_frame_hdr *hdr, const char *payload, uint32_t len) {
+    hdr->len = htonl(len);
+
+    ustream_write(s, (char *) hdr, sizeof(*hdr), len > 0);
+    if (len > 0) {
+        ustream_write(s, payload, len, false);
+    }
+    return 0;
+}
+
+// Write a link local frame, these are not forwarded and carry no sequence number.
+static int tcp_write_frame(struct ustream *s, uint8_t type, const char *payload, uint32_t len) {
+    struct tcp_frame_hdr hdr = {
+            .type = type,
+            .origin = htonl(node_id),
+    };
+
+    return tcp_write_frame_hdr(s, &hdr, payload, len);
+}
+
+static const uint32_t tcp_queue_limit[TCP_MSG_CLASSES] = {
+        [TCP_MSG_BULK] = TCP_SEND_QUEUE_BULK_LIMIT,
+        [TCP_MSG_CONTROL] = TCP_SEND_QUEUE_CONTROL_LIMIT,
+};
+
+// Order in which the send queues are served.
+static const int tcp_queue_prio[TCP_MSG_CLASSES] = {TCP_MSG_CONTROL, TCP_MSG_BULK};
+
+static const char *tcp_msg_class_str[TCP_MSG_CLASSES] = {
+        [TCP_MSG_BULK] = "bulk",
+        [TCP_MSG_CONTROL] = "control",
+};
+
+static void tcp_con_drain(struct network_con_s *con);
+
+// Set up a connected socket as stream, the notify callbacks have to be set.
+static void tcp_stream_init(struct ustream_fd *s, int fd) {
+#ifdef DAWN_IO_URING
+    if (use_uring_tcp && uring_tcp_stream_init(&s->stream, fd) == 0) {
+        s->fd.fd = fd;
+        return;
+    }
+#endif
+    ustream_fd_init(s, fd);
+}
+
+// Build a frame once, it is referenced by the queue of every peer it goes to.
+static struct tcp_msg *tcp_msg_new(struct tcp_frame_hdr *hdr, const char *payload, uint32_t len) {
+    struct tcp_msg *m = malloc(sizeof(*m) + sizeof(*hdr) + len);
+
+    if (!m) {
+        return NULL;
+    }
+
+    hdr->len = htonl(len);
+    m->refs = 1;
+    m->len = sizeof(*hdr) + len;
+    memcpy(m->data, hdr, sizeof(*hdr));
+    memcpy(m->data + sizeof(*hdr), payload, len);
+    return m;
+}
+
+static void tcp_msg_unref(struct tcp_msg *m) {
+    if (--m->refs == 0) {
+        free(m);
+    }
+}
+
+static struct tcp_msg *tcp_queue_pop(struct tcp_send_queue *q) {
+    struct tcp_msg *m = q->slots[q->head];
+
+    q->head = (q->head + 1) % TCP_SEND_QUEUE_SLOTS;
+    q->count--;
+    q->bytes -= m->len;
+    return m;
+}
+
+static void tcp_queue_flush(struct tcp_send_queue *q) {
+    while (q->count) {
+        tcp_msg_unref(tcp_queue_pop(q));
+    }
+}
+
+// Start a fresh token bucket, the rate is given in KiB/s.
+static void tcp_queue_set_rate(struct tcp_send_queue *q, int rate) {
+    q->max_rate = rate > 0 ? rate * 1024 : 0;
+    q->rate = q->max_rate;
+    q->tokens = q->rate;
+    q->last_refill = tcp_time_ms();
+}
+
+static void tcp_queue_refill(struct tcp_send_queue *q, uint64_t now) {
+    int64_t add = (int64_t) q->rate * (int64_t) (now - q->last_refill) / 1000;
+
+    if (add <= 0) {
+        return;
+    }
+
+    // burst of at most one second
+    q->tokens += add;
+    if (q->tokens > q->rate) {
+        q->tokens = q->rate;
+    }
+    q->last_refill = now;
+}
+
+// Multiplicative decrease of the rate of a peer that does not keep up.
+static void tcp_queue_slow_down(struct tcp_send_queue *q, uint64_t now) {
+    if (!q->max_rate || now - q->last_decrease < TCP_BULK_RATE_DECREASE_INTERVAL) {
+        return;
+    }
+
+    q->rate /= 2;
+    if (q->rate < TCP_BULK_RATE_MIN) {
+        q->rate = TCP_BULK_RATE_MIN;
+    }
+    q->last_decrease = now;
+}
+
+// Additive increase up to the configured rate.
+static void tcp_queue_speed_up(struct tcp_send_queue *q) {
+    if (q->rate >= q->max_rate) {
+        return;
+    }
+
+    q->rate += q->max_rate / 16;
+    if (q->rate > q->max_rate) {
+        q->rate = q->max_rate;
+    }
+}
+
+// Queue a frame to a connected peer unless the send queue of its class is above the limit.
+static int tcp_con_queue_frame(struct network_con_s *con, struct tcp_msg *m, int msg_class) {
+    struct ustream *s = &con->s.stream;
+    struct tcp_send_queue *q = &con->queue[msg_class];
+
+    // connection is already being torn down by tcp_con_notify_state
+    if (s->write_error || s->eof) {
+        return -1;
+    }
+
+    // a slow peer must not hold back the others, a frame larger than the limit still gets an empty queue
+    if (q->count == TCP_SEND_QUEUE_SLOTS || (q->count && q->bytes + m->len > tcp_queue_limit[msg_class])) {
+        q->dropped++;
+
+        // the socket is backed up, so the peer is the bottleneck and not the token bucket
+        if (msg_class == TCP_MSG_BULK && s->w.data_bytes >= TCP_WRITE_LOW_WATER) {
+            tcp_queue_slow_down(q, tcp_time_ms());
+        }
+        return -1;
+    }
+
+    q->slots[(q->head + q->count) % TCP_SEND_QUEUE_SLOTS] = m;
+    q->count++;
+    q->bytes += m->len;
+    m->refs++;
+
+    tcp_con_drain(con);
+    return 0;
+}
+
+// Hand queued frames to the socket, highest priority first, as far as the buckets allow.
+static void tcp_con_drain(struct network_con_s *con) {
+    struct ustream *s = &con->s.stream;
+    uint64_t now = tcp_time_ms();
+    int wait = 0;
+
+    if (con->state != TCP_CON_CONNECTED) {
+        return;
+    }
+
+    while (!s->write_error && !s->eof && s->w.data_bytes < TCP_WRITE_LOW_WATER) {
+        struct tcp_send_queue *q = NULL;
+
+        for (int i = 0; i < TCP_MSG_CLASSES && !q; i++) {
+            struct tcp_send_queue *c = &con->queue[tcp_queue_prio[i]];
+
+            if (!c->count) {
+                continue;
+            }
+
+            if (c->rate) {
+                tcp_queue_refill(c, now);
+                if (c->tokens <= 0) {
+                    int ms = (int) (-c->tokens * 1000 / c->rate) + 1;
+
+                    if (!wait || ms < wait) {
+                        wait = ms;
+                    }
+                    c->throttled++;
+                    continue;
+                }
+            }
+            q = c;
+        }
+
+        if (!q) {
+            break;
+        }
+
+        // the bucket may go negative, so frames larger than the burst are still sent
+        struct tcp_msg *m = tcp_queue_pop(q);
+        ustream_write(s, m->data, m->len, false);
+        if (q->rate) {
+            q->tokens -= m->len;
+        }
+        q->sent++;
+        tcp_msg_unref(m);
+    }
+
+    if (wait) {
+        uloop_timeout_set(&con->drain_timer, wait);
+    }
+}
+
+static void tcp_con_drain_cb(struct uloop_timeout *t) {
+    struct network_con_s *con = container_of(t,
+    struct network_con_s, drain_timer);
+
+    tcp_con_drain(con);
+}
+
+static struct tcp_subscription *tcp_subscription_get(in_addr_t addr) {
+    for (int i = 0; i <= tcp_subscription_last; i++) {
+        if (tcp_subscriptions[i].addr == addr) {
+            return &tcp_subscriptions[i];
+        }
+    }
+    return NULL;
+}
+
+static struct tcp_subscription *tcp_subscription_add(in_addr_t addr) {
+    struct tcp_subscription *sub = tcp_subscription_get(addr);
+
+    if (!sub) {
+        if (tcp_subscription_last + 1 >= ARRAY_NETWORK_LEN) {
+            return NULL;
+        }
+        sub = &tcp_subscriptions[++tcp_subscription_last];
+        memset(sub, 0, sizeof(*sub));
+        sub->addr = addr;
+    }
+    return sub;
+}
+
+static void tcp_subscription_set(in_addr_t addr, uint32_t *topics, int num_topics) {
+    struct tcp_subscription *sub = tcp_subscription_add(addr);
+
+    if (sub) {
+        sub->num_topics = num_topics;
+        memcpy(sub->topics, topics, num_topics * sizeof(uint32_t));
+    }
+}
+
+// Link local frames tell which node is behind an address.
+static void tcp_subscription_set_node(in_addr_t addr, uint32_t node) {
+    struct tcp_subscription *sub = tcp_subscription_add(addr);
+
+    if (sub) {
+        sub->node_id = node;
+    }
+}
+
+static int tcp_node_addr(uint32_t node, in_addr_t *addr) {
+    for (int i = 0; i <= tcp_subscription_last; i++) {
+        if (tcp_subscriptions[i].node_id == node) {
+            *addr = tcp_subscriptions[i].addr;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void tcp_subscription_remove(in_addr_t addr) {
+    struct tcp_subscription *sub = tcp_subscription_get(addr);
+
+    if (sub) {
+        *sub = tcp_subscriptions[tcp_subscription_last--];
+    }
+}
+
+// Peers that did not announce their topics yet get everything.
+static int tcp_con_subscribed(struct network_con_s *con, uint32_t topic) {
+    struct tcp_subscription *sub;
+
+    if (!topic || network_config.ssid_subscriptions <= 0) {
+        return 1;
+    }
+
+    // a peer without interfaces does not know yet what it needs
+    sub = tcp_subscription_get(con->sock_addr.sin_addr.s_addr);
+    if (!sub || sub->num_topics == 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < sub->num_topics; i++) {
+        if (sub->topics[i] == topic) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void tcp_con_send_topics(struct network_con_s *con) {
+    uint32_t topics[TCP_MAX_TOPICS];
+    int num_topics = get_local_ssid_topics(topics, TCP_MAX_TOPICS);
+
+    for (int i = 0; i < num_topics; i++) {
+        topics[i] = htonl(topics[i]);
+    }
+    tcp_write_frame(&con->s.stream, TCP_FRAME_SUBSCRIBE, (char *) topics, num_topics * sizeof(uint32_t));
+}
+
+// Send a gossip frame to a random subset of the connected peers, skipping the one it came from.
+static void tcp_gossip_send(struct tcp_frame_hdr *hdr, const char *payload, uint32_t len, in_addr_t from) {
+    uint32_t topic = ntohl(hdr->topic);
+    int candidates[ARRAY_NETWORK_LEN];
+    int n = 0;
+
+    pthread_mutex_lock(&tcp_array_mutex);
+    for (int i = 0; i <= tcp_entry_last; i++) {
+        if (network_array[i]->state == TCP_CON_CONNECTED && network_array[i]->sock_addr.sin_addr.s_addr != from &&
+            tcp_con_subscribed(network_array[i], topic)) {
+            candidates[n++] = i;
+        }
+    }
+
+    n = gossip_select(candidates, n, network_config.gossip_fanout);
+    struct tcp_msg *m = n > 0 ? tcp_msg_new(hdr, payload, len) : NULL;
+    if (m) {
+        for (int i = 0; i < n; i++) {
+            tcp_con_queue_frame(network_array[candidates[i]], m, TCP_MSG_BULK);
+        }
+        tcp_msg_unref(m);
+    }
+    pthread_mutex_unlock(&tcp_array_mutex);
+}
+
+// Move everything readable into the rx buffer and hand out complete frames.
+// Returns -1 if the peer violates the framing.
+static int tcp_read_frames(struct ustream *s, struct tcp_rx_buf *rx,
+                           void (*handle)(struct ustream *s, struct tcp_frame_hdr *hdr, char *payload,
+                                          uint32_t len)) {
+    char *buf;
+    int len;
+
+    while ((buf = ustream_get_read_buf(s, &len))) {
+        // one spare byte to terminate a payload in place
+        int needed = rx->len + len + 1;
+        if (needed > rx->size) {
+            if (needed > 2 * (TCP_FRAME_MAX_LEN + (int) sizeof(struct tcp_frame_hdr))) {
+                return -1;
+            }
+            char *tmp = realloc(rx->data, needed);
+            if (!tmp) {
+                return -1;
+            }
+            rx->data = tmp;
+            rx->size = needed;
+        }
+        memcpy(rx->data + rx->len, buf, len);
+        rx->len += len;
+        ustream_consume(s, len);
+
+        int off = 0;
+        while (rx->len - off >= (int) sizeof(struct tcp_frame_hdr)) {
+            struct tcp_frame_hdr hdr;
+            memcpy(&hdr, rx->data + off, sizeof(hdr));
+
+            uint32_t frame_len = ntohl(hdr.len);
+            if (frame_len > TCP_FRAME_MAX_LEN) {
+                return -1;
+            }
+            if (rx->len - off - sizeof(hdr) < frame_len) {
+                break;
+            }
+
+            char *payload = rx->data + off + sizeof(hdr);
+            char saved = payload[frame_len];
+            payload[frame_len] = '\0';
+            handle(s, &hdr, payload, frame_len);
+            payload[frame_len] = saved;
+
+            off += sizeof(hdr) + frame_len;
+        }
+
+        memmove(rx->data, rx->data + off, rx->len - off);
+        rx->len -= off;
+    }
+    return 0;
+}
+
+// Encrypt a message for the wire if configured. Returns the length or -1.
+static int tcp_encode_msg(char *msg, char **out) {
+    static char *enc_buf;
+    static size_t enc_size;
+    int out_len = strlen(msg);
+
+    *out = msg;
+    if (network_config.use_symm_enc) {
+        if (!reserve_buf(&enc_buf, &enc_size, gcrypt_encrypt_len(out_len))) {
+            return -1;
+        }
+        out_len = gcrypt_encrypt(msg, out_len, enc_buf, enc_size);
+        *out = enc_buf;
+    }
+
+    if (out_len > TCP_FRAME_MAX_LEN) {
+        fprintf(stderr, "TCP message of %d bytes is too large!\n", out_len);
+        return -1;
+    }
+    return out_len;
+}
+
+// Write a data frame to a single stream, bypassing the queue limits. Returns 0 or -1.
+static int tcp_write_msg(struct ustream *s, char *msg) {
+    char *out;
+    int out_len = tcp_encode_msg(msg, &out);
+
+    if (out_len < 0 || s->write_error || s->eof) {
+        return -1;
+    }
+
+    // only meant for this peer and never forwarded, so it needs no sequence number and
+    // can not push the window of a class past frames still waiting in the queue
+    struct tcp_frame_hdr hdr = {
+            .type = TCP_FRAME_DATA,
+            .msg_class = TCP_MSG_CONTROL,
+            .origin = htonl(node_id),
+    };
+    tcp_write_frame_hdr(s, &hdr, out, out_len);
+    return 0;
+}
+
+// Stream the data frame currently handled arrived on.
+static struct ustream *tcp_ingress;
+// Node that created the message currently handled.
+static uint32_t tcp_ingress_origin;
+
+// Frames are handled on the uloop thread only, so one buffer is enough.
+static char *tcp_dec_buf;
+static size_t tcp_dec_size;
+
+static void tcp_handle_data(char *payload, uint32_t len) {
+    if (network_config.use_symm_enc) {
+        // ciphertext is carried binary, no base64 on the TCP transport
+        if (!reserve_buf(&tcp_dec_buf, &tcp_dec_size, len + 1) ||
+            gcrypt_decrypt(payload, len, tcp_dec_buf, tcp_dec_size) < 0) {
+            fprintf(stderr, "Dropping TCP message that can not be decrypted!\n");
+            return;
+        }
+
+        printf("NETRWORK RECEIVED: %s\n", tcp_dec_buf);
+        handle_network_msg(tcp_dec_buf);
+    } else {
+        handle_network_msg(payload);
+    }
+}
+
+static void tcp_handle_gossip(in_addr_t from, struct tcp_frame_hdr *hdr, char *payload, uint32_t len) {
+    // forward first, the payload is passed on as received
+    if (hdr->ttl > 1) {
+        struct tcp_frame_hdr fwd = *hdr;
+
+        fwd.ttl--;
+        tcp_gossip_send(&fwd, payload, len, from);
+    }
+
+    tcp_ingress_origin = ntohl(hdr->origin);
+    tcp_handle_data(payload, len);
+    tcp_ingress_origin = 0;
+}
+
+static void tcp_rx_free(struct tcp_rx_buf *rx) {
+    free(rx->data);
+    rx->data = NULL;
+    rx->len = rx->size = 0;
+}
+
+static void tcp_con_free(struct network_con_s *con) {
+    if (!con) {
+        return;
+    }
+
+    uloop_timeout_cancel(&con->timer);
+    uloop_timeout_cancel(&con->drain_timer);
+    for (int i = 0; i < TCP_MSG_CLASSES; i++) {
+        tcp_queue_flush(&con->queue[i]);
+    }
+    if (con->state == TCP_CON_CONNECTING) {
+        uloop_fd_delete(&con->connect_fd);
+    } else if (con->state == TCP_CON_CONNECTED) {
+        ustream_free(&con->s.stream);
+    }
+    if (con->sockfd >= 0) {
+        close(con->sockfd);
+    }
+    tcp_rx_free(&con->rx);
+    free(con);
+}
+
+static void tcp_con_handle_frame(struct ustream *s, struct tcp_frame_hdr *hdr, char *payload, uint32_t len) {
+    struct network_con_s *con = container_of(s,
+    struct network_con_s, s.stream);
+
+    switch (hdr->type) {
+        case TCP_FRAME_PONG: {
+            uint64_t sent;
+            if (len != sizeof(sent)) {
+                break;
+            }
+            memcpy(&sent, payload, sizeof(sent));
+
+            con->pongs_received++;
+            con->pings_unanswered = 0;
+            con->rtt = (uint32_t) (tcp_time_ms() - sent);
+            con->srtt = con->srtt ? (7 * con->srtt + con->rtt) / 8 : con->rtt;
+
+            // peer answers, so the connection is healthy again
+            con->backoff = 0;
+            break;
+        }
+        case TCP_FRAME_DATA:
+            if (!dedup_check(ntohl(hdr->origin), hdr->msg_class, ntohl(hdr->seq))) {
+                tcp_handle_data(payload, len);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void tcp_con_read_cb(struct ustream *s, int bytes) {
+    struct network_con_s *con = container_of(s,
+    struct network_con_s, s.stream);
+
+    if (tcp_read_frames(s, &con->rx, tcp_con_handle_frame) < 0) {
+        fprintf(stderr, "Invalid frame from %s\n", inet_ntoa(con->sock_addr.sin_addr));
+        tcp_con_disconnect(con);
+    }
+}
+
+static void tcp_con_notify_state(struct ustream *s) {
+    struct network_con_s *con = container_of(s,
+    struct network_con_s, s.stream);
+
+    if (!s->write_error && !s->eof)
+        return;
+
+    printf("Removing bad TCP connection!\n");
+    tcp_con_disconnect(con);
+}
+
+static void tcp_con_notify_write(struct ustream *s, int bytes) {
+    struct network_con_s *con = container_of(s,
+    struct network_con_s, s.stream);
+    struct tcp_send_queue *bulk = &con->queue[TCP_MSG_BULK];
+
+    // peer caught up, probe whether it takes more state updates
+    if (s->w.data_bytes == 0 && !bulk->count) {
+        tcp_queue_speed_up(bulk);
+    }
+
+    tcp_con_drain(con);
+}
+
+static void tcp_con_send_ping(struct network_con_s *con) {
+    uint64_t now = tcp_time_ms();
+
+    if (con->pings_unanswered > 0) {
+        con->pings_lost++;
+    }
+
+    con->pings_sent++;
+    con->pings_unanswered++;
+    tcp_write_frame(&con->s.stream, TCP_FRAME_PING, (char *) &now, sizeof(now));
+}
+
+static void tcp_con_request_sync(struct network_con_s *con) {
+    static struct blob_buf b_sync;
+
+    printf("Requesting state from %s\n", inet_ntoa(con->sock_addr.sin_addr));
+
+    build_sync_digest(&b_sync);
+    char *str = build_network_msg(b_sync.head, "syncreq");
+    tcp_write_msg(&con->s.stream, str);
+    free(str);
+}
+
+static void tcp_con_connected(struct network_con_s *con) {
+    uloop_fd_delete(&con->connect_fd);
+
+    con->state = TCP_CON_CONNECTED;
+    con->pings_unanswered = 0;
+    con->rx.len = 0;
+
+    memset(&con->s, 0, sizeof(con->s));
+    con->s.stream.notify_read = tcp_con_read_cb;
+    con->s.stream.notify_state = tcp_con_notify_state;
+    con->s.stream.notify_write = tcp_con_notify_write;
+    tcp_stream_init(&con->s, con->sockfd);
+
+    tcp_queue_set_rate(&con->queue[TCP_MSG_BULK], network_config.peer_bulk_rate);
+    tcp_queue_set_rate(&con->queue[TCP_MSG_CONTROL], network_config.peer_control_rate);
+
+    printf("TCP connection to %s established\n", inet_ntoa(con->sock_addr.sin_addr));
+
+    tcp_con_send_topics(con);
+    tcp_con_send_ping(con);
+    uloop_timeout_set(&con->timer, tcp_heartbeat_ms());
+
+    // first peer after startup or after being cut off, catch up with its state
+    int connected = 0;
+    pthread_mutex_lock(&tcp_array_mutex);
+    for (int i = 0; i <= tcp_entry_last; i++) {
+        connected += network_array[i]->state == TCP_CON_CONNECTED;
+    }
+    pthread_mutex_unlock(&tcp_array_mutex);
+
+    if (connected == 1) {
+        tcp_con_request_sync(con);
+    }
+}
+
+static void tcp_con_connect_cb(struct uloop_fd *fd, unsigned int events) {
+    struct network_con_s *con = container_of(fd,
+    struct network_con_s, connect_fd);
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+
+    if (getsockopt(con->sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) {
+        err = errno;
+    }
+
+    if (err || fd->error) {
+        fprintf(stderr, "TCP connection to %s failed: %s\n", inet_ntoa(con->sock_addr.sin_addr),
+                strerror(err));
+        con->connect_failures++;
+        tcp_con_disconnect(con);
+        return;
+    }
+
+    tcp_con_connected(con);
+}
+
+static void tcp_con_connect(struct network_con_s *con) {
+    char port_str[12];
+    sprintf(port_str, "%d", ntohs(con->sock_addr.sin_port));
+
+    con->connect_attempts++;
+    con->sockfd = usock(USOCK_TCP | USOCK_NONBLOCK | USOCK_NUMERIC, inet_ntoa(con->sock_addr.sin_addr), port_str);
+    if (con->sockfd < 0) {
+        con->connect_failures++;
+        tcp_con_disconnect(con);
+        return;
+    }
+
+    con->state = TCP_CON_CONNECTING;
+    con->connect_fd.fd = con->sockfd;
+    con->connect_fd.cb = tcp_con_connect_cb;
+    uloop_fd_add(&con->connect_fd, ULOOP_WRITE);
+    uloop_timeout_set(&con->timer, TCP_CONNECT_TIMEOUT);
+}
+
+// Close the socket and schedule the next connection attempt.
+static void tcp_con_disconnect(struct network_con_s *con) {
+    if (con->state == TCP_CON_CONNECTING) {
+        uloop_fd_delete(&con->connect_fd);
+    } else if (con->state == TCP_CON_CONNECTED) {
+        ustream_free(&con->s.stream);
+        con->disconnects++;
+    }
+    if (con->sockfd >= 0) {
+        close(con->sockfd);
+        con->sockfd = -1;
+    }
+
+    // queued state is outdated once the peer is back, it catches up via sync
+    uloop_timeout_cancel(&con->drain_timer);
+    for (int i = 0; i < TCP_MSG_CLASSES; i++) {
+        tcp_queue_flush(&con->queue[i]);
+    }
+
+    con->state = TCP_CON_DISCONNECTED;
+
+    if (con->backoff < TCP_BACKOFF_MIN) {
+        con->backoff = TCP_BACKOFF_MIN;
+    } else if (con->backoff < TCP_BACKOFF_MAX) {
+        con->backoff *= 2;
+        if (con->backoff > TCP_BACKOFF_MAX) {
+            con->backoff = TCP_BACKOFF_MAX;
+        }
+    }
+
+    // spread reconnects of peers that failed at the same time
+    uloop_timeout_set(&con->timer, con->backoff + rand() % (con->backoff / 4 + 1));
+}
+
+static void tcp_con_timer_cb(struct uloop_timeout *t) {
+    struct network_con_s *con = container_of(t,
+    struct network_con_s, timer);
+
+    switch (con->state) {
+        case TCP_CON_DISCONNECTED:
+            if (con->last_seen < time(0) - TCP_PEER_EXPIRE) {
+                printf("Forgetting TCP peer %s\n", inet_ntoa(con->sock_addr.sin_addr));
+                pthread_mutex_lock(&tcp_array_mutex);
+                tcp_array_delete(con->sock_addr);
+                pthread_mutex_unlock(&tcp_array_mutex);
+                tcp_con_free(con);
+                return;
+            }
+            tcp_con_connect(con);
+            break;
+        case TCP_CON_CONNECTING:
+            fprintf(stderr, "TCP connection to %s timed out\n", inet_ntoa(con->sock_addr.sin_addr));
+            con->connect_failures++;
+            tcp_con_disconnect(con);
+            break;
+        case TCP_CON_CONNECTED:
+            if (con->pings_unanswered >= TCP_HEARTBEAT_MISS) {
+                fprintf(stderr, "TCP peer %s stopped answering\n", inet_ntoa(con->sock_addr.sin_addr));
+                tcp_con_disconnect(con);
+                break;
+            }
+            tcp_con_send_ping(con);
+            uloop_timeout_set(&con->timer, tcp_heartbeat_ms());
+            break;
+        default:
+            break;
+    }
+}
+
 static void client_close(struct ustream *s) {
     struct client *cl = container_of(s,
     struct client, s.stream);
 
     fprintf(stderr, "Connection closed\n");
+    tcp_subscription_remove(cl->sin.sin_addr.s_addr);
     ustream_free(s);
     close(cl->s.fd.fd);
-
-    // remove from tcp array
-    pthread_mutex_lock(&tcp_array_mutex);
-    tcp_array_delete(cl->sin);
-    pthread_mutex_unlock(&tcp_array_mutex);
+    tcp_rx_free(&cl->rx);
 
     free(cl);
 }
@@ -59,48 +850,66 @@ static void client_notify_state(struct ustream *s) {
     struct client *cl = container_of(s,
     struct client, s.stream);
 
-    if (!s->eof)
+    if (!s->eof && !s->write_error)
         return;
 
     fprintf(stderr, "eof!, pending: %d, total: %d\n", s->w.data_bytes, cl->ctr);
 
-    // TODO: REMOVE CLIENT FROM LIST! OR NOT?
-    if (!s->w.data_bytes)
+    if (!s->w.data_bytes || s->write_error)
         return client_close(s);
 
 }
 
-static void client_read_cb(struct ustream *s, int bytes) {
-    char *str;
-    int len;
+static void client_handle_frame(struct ustream *s, struct tcp_frame_hdr *hdr, char *payload, uint32_t len) {
+    struct client *cl = container_of(s,
+    struct client, s.stream);
 
-    do {
-        str = ustream_get_read_buf(s, &len);
-        if (!str)
+    switch (hdr->type) {
+        case TCP_FRAME_PING:
+            tcp_subscription_set_node(cl->sin.sin_addr.s_addr, ntohl(hdr->origin));
+            tcp_write_frame(s, TCP_FRAME_PONG, payload, len);
             break;
+        case TCP_FRAME_DATA:
+            if (!dedup_check(ntohl(hdr->origin), hdr->msg_class, ntohl(hdr->seq))) {
+                tcp_ingress = s;
+                tcp_ingress_origin = ntohl(hdr->origin);
+                tcp_handle_data(payload, len);
+                tcp_ingress = NULL;
+                tcp_ingress_origin = 0;
+            }
+            break;
+        case TCP_FRAME_GOSSIP:
+            if (!dedup_check(ntohl(hdr->origin), hdr->msg_class, ntohl(hdr->seq))) {
+                tcp_handle_gossip(cl->sin.sin_addr.s_addr, hdr, payload, len);
+            }
+            break;
+        case TCP_FRAME_SUBSCRIBE: {
+            uint32_t topics[TCP_MAX_TOPICS];
+            int num_topics = len / sizeof(uint32_t);
 
-        //printf("RECEIVED String: %s\n", str);
-
-        if (network_config.use_symm_enc) {
-            char *base64_dec_str = malloc(B64_DECODE_LEN(strlen(str)));
-            int base64_dec_length = b64_decode(str, base64_dec_str, B64_DECODE_LEN(strlen(str)));
-            char *dec = gcrypt_decrypt_msg(base64_dec_str, base64_dec_length);
-
-            printf("NETRWORK RECEIVED: %s\n", dec);
-            free(base64_dec_str);
-            handle_network_msg(dec);
-            free(dec);
-        } else {
-            handle_network_msg(str);
+            if (num_topics > TCP_MAX_TOPICS) {
+                num_topics = TCP_MAX_TOPICS;
+            }
+            memcpy(topics, payload, num_topics * sizeof(uint32_t));
+            for (int i = 0; i < num_topics; i++) {
+                topics[i] = ntohl(topics[i]);
+            }
+            tcp_subscription_set(cl->sin.sin_addr.s_addr, topics, num_topics);
+            tcp_subscription_set_node(cl->sin.sin_addr.s_addr, ntohl(hdr->origin));
+            break;
         }
+        default:
+            break;
+    }
+}
 
-        ustream_consume(s, len);
-
-    } while (1);
+static void client_read_cb(struct ustream *s, int bytes) {
+    struct client *cl = container_of(s,
+    struct client, s.stream);
 
-    if (s->w.data_bytes > 256 && !ustream_read_blocked(s)) {
-        fprintf(stderr, "Block read, bytes: %d\n", s->w.data_bytes);
-        ustream_set_read_blocked(s, true);
+    if (tcp_read_frames(s, &cl->rx, client_handle_frame) < 0) {
+        fprintf(stderr, "Invalid frame from %s\n", inet_ntoa(cl->sin.sin_addr));
+        client_close(s);
     }
 }
 
@@ -119,11 +928,10 @@ static void server_cb(struct uloop_fd *fd, unsigned int events) {
         return;
     }
 
-    cl->s.stream.string_data = 1;
     cl->s.stream.notify_read = client_read_cb;
     cl->s.stream.notify_state = client_notify_state;
     cl->s.stream.notify_write = client_notify_write;
-    ustream_fd_init(&cl->s, sfd);
+    tcp_stream_init(&cl->s, sfd);
     next_client = NULL;
     fprintf(stderr, "New connection\n");
 }
@@ -141,45 +949,53 @@ int run_server(int port) {
 
     uloop_fd_add(&server, ULOOP_READ);
 
+#ifdef DAWN_IO_URING
+    use_uring_tcp = uring_tcp_init() == 0;
+#endif
+
     return 0;
 }
 
 int add_tcp_conncection(char *ipv4, int port) {
-    //int sockfd;
     struct sockaddr_in serv_addr;
 
-    char port_str[12];
-    sprintf(port_str, "%d", port);
-
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = inet_addr(ipv4);
     serv_addr.sin_port = htons(port);
 
-    print_tcp_array();
+    // umdns only refreshes known peers, reconnecting is up to the connection manager
+    pthread_mutex_lock(&tcp_array_mutex);
+    struct network_con_s *known = tcp_array_get_entry(serv_addr);
+    if (known) {
+        known->last_seen = time(0);
+    }
+    pthread_mutex_unlock(&tcp_array_mutex);
 
-    if (tcp_array_contains_address(serv_addr)) {
+    if (known) {
         return 0;
     }
 
-    int sockfd = usock(USOCK_TCP | USOCK_NONBLOCK, ipv4, port_str);
-    struct network_con_s tmp =
-            {
-                    .sock_addr = serv_addr,
-                    .sockfd = sockfd
-            };
-    //tmp.s.fd.fd = usock(USOCK_TCP | USOCK_NONBLOCK, ipv4, port_str);
-    //uloop_fd_add(&tmp.s.fd, ULOOP_WRITE);
-    //tmp.sockfd = tmp.s.fd.fd;
+    struct network_con_s *con = calloc(1, sizeof(struct network_con_s));
+    con->sock_addr = serv_addr;
+    con->sockfd = -1;
+    con->state = TCP_CON_DISCONNECTED;
+    con->last_seen = time(0);
+    con->timer.cb = tcp_con_timer_cb;
+    con->drain_timer.cb = tcp_con_drain_cb;
 
-    insert_to_tcp_array(tmp);
+    if (!insert_to_tcp_array(con)) {
+        tcp_con_free(con);
+        return 0;
+    }
 
-    printf("NEW TCP CONNECTION!!! to %s:%d\n", ipv4, port);
+    printf("NEW TCP PEER!!! %s:%d\n", ipv4, port);
+    tcp_con_connect(con);
 
     return 0;
 }
 
-int insert_to_tcp_array(struct network_con_s entry) {
+int insert_to_tcp_array(struct network_con_s *entry) {
     pthread_mutex_lock(&tcp_array_mutex);
 
     int ret = tcp_array_insert(entry);
@@ -188,53 +1004,199 @@ int insert_to_tcp_array(struct network_con_s entry) {
     return ret;
 }
 
-void print_tcp_entry(struct network_con_s entry) {
-    printf("Conenctin to Port: %d\n", entry.sock_addr.sin_port);
+void print_tcp_entry(struct network_con_s *entry) {
+    printf("Conenctin to %s:%d, state: %s, srtt: %u, queued: %u/%u, dropped: %u/%u\n",
+           inet_ntoa(entry->sock_addr.sin_addr), ntohs(entry->sock_addr.sin_port),
+           tcp_con_state_str[entry->state], entry->srtt,
+           entry->queue[TCP_MSG_CONTROL].bytes, entry->queue[TCP_MSG_BULK].bytes,
+           entry->queue[TCP_MSG_CONTROL].dropped, entry->queue[TCP_MSG_BULK].dropped);
 }
 
-void send_tcp(char *msg) {
+void send_tcp(char *msg, int msg_class, uint32_t topic) {
+    char *out;
+    int out_len = tcp_encode_msg(msg, &out);
+
+    if (out_len < 0) {
+        return;
+    }
+
+    struct tcp_frame_hdr hdr = {
+            .type = TCP_FRAME_DATA,
+            .msg_class = msg_class,
+            .topic = htonl(topic),
+            .origin = htonl(node_id),
+            .seq = htonl(dedup_next_seq(msg_class)),
+    };
+
+    // state updates are spread via gossip, control messages still go to every peer
+    if (msg_class == TCP_MSG_BULK && network_config.gossip_fanout > 0) {
+        hdr.type = TCP_FRAME_GOSSIP;
+        hdr.ttl = gossip_ttl();
+        tcp_gossip_send(&hdr, out, out_len, INADDR_NONE);
+        return;
+    }
+
+    struct tcp_msg *m = tcp_msg_new(&hdr, out, out_len);
+    if (!m) {
+        return;
+    }
+
     pthread_mutex_lock(&tcp_array_mutex);
+    for (int i = 0; i <= tcp_entry_last; i++) {
+        if (network_array[i]->state == TCP_CON_CONNECTED && tcp_con_subscribed(network_array[i], topic)) {
+            tcp_con_queue_frame(network_array[i], m, msg_class);
+        }
+    }
+    pthread_mutex_unlock(&tcp_array_mutex);
+    tcp_msg_unref(m);
+}
 
-    if (network_config.use_symm_enc) {
-        int length_enc;
-        size_t msglen = strlen(msg);
-        char *enc = gcrypt_encrypt_msg(msg, msglen + 1, &length_enc);
-
-        char *base64_enc_str = malloc(B64_ENCODE_LEN(length_enc));
-        size_t base64_enc_length = b64_encode(enc, length_enc, base64_enc_str, B64_ENCODE_LEN(length_enc));
-
-        for (int i = 0; i <= tcp_entry_last; i++) {
-            if (send(network_array[i].sockfd, base64_enc_str, base64_enc_length, 0) < 0) {
-                close(network_array->sockfd);
-                printf("Removing bad TCP connection!\n");
-                for (int j = i; j < tcp_entry_last; j++) {
-                    network_array[j] = network_array[j + 1];
-                }
+static struct tcp_bssid_owner *tcp_bssid_owner_get(uint8_t bssid_addr[]) {
+    for (int i = 0; i <= tcp_bssid_owner_last; i++) {
+        if (mac_is_equal(tcp_bssid_owners[i].bssid_addr, bssid_addr)) {
+            return &tcp_bssid_owners[i];
+        }
+    }
+    return NULL;
+}
+
+void tcp_set_bssid_owner(uint8_t bssid_addr[]) {
+    struct tcp_bssid_owner *owner;
+
+    if (!tcp_ingress_origin) {
+        return;
+    }
 
-                if (tcp_entry_last > -1) {
-                    tcp_entry_last--;
+    owner = tcp_bssid_owner_get(bssid_addr);
+    if (!owner) {
+        if (tcp_bssid_owner_last + 1 < TCP_MAX_BSSID_OWNERS) {
+            owner = &tcp_bssid_owners[++tcp_bssid_owner_last];
+        } else {
+            // replace the entry that was not refreshed for the longest time
+            owner = &tcp_bssid_owners[0];
+            for (int i = 1; i <= tcp_bssid_owner_last; i++) {
+                if (tcp_bssid_owners[i].time < owner->time) {
+                    owner = &tcp_bssid_owners[i];
                 }
             }
         }
-        free(base64_enc_str);
-        free(enc);
-    } else {
-        for (int i = 0; i <= tcp_entry_last; i++) {
-            if (send(network_array[i].sockfd, msg, strlen(msg), 0) < 0) {
-                close(network_array->sockfd);
-                printf("Removing bad TCP connection!\n");
-                for (int j = i; j < tcp_entry_last; j++) {
-                    network_array[j] = network_array[j + 1];
-                }
+        memcpy(owner->bssid_addr, bssid_addr, ETH_ALEN);
+    }
 
-                if (tcp_entry_last > -1) {
-                    tcp_entry_last--;
-                }
-            }
+    owner->node_id = tcp_ingress_origin;
+    owner->time = time(0);
+}
+
+int send_tcp_directed(char *msg, int msg_class, uint8_t bssids[][ETH_ALEN], int num_bssids) {
+    in_addr_t targets[ARRAY_NETWORK_LEN];
+    int num_targets = 0;
+    int sent = 0;
+
+    for (int i = 0; i < num_bssids; i++) {
+        struct tcp_bssid_owner *owner = tcp_bssid_owner_get(bssids[i]);
+        in_addr_t addr;
+        int known = 0;
+
+        if (!owner || owner->time < time(0) - TCP_PEER_EXPIRE || !tcp_node_addr(owner->node_id, &addr)) {
+            continue;
+        }
+        for (int j = 0; j < num_targets; j++) {
+            known |= targets[j] == addr;
+        }
+        if (!known && num_targets < ARRAY_NETWORK_LEN) {
+            targets[num_targets++] = addr;
         }
     }
 
+    if (!num_targets) {
+        return 0;
+    }
+
+    char *out;
+    int out_len = tcp_encode_msg(msg, &out);
+    if (out_len < 0) {
+        return 0;
+    }
+
+    struct tcp_frame_hdr hdr = {
+            .type = TCP_FRAME_DATA,
+            .msg_class = msg_class,
+            .origin = htonl(node_id),
+            .seq = htonl(dedup_next_seq(msg_class)),
+    };
+    struct tcp_msg *m = tcp_msg_new(&hdr, out, out_len);
+    if (!m) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&tcp_array_mutex);
+    for (int i = 0; i < num_targets; i++) {
+        struct sockaddr_in target = {.sin_addr.s_addr = targets[i]};
+        struct network_con_s *con = tcp_array_get_entry(target);
+
+        if (con && con->state == TCP_CON_CONNECTED && tcp_con_queue_frame(con, m, msg_class) == 0) {
+            sent++;
+        }
+    }
     pthread_mutex_unlock(&tcp_array_mutex);
+    tcp_msg_unref(m);
+
+    return sent;
+}
+
+int send_tcp_reply(char *msg) {
+    return tcp_ingress ? tcp_write_msg(tcp_ingress, msg) : -1;
+}
+
+void tcp_announce_topics() {
+    pthread_mutex_lock(&tcp_array_mutex);
+    for (int i = 0; i <= tcp_entry_last; i++) {
+        if (network_array[i]->state == TCP_CON_CONNECTED) {
+            tcp_con_send_topics(network_array[i]);
+        }
+    }
+    pthread_mutex_unlock(&tcp_array_mutex);
+}
+
+int build_tcp_peer_overview(struct blob_buf *b) {
+    void *peer_list;
+
+    blob_buf_init(b, 0);
+
+    pthread_mutex_lock(&tcp_array_mutex);
+    for (int i = 0; i <= tcp_entry_last; i++) {
+        struct network_con_s *con = network_array[i];
+
+        peer_list = blobmsg_open_table(b, inet_ntoa(con->sock_addr.sin_addr));
+        blobmsg_add_u32(b, "port", ntohs(con->sock_addr.sin_port));
+        blobmsg_add_string(b, "state", tcp_con_state_str[con->state]);
+        blobmsg_add_u32(b, "rtt", con->rtt);
+        blobmsg_add_u32(b, "srtt", con->srtt);
+        blobmsg_add_u32(b, "pings_sent", con->pings_sent);
+        blobmsg_add_u32(b, "pongs_received", con->pongs_received);
+        blobmsg_add_u32(b, "loss", con->pings_sent ? con->pings_lost * 100 / con->pings_sent : 0);
+        blobmsg_add_u32(b, "connect_attempts", con->connect_attempts);
+        blobmsg_add_u32(b, "connect_failures", con->connect_failures);
+        blobmsg_add_u32(b, "disconnects", con->disconnects);
+        blobmsg_add_u32(b, "backoff", con->state == TCP_CON_DISCONNECTED ? con->backoff : 0);
+        blobmsg_add_u32(b, "unsent", con->state == TCP_CON_CONNECTED ? con->s.stream.w.data_bytes : 0);
+        for (int j = 0; j < TCP_MSG_CLASSES; j++) {
+            struct tcp_send_queue *q = &con->queue[j];
+            void *queue_table = blobmsg_open_table(b, tcp_msg_class_str[j]);
+
+            blobmsg_add_u32(b, "queued", q->count);
+            blobmsg_add_u32(b, "queued_bytes", q->bytes);
+            blobmsg_add_u32(b, "sent", q->sent);
+            blobmsg_add_u32(b, "dropped", q->dropped);
+            blobmsg_add_u32(b, "throttled", q->throttled);
+            blobmsg_add_u32(b, "rate", q->rate);
+            blobmsg_close_table(b, queue_table);
+        }
+        blobmsg_close_table(b, peer_list);
+    }
+    pthread_mutex_unlock(&tcp_array_mutex);
+
+    return 0;
 }
 
 
@@ -246,58 +1208,69 @@ void print_tcp_array() {
     printf("------------------\n");
 }
 
-int tcp_array_insert(struct network_con_s entry) {
+int tcp_array_insert(struct network_con_s *entry) {
     if (tcp_entry_last == -1) {
         network_array[0] = entry;
         tcp_entry_last++;
         return 1;
     }
 
+    if (tcp_entry_last + 1 >= ARRAY_NETWORK_LEN) {
+        return 0;
+    }
+
     int i;
     for (i = 0; i <= tcp_entry_last; i++) {
-        if (entry.sock_addr.sin_addr.s_addr < network_array[i].sock_addr.sin_addr.s_addr) {
+        if (entry->sock_addr.sin_addr.s_addr < network_array[i]->sock_addr.sin_addr.s_addr) {
             break;
         }
-        if (entry.sock_addr.sin_addr.s_addr == network_array[i].sock_addr.sin_addr.s_addr) {
+        if (entry->sock_addr.sin_addr.s_addr == network_array[i]->sock_addr.sin_addr.s_addr) {
             return 0;
         }
     }
     for (int j = tcp_entry_last; j >= i; j--) {
-        if (j + 1 <= ARRAY_NETWORK_LEN) {
-            network_array[j + 1] = network_array[j];
-        }
+        network_array[j + 1] = network_array[j];
     }
     network_array[i] = entry;
+    tcp_entry_last++;
 
-    if (tcp_entry_last < ARRAY_NETWORK_LEN) {
-        tcp_entry_last++;
-    }
     return 1;
 }
 
-int tcp_array_delete(struct sockaddr_in entry) {
+struct network_con_s *tcp_array_delete(struct sockaddr_in entry) {
     int i;
-    int found_in_array = 0;
+    struct network_con_s *tmp = NULL;
 
     if (tcp_entry_last == -1) {
-        return 0;
+        return NULL;
     }
 
     for (i = 0; i <= tcp_entry_last; i++) {
-        if (entry.sin_addr.s_addr == network_array[i].sock_addr.sin_addr.s_addr) {
-            found_in_array = 1;
+        if (entry.sin_addr.s_addr == network_array[i]->sock_addr.sin_addr.s_addr) {
+            tmp = network_array[i];
             break;
         }
     }
 
+    if (!tmp) {
+        return NULL;
+    }
+
     for (int j = i; j < tcp_entry_last; j++) {
         network_array[j] = network_array[j + 1];
     }
+    tcp_entry_last--;
 
-    if (tcp_entry_last > -1 && found_in_array) {
-        tcp_entry_last--;
+    return tmp;
+}
+
+struct network_con_s *tcp_array_get_entry(struct sockaddr_in entry) {
+    for (int i = 0; i <= tcp_entry_last; i++) {
+        if (entry.sin_addr.s_addr == network_array[i]->sock_addr.sin_addr.s_addr) {
+            return network_array[i];
+        }
     }
-    return 0;
+    return NULL;
 }
 
 int tcp_array_contains_address(struct sockaddr_in entry) {
@@ -310,15 +1283,5 @@ int tcp_array_contains_address(struct sockaddr_in entry) {
 }
 
 int tcp_array_contains_address_help(struct sockaddr_in entry) {
-    if (tcp_entry_last == -1) {
-        return 0;
-    }
-
-    int i;
-    for (i = 0; i <= tcp_entry_last; i++) {
-        if (entry.sin_addr.s_addr == network_array[i].sock_addr.sin_addr.s_addr) {
-            return 1;
-        }
-    }
-    return 0;
-}
\ No newline at end of file
+    return tcp_array_get_entry(entry) != NULL;
+}
@@ -0,0 +1,557 @@
+#include <liburing.h>
+#include <libubox/uloop.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uringsocket.h"
+#include "utils.h"
+
+#define URING_BUF_GROUP 0
+// index of the socket in the registered files
+#define URING_SOCK 0
+
+static struct io_uring recv_ring;
+static struct io_uring_buf_ring *recv_bufs;
+static char *recv_buf_mem;
+static int recv_armed;
+
+static struct io_uring send_ring;
+
+static int uring_setup_ring(struct io_uring *ring, unsigned entries, int sock) {
+    int ret = io_uring_queue_init(entries, ring, 0);
+
+    if (ret < 0) {
+        fprintf(stderr, "io_uring not available: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    ret = io_uring_register_files(ring, &sock, 1);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring file registration failed: %s\n", strerror(-ret));
+        io_uring_queue_exit(ring);
+        return -1;
+    }
+    return 0;
+}
+
+static void uring_recycle_buf(int bid) {
+    io_uring_buf_ring_add(recv_bufs, recv_buf_mem + bid * URING_RECV_BUF_LEN, URING_RECV_BUF_LEN, bid,
+                          io_uring_buf_ring_mask(URING_RECV_BUFS), 0);
+    io_uring_buf_ring_advance(recv_bufs, 1);
+}
+
+// One request keeps receiving until the kernel ends it, e.g. when it ran out of buffers.
+static void uring_arm_recv() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&recv_ring);
+
+    io_uring_prep_recv_multishot(sqe, URING_SOCK, NULL, 0, 0);
+    sqe->flags |= IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    recv_armed = 1;
+}
+
+// Tear the receive ring down, pending requests are cancelled with it.
+static void uring_recv_exit() {
+    io_uring_free_buf_ring(&recv_ring, recv_bufs, URING_RECV_BUFS, URING_BUF_GROUP);
+    io_uring_queue_exit(&recv_ring);
+    free(recv_buf_mem);
+    recv_bufs = NULL;
+    recv_buf_mem = NULL;
+    recv_armed = 0;
+}
+
+int uring_socket_init(int sock) {
+    int ret;
+
+    if (uring_setup_ring(&recv_ring, 8, sock)) {
+        return -1;
+    }
+
+    recv_bufs = io_uring_setup_buf_ring(&recv_ring, URING_RECV_BUFS, URING_BUF_GROUP, 0, &ret);
+    recv_buf_mem = malloc(URING_RECV_BUFS * URING_RECV_BUF_LEN);
+    if (!recv_bufs || !recv_buf_mem) {
+        fprintf(stderr, "io_uring buffer ring setup failed\n");
+        if (recv_bufs) {
+            io_uring_free_buf_ring(&recv_ring, recv_bufs, URING_RECV_BUFS, URING_BUF_GROUP);
+        }
+        free(recv_buf_mem);
+        io_uring_queue_exit(&recv_ring);
+        return -1;
+    }
+
+    for (int i = 0; i < URING_RECV_BUFS; i++) {
+        io_uring_buf_ring_add(recv_bufs, recv_buf_mem + i * URING_RECV_BUF_LEN, URING_RECV_BUF_LEN, i,
+                              io_uring_buf_ring_mask(URING_RECV_BUFS), i);
+    }
+    io_uring_buf_ring_advance(recv_bufs, URING_RECV_BUFS);
+
+    if (uring_setup_ring(&send_ring, URING_SEND_ENTRIES, sock)) {
+        io_uring_free_buf_ring(&recv_ring, recv_bufs, URING_RECV_BUFS, URING_BUF_GROUP);
+        free(recv_buf_mem);
+        io_uring_queue_exit(&recv_ring);
+        return -1;
+    }
+
+    printf("Using io_uring for the network socket\n");
+    return 0;
+}
+
+int uring_socket_recv(char *buf, size_t size) {
+    struct io_uring_cqe *cqe;
+
+    while (1) {
+        if (!recv_armed) {
+            uring_arm_recv();
+        }
+
+        // completions that are already there are taken without a syscall
+        if (io_uring_peek_cqe(&recv_ring, &cqe)) {
+            int ret = io_uring_submit_and_wait(&recv_ring, 1);
+            if (ret < 0 && ret != -EINTR) {
+                fprintf(stderr, "io_uring wait failed: %s\n", strerror(-ret));
+                uring_recv_exit();
+                return -1;
+            }
+            continue;
+        }
+
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        io_uring_cqe_seen(&recv_ring, cqe);
+
+        if (!(flags & IORING_CQE_F_MORE)) {
+            recv_armed = 0;
+        }
+
+        if (res < 0) {
+            // ran out of buffers for a moment, the request is armed again
+            if (res == -ENOBUFS) {
+                continue;
+            }
+            fprintf(stderr, "io_uring receive failed: %s\n", strerror(-res));
+            uring_recv_exit();
+            return -1;
+        }
+
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        int len = (size_t) res < size ? res : (int) size;
+        memcpy(buf, recv_buf_mem + bid * URING_RECV_BUF_LEN, len);
+        uring_recycle_buf(bid);
+
+        return len;
+    }
+}
+
+int uring_socket_sendmsgs(struct msghdr *msgs, int n) {
+    struct io_uring_cqe *cqe;
+    int err = 0;
+
+    if (n > URING_SEND_ENTRIES) {
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&send_ring);
+
+        io_uring_prep_sendmsg(sqe, URING_SOCK, &msgs[i], 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+
+    int ret = io_uring_submit_and_wait(&send_ring, n);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring submit failed: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (io_uring_wait_cqe(&send_ring, &cqe) < 0) {
+            return -1;
+        }
+        if (cqe->res < 0) {
+            err = cqe->res;
+        }
+        io_uring_cqe_seen(&send_ring, cqe);
+    }
+
+    if (err) {
+        fprintf(stderr, "io_uring send failed: %s\n", strerror(-err));
+        return -1;
+    }
+    return 0;
+}
+
+// TCP peer connections, driven from the uloop: the ring fd is readable while completions wait.
+
+#define URING_TCP_BUF_GROUP 1
+
+// Request a completion belongs to, kept in the low bits of the user data.
+enum {
+    URING_TCP_RECV = 1,
+    URING_TCP_SEND,
+    URING_TCP_CANCEL,
+};
+#define URING_TCP_OP_MASK 3
+
+struct uring_tcp_conn {
+    struct ustream *s;      // NULL once the stream is freed, the requests may still be in flight
+    int fd;
+    int pending;            // requests the kernel still owns
+    int recv_armed;
+    int send_busy;
+    int dirty;              // on the submit list
+    struct uring_tcp_conn *next_dirty;
+    int tx_off;
+    int tx_len;
+    char tx[URING_TCP_TX_LEN];
+};
+
+static struct io_uring tcp_ring;
+static struct io_uring_buf_ring *tcp_bufs;
+static char *tcp_buf_mem;
+
+// Stream to connection lookup for the ustream callbacks, open addressing.
+static struct uring_tcp_conn *tcp_conns[URING_TCP_CONNS];
+static int tcp_conns_num;
+
+static struct uring_tcp_conn *tcp_dirty;
+
+static void uring_tcp_ring_cb(struct uloop_fd *fd, unsigned int events);
+static void uring_tcp_submit_cb(struct uloop_timeout *t);
+
+static struct uloop_fd tcp_ring_fd = {
+        .cb = uring_tcp_ring_cb
+};
+static struct uloop_timeout tcp_submit_timer = {
+        .cb = uring_tcp_submit_cb
+};
+
+static int uring_tcp_slot(struct ustream *s) {
+    uint32_t i = hash_fnv1a((const uint8_t *) &s, sizeof(s)) & (URING_TCP_CONNS - 1);
+
+    while (tcp_conns[i] && tcp_conns[i]->s != s) {
+        i = (i + 1) & (URING_TCP_CONNS - 1);
+    }
+    return i;
+}
+
+static struct uring_tcp_conn *uring_tcp_conn_get(struct ustream *s) {
+    return tcp_conns[uring_tcp_slot(s)];
+}
+
+static void uring_tcp_conn_remove(struct ustream *s) {
+    uint32_t i = uring_tcp_slot(s);
+
+    if (!tcp_conns[i]) {
+        return;
+    }
+    tcp_conns[i] = NULL;
+    tcp_conns_num--;
+
+    // move the entries behind the gap back to where a lookup finds them
+    for (uint32_t j = (i + 1) & (URING_TCP_CONNS - 1); tcp_conns[j]; j = (j + 1) & (URING_TCP_CONNS - 1)) {
+        struct uring_tcp_conn *c = tcp_conns[j];
+
+        tcp_conns[j] = NULL;
+        tcp_conns[uring_tcp_slot(c->s)] = c;
+    }
+}
+
+// All requests of a round go out with one submission at the end of the uloop iteration.
+static void uring_tcp_kick() {
+    if (!tcp_submit_timer.pending) {
+        uloop_timeout_set(&tcp_submit_timer, 0);
+    }
+}
+
+static struct io_uring_sqe *uring_tcp_get_sqe() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&tcp_ring);
+
+    if (!sqe) {
+        io_uring_submit(&tcp_ring);
+        sqe = io_uring_get_sqe(&tcp_ring);
+    }
+    return sqe;
+}
+
+static void uring_tcp_release(struct uring_tcp_conn *c) {
+    if (!c->s && !c->pending && !c->dirty) {
+        free(c);
+    }
+}
+
+static void uring_tcp_mark_dirty(struct uring_tcp_conn *c) {
+    if (!c->dirty) {
+        c->dirty = 1;
+        c->next_dirty = tcp_dirty;
+        tcp_dirty = c;
+    }
+    uring_tcp_kick();
+}
+
+static int uring_tcp_arm_recv(struct uring_tcp_conn *c) {
+    struct io_uring_sqe *sqe = uring_tcp_get_sqe();
+
+    if (!sqe) {
+        return -1;
+    }
+
+    io_uring_prep_recv_multishot(sqe, c->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_TCP_BUF_GROUP;
+    io_uring_sqe_set_data64(sqe, (uintptr_t) c | URING_TCP_RECV);
+    c->recv_armed = 1;
+    c->pending++;
+    uring_tcp_kick();
+    return 0;
+}
+
+static void uring_tcp_send(struct uring_tcp_conn *c, int poll_first) {
+    struct io_uring_sqe *sqe = uring_tcp_get_sqe();
+
+    if (!sqe) {
+        // tried again with the next round
+        uring_tcp_mark_dirty(c);
+        return;
+    }
+
+    io_uring_prep_send(sqe, c->fd, c->tx + c->tx_off, c->tx_len - c->tx_off, MSG_NOSIGNAL);
+    if (poll_first) {
+        sqe->ioprio |= IORING_RECVSEND_POLL_FIRST;
+    }
+    io_uring_sqe_set_data64(sqe, (uintptr_t) c | URING_TCP_SEND);
+    c->send_busy = 1;
+    c->pending++;
+}
+
+static void uring_tcp_submit_cb(struct uloop_timeout *t) {
+    while (tcp_dirty) {
+        struct uring_tcp_conn *c = tcp_dirty;
+
+        tcp_dirty = c->next_dirty;
+        c->dirty = 0;
+
+        // staged data of a freed stream is dropped like the write buffer of a ustream_fd
+        if (c->s && !c->send_busy && c->tx_len > c->tx_off) {
+            uring_tcp_send(c, 0);
+        }
+        uring_tcp_release(c);
+    }
+    io_uring_submit(&tcp_ring);
+}
+
+static void uring_tcp_fail(struct uring_tcp_conn *c, int write_error) {
+    if (write_error) {
+        c->s->write_error = true;
+    } else {
+        c->s->eof = true;
+    }
+    ustream_state_change(c->s);
+}
+
+// Hand received data to the stream, the reader may free the stream on the way.
+static void uring_tcp_deliver(struct uring_tcp_conn *c, char *data, int len) {
+    while (len > 0 && c->s) {
+        int maxlen;
+        char *buf = ustream_reserve(c->s, len, &maxlen);
+
+        if (!buf) {
+            // the readers consume everything, so this only happens if one stops reading
+            fprintf(stderr, "TCP receive buffer is full, closing the connection!\n");
+            uring_tcp_fail(c, 0);
+            return;
+        }
+        if (maxlen > len) {
+            maxlen = len;
+        }
+        memcpy(buf, data, maxlen);
+        data += maxlen;
+        len -= maxlen;
+        ustream_fill_read(c->s, maxlen);
+    }
+}
+
+static void uring_tcp_complete(struct io_uring_cqe *cqe) {
+    struct uring_tcp_conn *c = (struct uring_tcp_conn *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_TCP_OP_MASK);
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+
+    switch (cqe->user_data & URING_TCP_OP_MASK) {
+        case URING_TCP_RECV:
+            if (!(flags & IORING_CQE_F_MORE)) {
+                c->recv_armed = 0;
+                c->pending--;
+            }
+
+            if (flags & IORING_CQE_F_BUFFER) {
+                int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                char *buf = tcp_buf_mem + bid * URING_TCP_RECV_BUF_LEN;
+
+                if (res > 0) {
+                    uring_tcp_deliver(c, buf, res);
+                }
+                io_uring_buf_ring_add(tcp_bufs, buf, URING_TCP_RECV_BUF_LEN, bid,
+                                      io_uring_buf_ring_mask(URING_TCP_RECV_BUFS), 0);
+                io_uring_buf_ring_advance(tcp_bufs, 1);
+            }
+
+            if (!c->s || c->s->eof) {
+                break;
+            }
+            if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+                uring_tcp_fail(c, 0);
+            } else if (!c->recv_armed && uring_tcp_arm_recv(c)) {
+                uring_tcp_fail(c, 0);
+            }
+            break;
+        case URING_TCP_SEND:
+            c->pending--;
+            c->send_busy = 0;
+            if (!c->s) {
+                break;
+            }
+
+            if (res == -EAGAIN) {
+                uring_tcp_send(c, 1);
+            } else if (res < 0) {
+                uring_tcp_fail(c, 1);
+            } else if ((c->tx_off += res) < c->tx_len) {
+                uring_tcp_send(c, 0);
+            } else {
+                // refill from the write buffer of the stream, notify_write drains the send queues
+                c->tx_off = c->tx_len = 0;
+                ustream_write_pending(c->s);
+            }
+            uring_tcp_kick();
+            break;
+        case URING_TCP_CANCEL:
+            c->pending--;
+            break;
+        default:
+            return;
+    }
+    uring_tcp_release(c);
+}
+
+static void uring_tcp_ring_cb(struct uloop_fd *fd, unsigned int events) {
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&tcp_ring, &cqe) == 0) {
+        struct io_uring_cqe done = *cqe;
+
+        // the slot is free before the handlers queue new requests
+        io_uring_cqe_seen(&tcp_ring, cqe);
+        uring_tcp_complete(&done);
+    }
+}
+
+// One send per connection is in flight, everything else waits in the write buffer of the stream,
+// so the send queues still see the backlog of a slow peer.
+static int uring_tcp_write(struct ustream *s, const char *buf, int len, bool more) {
+    struct uring_tcp_conn *c = uring_tcp_conn_get(s);
+
+    if (!c) {
+        return -1;
+    }
+    if (c->send_busy) {
+        return 0;
+    }
+
+    if (len > URING_TCP_TX_LEN - c->tx_len) {
+        len = URING_TCP_TX_LEN - c->tx_len;
+    }
+    memcpy(c->tx + c->tx_len, buf, len);
+    c->tx_len += len;
+    if (len > 0) {
+        uring_tcp_mark_dirty(c);
+    }
+    return len;
+}
+
+// The multishot request keeps receiving, the readers consume everything they get anyway.
+static void uring_tcp_set_read_blocked(struct ustream *s) {
+}
+
+static void uring_tcp_free(struct ustream *s) {
+    struct uring_tcp_conn *c = uring_tcp_conn_get(s);
+
+    if (!c) {
+        return;
+    }
+    uring_tcp_conn_remove(s);
+    c->s = NULL;
+
+    // the request holds its own reference to the socket, closing the fd does not end it
+    if (c->recv_armed) {
+        struct io_uring_sqe *sqe = uring_tcp_get_sqe();
+
+        if (sqe) {
+            io_uring_prep_cancel64(sqe, (uintptr_t) c | URING_TCP_RECV, 0);
+            io_uring_sqe_set_data64(sqe, (uintptr_t) c | URING_TCP_CANCEL);
+            c->pending++;
+            uring_tcp_kick();
+        }
+    }
+    uring_tcp_release(c);
+}
+
+int uring_tcp_init() {
+    int ret = io_uring_queue_init(URING_TCP_ENTRIES, &tcp_ring, 0);
+
+    if (ret < 0) {
+        fprintf(stderr, "io_uring not available for TCP: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    tcp_bufs = io_uring_setup_buf_ring(&tcp_ring, URING_TCP_RECV_BUFS, URING_TCP_BUF_GROUP, 0, &ret);
+    tcp_buf_mem = malloc(URING_TCP_RECV_BUFS * URING_TCP_RECV_BUF_LEN);
+    if (!tcp_bufs || !tcp_buf_mem) {
+        fprintf(stderr, "io_uring buffer ring setup failed\n");
+        if (tcp_bufs) {
+            io_uring_free_buf_ring(&tcp_ring, tcp_bufs, URING_TCP_RECV_BUFS, URING_TCP_BUF_GROUP);
+        }
+        free(tcp_buf_mem);
+        io_uring_queue_exit(&tcp_ring);
+        return -1;
+    }
+
+    for (int i = 0; i < URING_TCP_RECV_BUFS; i++) {
+        io_uring_buf_ring_add(tcp_bufs, tcp_buf_mem + i * URING_TCP_RECV_BUF_LEN, URING_TCP_RECV_BUF_LEN, i,
+                              io_uring_buf_ring_mask(URING_TCP_RECV_BUFS), i);
+    }
+    io_uring_buf_ring_advance(tcp_bufs, URING_TCP_RECV_BUFS);
+
+    tcp_ring_fd.fd = tcp_ring.ring_fd;
+    uloop_fd_add(&tcp_ring_fd, ULOOP_READ);
+
+    printf("Using io_uring for the TCP connections\n");
+    return 0;
+}
+
+int uring_tcp_stream_init(struct ustream *s, int fd) {
+    // keep the lookup sparse, further connections use the uloop
+    if (tcp_conns_num >= URING_TCP_CONNS * 3 / 4) {
+        return -1;
+    }
+
+    struct uring_tcp_conn *c = calloc(1, sizeof(*c));
+    if (!c) {
+        return -1;
+    }
+    c->s = s;
+    c->fd = fd;
+
+    s->write = uring_tcp_write;
+    s->free = uring_tcp_free;
+    s->set_read_blocked = uring_tcp_set_read_blocked;
+    ustream_init_defaults(s);
+
+    if (uring_tcp_arm_recv(c)) {
+        free(c);
+        return -1;
+    }
+    tcp_conns[uring_tcp_slot(s)] = c;
+    tcp_conns_num++;
+    return 0;
+}
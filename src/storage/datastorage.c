@@ -7,6 +7,7 @@
 #include "dawn_iwinfo.h"
 #include "utils.h"
 #include "ieee80211_utils.h"
+#include "kick_scheduler.h"
 
 #define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
 
@@ -223,6 +224,279 @@ int build_network_overview(struct blob_buf *b) {
     return 0;
 }
 
+// Order independent digest of the clients and probes known for an ap.
+// Caller holds client_array_mutex and probe_array_mutex.
+static void sync_digest_ap(uint8_t bssid_addr[], struct sync_digest *digest) {
+    memcpy(digest->bssid_addr, bssid_addr, ETH_ALEN * sizeof(uint8_t));
+    digest->clients = 0;
+    digest->probes = 0;
+
+    for (int i = 0; i <= client_entry_last; i++) {
+        if (mac_is_equal(client_array[i].bssid_addr, bssid_addr)) {
+            digest->clients ^= hash_fnv1a(client_array[i].client_addr, ETH_ALEN);
+        }
+    }
+    for (int i = 0; i <= probe_entry_last; i++) {
+        if (mac_is_equal(probe_array[i].bssid_addr, bssid_addr)) {
+            digest->probes ^= hash_fnv1a(probe_array[i].client_addr, ETH_ALEN);
+        }
+    }
+}
+
+// Copy the ap array so the other arrays can be locked without holding ap_array_mutex.
+static int ap_array_snapshot(ap *aps) {
+    pthread_mutex_lock(&ap_array_mutex);
+    int num = ap_entry_last + 1;
+    memcpy(aps, ap_array, num * sizeof(ap));
+    pthread_mutex_unlock(&ap_array_mutex);
+
+    return num;
+}
+
+int build_sync_digest(struct blob_buf *b) {
+    static ap aps[ARRAY_AP_LEN];
+    static uint8_t local[ARRAY_AP_LEN][ETH_ALEN];
+    struct sync_digest digest;
+    char ap_mac_buf[20];
+    void *digest_list, *ap_list;
+
+    int num_aps = ap_array_snapshot(aps);
+    int num_local = get_local_bssids(local, ARRAY_AP_LEN);
+
+    blob_buf_init(b, 0);
+    digest_list = blobmsg_open_table(b, "digests");
+
+    pthread_mutex_lock(&client_array_mutex);
+    pthread_mutex_lock(&probe_array_mutex);
+    for (int m = 0; m < num_aps; m++) {
+        sync_digest_ap(aps[m].bssid_addr, &digest);
+
+        sprintf(ap_mac_buf, MACSTR, MAC2STR(aps[m].bssid_addr));
+        ap_list = blobmsg_open_table(b, ap_mac_buf);
+        blobmsg_add_u32(b, "clients", digest.clients);
+        blobmsg_add_u32(b, "probes", digest.probes);
+        for (int k = 0; k < num_local; k++) {
+            if (mac_is_equal(local[k], aps[m].bssid_addr)) {
+                blobmsg_add_u8(b, "local", 1);
+                memset(local[k], 0, ETH_ALEN);
+                break;
+            }
+        }
+        blobmsg_close_table(b, ap_list);
+    }
+    pthread_mutex_unlock(&probe_array_mutex);
+    pthread_mutex_unlock(&client_array_mutex);
+
+    // own aps that did not make it into the ap array yet
+    for (int k = 0; k < num_local; k++) {
+        uint8_t zero[ETH_ALEN] = {0};
+
+        if (mac_is_equal(local[k], zero)) {
+            continue;
+        }
+        sprintf(ap_mac_buf, MACSTR, MAC2STR(local[k]));
+        ap_list = blobmsg_open_table(b, ap_mac_buf);
+        blobmsg_add_u32(b, "clients", 0);
+        blobmsg_add_u32(b, "probes", 0);
+        blobmsg_add_u8(b, "local", 1);
+        blobmsg_close_table(b, ap_list);
+    }
+
+    blobmsg_close_table(b, digest_list);
+    return 0;
+}
+
+// Station in the layout of a "clients" message, the client array has to be locked by the caller.
+static void add_client(struct blob_buf *b, int i) {
+    char client_mac_buf[20];
+    void *client_list;
+
+    sprintf(client_mac_buf, MACSTR, MAC2STR(client_array[i].client_addr));
+    client_list = blobmsg_open_table(b, client_mac_buf);
+    blobmsg_add_u8(b, "auth", client_array[i].auth);
+    blobmsg_add_u8(b, "assoc", client_array[i].assoc);
+    blobmsg_add_u8(b, "authorized", client_array[i].authorized);
+    blobmsg_add_u8(b, "preauth", client_array[i].preauth);
+    blobmsg_add_u8(b, "wds", client_array[i].wds);
+    blobmsg_add_u8(b, "wmm", client_array[i].wmm);
+    blobmsg_add_u8(b, "ht", client_array[i].ht);
+    blobmsg_add_u8(b, "vht", client_array[i].vht);
+    blobmsg_add_u8(b, "wps", client_array[i].wps);
+    blobmsg_add_u8(b, "mfp", client_array[i].mfp);
+    blobmsg_add_u32(b, "aid", client_array[i].aid);
+    blobmsg_close_table(b, client_list);
+}
+
+// Stations of an ap in the layout of a "clients" message, the client array has to be locked by the caller.
+static void add_client_table(struct blob_buf *b, uint8_t bssid_addr[]) {
+    void *client_table = blobmsg_open_table(b, "clients");
+
+    for (int i = 0; i <= client_entry_last; i++) {
+        if (mac_is_equal(client_array[i].bssid_addr, bssid_addr)) {
+            add_client(b, i);
+        }
+    }
+    blobmsg_close_table(b, client_table);
+}
+
+void client_array_add_table(struct blob_buf *b, uint8_t bssid_addr[]) {
+    pthread_mutex_lock(&client_array_mutex);
+    add_client_table(b, bssid_addr);
+    pthread_mutex_unlock(&client_array_mutex);
+}
+
+// Sync reply under construction, sent in chunks of about SYNC_CHUNK_LEN.
+struct sync_chunk {
+    struct blob_buf *b;
+    void (*send)(struct blob_buf *b);
+    const char *list_name;
+    void *list;
+    int num;    // entries in the current chunk
+};
+
+static void sync_chunk_open(struct sync_chunk *c, const char *list_name) {
+    blob_buf_init(c->b, 0);
+    c->list_name = list_name;
+    c->list = blobmsg_open_array(c->b, list_name);
+    c->num = 0;
+}
+
+static void sync_chunk_flush(struct sync_chunk *c) {
+    blobmsg_close_array(c->b, c->list);
+    if (c->num > 0) {
+        c->send(c->b);
+    }
+    sync_chunk_open(c, c->list_name);
+}
+
+// Room for one more entry, the chunk is sent first if it is full.
+static void sync_chunk_reserve(struct sync_chunk *c) {
+    if (c->num > 0 && blob_len(c->b->head) >= SYNC_CHUNK_LEN) {
+        sync_chunk_flush(c);
+    }
+    c->num++;
+}
+
+// Ap entry in the layout of a "clients" message, the stations follow.
+static void sync_table_open(struct blob_buf *b, ap *ap_entry, int continued, int num_sta,
+                            void **ap_list, void **client_table) {
+    *ap_list = blobmsg_open_table(b, NULL);
+    blobmsg_add_macaddr(b, "bssid", ap_entry->bssid_addr);
+    blobmsg_add_string(b, "ssid", (char *) ap_entry->ssid);
+    blobmsg_add_u32(b, "freq", ap_entry->freq);
+    blobmsg_add_u8(b, "ht_supported", ap_entry->ht);
+    blobmsg_add_u8(b, "vht_supported", ap_entry->vht);
+    blobmsg_add_u32(b, "channel_utilization", ap_entry->channel_utilization);
+    blobmsg_add_u32(b, "collision_domain", ap_entry->collision_domain);
+    blobmsg_add_u32(b, "bandwidth", ap_entry->bandwidth);
+    if (continued) {
+        // the rest of a table that did not fit into one chunk, applied like a "clientsdelta"
+        blobmsg_add_u8(b, "continued", 1);
+        blobmsg_add_u32(b, "num_sta", num_sta);
+    }
+    *client_table = blobmsg_open_table(b, "clients");
+}
+
+static void sync_table_close(struct blob_buf *b, void *ap_list, void *client_table) {
+    blobmsg_close_table(b, client_table);
+    blobmsg_close_table(b, ap_list);
+}
+
+int build_sync_data(struct blob_buf *b, struct sync_digest *digests, int num_digests,
+                    void (*send)(struct blob_buf *b)) {
+    static ap aps[ARRAY_AP_LEN];
+    static int selected[ARRAY_AP_LEN];
+    struct sync_chunk chunk = {.b = b, .send = send};
+    struct sync_digest digest;
+    void *ap_list, *client_table, *probe;
+    int num_selected = 0;
+
+    int num_aps = ap_array_snapshot(aps);
+
+    pthread_mutex_lock(&client_array_mutex);
+    pthread_mutex_lock(&probe_array_mutex);
+
+    sync_chunk_open(&chunk, "tables");
+    for (int m = 0; m < num_aps; m++) {
+        sync_digest_ap(aps[m].bssid_addr, &digest);
+
+        // skip aps the peer already knows the same way or serves itself
+        int known = 0;
+        for (int k = 0; k < num_digests; k++) {
+            if (mac_is_equal(digests[k].bssid_addr, aps[m].bssid_addr)) {
+                known = digests[k].local ||
+                        (digests[k].clients == digest.clients && digests[k].probes == digest.probes);
+                break;
+            }
+        }
+        if (known) {
+            continue;
+        }
+        selected[num_selected++] = m;
+
+        int num_sta = 0;
+        for (int i = 0; i <= client_entry_last; i++) {
+            num_sta += mac_is_equal(client_array[i].bssid_addr, aps[m].bssid_addr);
+        }
+
+        sync_chunk_reserve(&chunk);
+        sync_table_open(b, &aps[m], 0, num_sta, &ap_list, &client_table);
+        for (int i = 0, in_table = 0; i <= client_entry_last; i++) {
+            if (!mac_is_equal(client_array[i].bssid_addr, aps[m].bssid_addr)) {
+                continue;
+            }
+
+            // a large ap is split, the first part replaces the table of the peer, the rest adds to it
+            if (in_table > 0 && blob_len(b->head) >= SYNC_CHUNK_LEN) {
+                sync_table_close(b, ap_list, client_table);
+                sync_chunk_flush(&chunk);
+                sync_chunk_reserve(&chunk);
+                sync_table_open(b, &aps[m], 1, num_sta, &ap_list, &client_table);
+                in_table = 0;
+            }
+            in_table++;
+            add_client(b, i);
+        }
+        sync_table_close(b, ap_list, client_table);
+    }
+    blobmsg_close_array(b, chunk.list);
+    if (chunk.num > 0) {
+        send(b);
+    }
+
+    // same layout as a "probe" message
+    sync_chunk_open(&chunk, "probes");
+    for (int i = 0; i <= probe_entry_last; i++) {
+        int wanted = 0;
+        for (int k = 0; k < num_selected && !wanted; k++) {
+            wanted = mac_is_equal(probe_array[i].bssid_addr, aps[selected[k]].bssid_addr);
+        }
+        if (!wanted) {
+            continue;
+        }
+
+        sync_chunk_reserve(&chunk);
+        probe = blobmsg_open_table(b, NULL);
+        blobmsg_add_macaddr(b, "bssid", probe_array[i].bssid_addr);
+        blobmsg_add_macaddr(b, "address", probe_array[i].client_addr);
+        blobmsg_add_macaddr(b, "target", probe_array[i].target_addr);
+        blobmsg_add_u32(b, "signal", probe_array[i].signal);
+        blobmsg_add_u32(b, "freq", probe_array[i].freq);
+        blobmsg_add_u8(b, "ht_support", probe_array[i].ht_support);
+        blobmsg_add_u8(b, "vht_support", probe_array[i].vht_support);
+        blobmsg_close_table(b, probe);
+    }
+    blobmsg_close_array(b, chunk.list);
+    if (chunk.num > 0) {
+        send(b);
+    }
+
+    pthread_mutex_unlock(&probe_array_mutex);
+    pthread_mutex_unlock(&client_array_mutex);
+
+    return num_selected;
+}
+
 int eval_probe_metric(struct probe_entry_s probe_entry) {
 
     int score = 0;
@@ -374,6 +648,314 @@ int better_ap_available(uint8_t bssid_addr[], uint8_t client_addr[], int automat
     return 0;
 }
 
+int probe_array_best_bssids(uint8_t client_addr[], uint8_t own_bssid_addr[], uint8_t bssids[][ETH_ALEN], int max) {
+    int scores[max > 0 ? max : 1];
+    int n = 0;
+
+    for (int i = 0; i <= probe_entry_last; i++) {
+        if (!mac_is_equal(probe_array[i].client_addr, client_addr) ||
+            mac_is_equal(probe_array[i].bssid_addr, own_bssid_addr) ||
+            !compare_ssid(own_bssid_addr, probe_array[i].bssid_addr)) {
+            continue;
+        }
+
+        int score = eval_probe_metric(probe_array[i]);
+
+        // insert into the list sorted by score, the worst entry falls out
+        int k = n < max ? n++ : max;
+        while (k > 0 && scores[k - 1] < score) {
+            if (k < max) {
+                scores[k] = scores[k - 1];
+                memcpy(bssids[k], bssids[k - 1], ETH_ALEN);
+            }
+            k--;
+        }
+        if (k < max) {
+            scores[k] = score;
+            memcpy(bssids[k], probe_array[i].bssid_addr, ETH_ALEN);
+        }
+    }
+    return n;
+}
+
+int probe_array_score(uint8_t bssid_addr[], uint8_t client_addr[]) {
+    for (int i = 0; i <= probe_entry_last; i++) {
+        if (mac_is_equal(probe_array[i].bssid_addr, bssid_addr) &&
+            mac_is_equal(probe_array[i].client_addr, client_addr)) {
+            return eval_probe_metric(probe_array[i]);
+        }
+    }
+    return 0;
+}
+
+// Cached decision inputs of a client at one ap.
+struct verdict_ap {
+    uint8_t bssid_addr[ETH_ALEN];
+    uint8_t known;
+    uint8_t asked;          // verdict was requested, keep it fresh
+    uint8_t score_key;      // probe fields eval_probe_metric depends on
+    int8_t better_ap;
+    int counter;
+    uint32_t generation;    // better_ap is valid while this matches verdict_generation
+};
+
+struct client_verdict {
+    uint8_t client_addr[ETH_ALEN];
+    uint8_t used;
+    uint8_t maclisted;
+    uint32_t epoch;         // bumped whenever the verdicts of the client become stale
+    int num_aps;
+    struct verdict_ap ap[VERDICT_MAX_APS];
+};
+
+// Open addressing table indexed by the client mac.
+static struct client_verdict verdict_cache[VERDICT_CACHE_LEN];
+static int verdict_cache_num;
+// Bumped when an ap changes, which makes all cached better_ap results stale. Never 0.
+static uint32_t verdict_generation = 1;
+
+static struct client_verdict *verdict_client(uint8_t client_addr[], int create) {
+    uint32_t i = hash_fnv1a(client_addr, ETH_ALEN) & (VERDICT_CACHE_LEN - 1);
+
+    while (verdict_cache[i].used) {
+        if (mac_is_equal(verdict_cache[i].client_addr, client_addr)) {
+            return &verdict_cache[i];
+        }
+        i = (i + 1) & (VERDICT_CACHE_LEN - 1);
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    // start over instead of deleting single clients, the cache refills from the probe array
+    if (verdict_cache_num >= VERDICT_CACHE_LEN * 3 / 4) {
+        memset(verdict_cache, 0, sizeof(verdict_cache));
+        verdict_cache_num = 0;
+        i = hash_fnv1a(client_addr, ETH_ALEN) & (VERDICT_CACHE_LEN - 1);
+    }
+
+    verdict_cache_num++;
+    memcpy(verdict_cache[i].client_addr, client_addr, ETH_ALEN);
+    verdict_cache[i].used = 1;
+    verdict_cache[i].maclisted = mac_in_maclist(client_addr);
+    return &verdict_cache[i];
+}
+
+static struct verdict_ap *verdict_client_ap(struct client_verdict *c, uint8_t bssid_addr[], int create) {
+    for (int i = 0; i < c->num_aps; i++) {
+        if (mac_is_equal(c->ap[i].bssid_addr, bssid_addr)) {
+            return &c->ap[i];
+        }
+    }
+
+    if (!create || c->num_aps >= VERDICT_MAX_APS) {
+        return NULL;
+    }
+
+    struct verdict_ap *a = &c->ap[c->num_aps++];
+    memset(a, 0, sizeof(*a));
+    memcpy(a->bssid_addr, bssid_addr, ETH_ALEN);
+    return a;
+}
+
+static void verdict_client_stale(struct client_verdict *c) {
+    c->epoch++;
+    for (int i = 0; i < c->num_aps; i++) {
+        c->ap[i].generation = 0;
+    }
+}
+
+static uint8_t probe_score_key(probe_entry *entry) {
+    return (entry->signal >= dawn_metric.rssi_val)
+           | (entry->signal <= dawn_metric.low_rssi_val) << 1
+           | (entry->freq > 5000) << 2
+           | (entry->ht_support != 0) << 3
+           | (entry->vht_support != 0) << 4;
+}
+
+// Mirror a probe entry into the cache, called with the probe array locked.
+static void verdict_probe_update(probe_entry *entry) {
+    uint8_t key = probe_score_key(entry);
+
+    pthread_mutex_lock(&verdict_mutex);
+    struct client_verdict *c = verdict_client(entry->client_addr, 1);
+    struct verdict_ap *a = verdict_client_ap(c, entry->bssid_addr, 1);
+
+    if (!a) {
+        // not tracked, but it can still change the verdicts at the other aps
+        verdict_client_stale(c);
+    } else {
+        if (!a->known || a->score_key != key) {
+            verdict_client_stale(c);
+        }
+        a->known = 1;
+        a->score_key = key;
+        a->counter = entry->counter;
+    }
+    pthread_mutex_unlock(&verdict_mutex);
+}
+
+static void verdict_probe_remove(probe_entry *entry) {
+    pthread_mutex_lock(&verdict_mutex);
+    struct client_verdict *c = verdict_client(entry->client_addr, 0);
+    if (c) {
+        struct verdict_ap *a = verdict_client_ap(c, entry->bssid_addr, 0);
+        if (a) {
+            a->known = 0;
+            a->counter = 0;
+        }
+        verdict_client_stale(c);
+    }
+    pthread_mutex_unlock(&verdict_mutex);
+}
+
+static void verdict_invalidate_client(uint8_t client_addr[]) {
+    pthread_mutex_lock(&verdict_mutex);
+    struct client_verdict *c = verdict_client(client_addr, 0);
+    if (c) {
+        verdict_client_stale(c);
+    }
+    pthread_mutex_unlock(&verdict_mutex);
+}
+
+static void verdict_invalidate_all() {
+    pthread_mutex_lock(&verdict_mutex);
+    if (++verdict_generation == 0) {
+        verdict_generation = 1;
+    }
+    pthread_mutex_unlock(&verdict_mutex);
+}
+
+static void verdict_set_maclisted(uint8_t client_addr[]) {
+    pthread_mutex_lock(&verdict_mutex);
+    struct client_verdict *c = verdict_client(client_addr, 0);
+    if (c) {
+        c->maclisted = 1;
+    }
+    pthread_mutex_unlock(&verdict_mutex);
+}
+
+// Only the ap fields better_ap_available looks at matter.
+static int ap_verdict_changed(ap *old_entry, ap *new_entry) {
+    if (!mac_is_equal(old_entry->bssid_addr, new_entry->bssid_addr)) {
+        return 1;
+    }
+
+    return old_entry->ht != new_entry->ht
+           || old_entry->vht != new_entry->vht
+           || (old_entry->channel_utilization <= dawn_metric.chan_util_val) !=
+              (new_entry->channel_utilization <= dawn_metric.chan_util_val)
+           || (old_entry->channel_utilization > dawn_metric.max_chan_util_val) !=
+              (new_entry->channel_utilization > dawn_metric.max_chan_util_val)
+           || (dawn_metric.use_station_count && old_entry->station_count != new_entry->station_count)
+           || strcmp((char *) old_entry->ssid, (char *) new_entry->ssid) != 0;
+}
+
+void verdict_lookup(uint8_t bssid_addr[], uint8_t client_addr[], struct verdict *v) {
+    pthread_mutex_lock(&verdict_mutex);
+    struct client_verdict *c = verdict_client(client_addr, 0);
+    struct verdict_ap *a = c ? verdict_client_ap(c, bssid_addr, 0) : NULL;
+    if (a) {
+        v->maclisted = c->maclisted;
+        v->known = a->known;
+        v->counter = a->counter;
+        pthread_mutex_unlock(&verdict_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&verdict_mutex);
+
+    // miss, fill the cache from the probe array
+    pthread_mutex_lock(&probe_array_mutex);
+    probe_entry entry = {.counter = 0};
+    int found = 0;
+    for (int i = 0; i <= probe_entry_last; i++) {
+        if (mac_is_equal(bssid_addr, probe_array[i].bssid_addr) &&
+            mac_is_equal(client_addr, probe_array[i].client_addr)) {
+            entry = probe_array[i];
+            found = 1;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&verdict_mutex);
+    c = verdict_client(client_addr, 1);
+    a = verdict_client_ap(c, bssid_addr, 1);
+    if (a) {
+        a->known = found;
+        a->counter = entry.counter;
+        a->score_key = found ? probe_score_key(&entry) : 0;
+    }
+    v->maclisted = c->maclisted;
+    v->known = found;
+    v->counter = entry.counter;
+    pthread_mutex_unlock(&verdict_mutex);
+    pthread_mutex_unlock(&probe_array_mutex);
+}
+
+int better_ap_available_cached(uint8_t bssid_addr[], uint8_t client_addr[]) {
+    uint32_t epoch = 0;
+    uint32_t generation;
+    int ret;
+
+    pthread_mutex_lock(&verdict_mutex);
+    struct client_verdict *c = verdict_client(client_addr, 0);
+    struct verdict_ap *a = c ? verdict_client_ap(c, bssid_addr, 0) : NULL;
+    if (a && a->generation == verdict_generation) {
+        ret = a->better_ap;
+        pthread_mutex_unlock(&verdict_mutex);
+        return ret;
+    }
+    if (c) {
+        epoch = c->epoch;
+    }
+    generation = verdict_generation;
+    pthread_mutex_unlock(&verdict_mutex);
+
+    pthread_mutex_lock(&probe_array_mutex);
+    ret = better_ap_available(bssid_addr, client_addr, 0);
+
+    // only keep the result if nothing changed while it was computed
+    pthread_mutex_lock(&verdict_mutex);
+    c = verdict_client(client_addr, 1);
+    a = verdict_client_ap(c, bssid_addr, 1);
+    if (a && c->epoch == epoch && generation == verdict_generation) {
+        a->better_ap = (int8_t) ret;
+        a->generation = generation;
+        a->asked = 1;
+    }
+    pthread_mutex_unlock(&verdict_mutex);
+    pthread_mutex_unlock(&probe_array_mutex);
+
+    return ret;
+}
+
+void verdict_cache_refresh() {
+    uint8_t clients[VERDICT_REFRESH_MAX][ETH_ALEN];
+    uint8_t bssids[VERDICT_REFRESH_MAX][ETH_ALEN];
+    int n = 0;
+
+    pthread_mutex_lock(&verdict_mutex);
+    for (int i = 0; i < VERDICT_CACHE_LEN && n < VERDICT_REFRESH_MAX; i++) {
+        struct client_verdict *c = &verdict_cache[i];
+        if (!c->used) {
+            continue;
+        }
+        for (int j = 0; j < c->num_aps && n < VERDICT_REFRESH_MAX; j++) {
+            if (c->ap[j].asked && c->ap[j].generation != verdict_generation) {
+                memcpy(clients[n], c->client_addr, ETH_ALEN);
+                memcpy(bssids[n], c->ap[j].bssid_addr, ETH_ALEN);
+                n++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&verdict_mutex);
+
+    for (int i = 0; i < n; i++) {
+        better_ap_available_cached(bssids[i], clients[i]);
+    }
+}
+
 int kick_client(struct client_s client_entry) {
     return !mac_in_maclist(client_entry.client_addr) &&
            better_ap_available(client_entry.bssid_addr, client_entry.client_addr, 1);
@@ -435,7 +1017,7 @@ void kick_clients(uint8_t bssid[], uint32_t id) {
                 continue;
             }
 
-            printf("Better AP available. Kicking client:\n");
+            printf("Better AP available. Queueing kick of client:\n");
             print_client_entry(client_array[j]);
             printf("Check if client is active receiving!\n");
 
@@ -446,25 +1028,20 @@ void kick_clients(uint8_t bssid[], uint32_t id) {
                 // tx_rate has always some weird value so don't use ist
                 if (rx_rate > dawn_metric.bandwith_threshold) {
                     printf("Client is probably in active transmisison. Don't kick! RxRate is: %f\n", rx_rate);
+                    kick_queue_remove(client_array[j].client_addr);
                     continue;
                 }
             }
             printf("Client is probably NOT in active transmisison. KICK! RxRate is: %f\n", rx_rate);
 
 
-            // here we should send a messsage to set the probe.count for all aps to the min that there is no delay between switching
-            // the hearing map is full...
-            send_set_probe(client_array[j].client_addr);
-
-            // don't deauth station? <- deauth is better!
-            // maybe we can use handovers...
-            del_client_interface(id, client_array[j].client_addr, NO_MORE_STAS, 1, 1000);
-            client_array_delete(client_array[j]);
-
-            // don't delete clients in a row. use update function again...
-            // -> chan_util update, ...
-            add_client_update_timer(timeout_config.update_client * 1000 / 4);
-            break;
+            // the scheduler spreads the kicks over time and over the target aps
+            uint8_t target[1][ETH_ALEN];
+            if (probe_array_best_bssids(client_array[j].client_addr, bssid, target, 1) == 1) {
+                int score_gap = probe_array_score(target[0], client_array[j].client_addr) -
+                                probe_array_score(bssid, client_array[j].client_addr);
+                kick_queue_add(id, bssid, client_array[j].client_addr, target[0], score_gap);
+            }
 
             // no entry in probe array for own bssid
         } else if (do_kick == -1) {
@@ -478,6 +1055,7 @@ void kick_clients(uint8_t bssid[], uint32_t id) {
             print_client_entry(client_array[j]);
             // set kick counter to 0 again
             client_array[j].kick_count = 0;
+            kick_queue_remove(client_array[j].client_addr);
         }
     }
 
@@ -552,6 +1130,7 @@ void client_array_insert(client entry) {
     if (client_entry_last == -1) {
         client_array[0] = entry;
         client_entry_last++;
+        verdict_invalidate_client(entry.client_addr);
         return;
     }
 
@@ -571,6 +1150,7 @@ void client_array_insert(client entry) {
     if (client_entry_last < ARRAY_CLIENT_LEN) {
         client_entry_last++;
     }
+    verdict_invalidate_client(entry.client_addr);
 }
 
 client client_array_delete(client entry) {
@@ -598,6 +1178,7 @@ client client_array_delete(client entry) {
 
     if (client_entry_last > -1 && found_in_array) {
         client_entry_last--;
+        verdict_invalidate_client(entry.client_addr);
     }
     return tmp;
 }
@@ -669,6 +1250,7 @@ int probe_array_set_all_probe_count(uint8_t client_addr[], uint32_t probe_count)
         if (mac_is_equal(client_addr, probe_array[i].client_addr)) {
             printf("SETTING MAC!!!\n");
             probe_array[i].counter = probe_count;
+            verdict_probe_update(&probe_array[i]);
         } else if (!mac_is_greater(client_addr, probe_array[i].client_addr)) {
             printf("MAC NOT FOUND!!!\n");
             break;
@@ -679,9 +1261,27 @@ int probe_array_set_all_probe_count(uint8_t client_addr[], uint32_t probe_count)
     return updated;
 }
 
+time_t update_silence() {
+    return timeout_config.max_update_silence > 0 ? timeout_config.max_update_silence : UPDATE_SILENCE_DEFAULT;
+}
+
+// Only changes beyond the threshold are sent, compared to the value the other nodes have.
+// Small fluctuations around a sent value therefore stay quiet.
+static int rssi_change_significant(probe_entry *entry, time_t now) {
+    if (dawn_metric.rssi_update_delta <= 0 || !entry->sent_time) {
+        return 1;
+    }
+
+    if (abs((int) entry->signal - (int) entry->sent_signal) >= dawn_metric.rssi_update_delta) {
+        return 1;
+    }
+    return now - entry->sent_time >= update_silence();
+}
+
 int probe_array_update_rssi(uint8_t bssid_addr[], uint8_t client_addr[], uint32_t rssi) {
 
     int updated = 0;
+    time_t now = time(0);
 
     if (probe_entry_last == -1) {
         return 0;
@@ -694,7 +1294,12 @@ int probe_array_update_rssi(uint8_t bssid_addr[], uint8_t client_addr[], uint32_
             mac_is_equal(client_addr, probe_array[i].client_addr)) {
             probe_array[i].signal = rssi;
             updated = 1;
-            ubus_send_probe_via_network(probe_array[i]);
+            verdict_probe_update(&probe_array[i]);
+            if (rssi_change_significant(&probe_array[i], now)) {
+                probe_array[i].sent_signal = rssi;
+                probe_array[i].sent_time = now;
+                ubus_send_probe_via_network(probe_array[i]);
+            }
         }
     }
     pthread_mutex_unlock(&probe_array_mutex);
@@ -738,11 +1343,15 @@ probe_entry insert_to_array(probe_entry entry, int inc_counter) {
 
     entry.time = time(0);
     entry.counter = 0;
+    entry.sent_signal = 0;
+    entry.sent_time = 0;
     probe_entry tmp = probe_array_delete(entry);
 
     if (mac_is_equal(entry.bssid_addr, tmp.bssid_addr)
         && mac_is_equal(entry.client_addr, tmp.client_addr)) {
         entry.counter = tmp.counter;
+        entry.sent_signal = tmp.sent_signal;
+        entry.sent_time = tmp.sent_time;
     }
 
     if (inc_counter) {
@@ -751,6 +1360,7 @@ probe_entry insert_to_array(probe_entry entry, int inc_counter) {
     }
 
     probe_array_insert(entry);
+    verdict_probe_update(&entry);
 
     pthread_mutex_unlock(&probe_array_mutex);
 
@@ -761,8 +1371,11 @@ ap insert_to_ap_array(ap entry) {
     pthread_mutex_lock(&ap_array_mutex);
 
     entry.time = time(0);
-    ap_array_delete(entry);
+    ap tmp = ap_array_delete(entry);
     ap_array_insert(entry);
+    if (ap_verdict_changed(&tmp, &entry)) {
+        verdict_invalidate_all();
+    }
     pthread_mutex_unlock(&ap_array_mutex);
 
     return entry;
@@ -875,8 +1488,10 @@ void remove_old_client_entries(time_t current_time, long long int threshold) {
 void remove_old_probe_entries(time_t current_time, long long int threshold) {
     for (int i = 0; i <= probe_entry_last; i++) {
         if (probe_array[i].time < current_time - threshold) {
-            if (!is_connected(probe_array[i].bssid_addr, probe_array[i].client_addr))
+            if (!is_connected(probe_array[i].bssid_addr, probe_array[i].client_addr)) {
+                verdict_probe_remove(&probe_array[i]);
                 probe_array_delete(probe_array[i]);
+            }
         }
     }
 }
@@ -885,6 +1500,7 @@ void remove_old_ap_entries(time_t current_time, long long int threshold) {
     for (int i = 0; i <= ap_entry_last; i++) {
         if (ap_array[i].time < current_time - threshold) {
             ap_array_delete(ap_array[i]);
+            verdict_invalidate_all();
         }
     }
 }
@@ -911,7 +1527,9 @@ void remove_probe_array_cb(struct uloop_timeout *t) {
 void remove_client_array_cb(struct uloop_timeout *t) {
     pthread_mutex_lock(&client_array_mutex);
     printf("[Thread] : Removing old client entries!\n");
-    remove_old_client_entries(time(0), timeout_config.update_client);
+    // unchanged client tables may be held back by the other nodes for up to the silence interval
+    remove_old_client_entries(time(0), timeout_config.update_client +
+                                       (dawn_metric.chan_util_update_delta > 0 ? update_silence() : 0));
     pthread_mutex_unlock(&client_array_mutex);
     uloop_timeout_set(&client_timeout, timeout_config.update_client * 1000);
 }
@@ -970,6 +1588,56 @@ void insert_client_to_array(client entry) {
     pthread_mutex_unlock(&client_array_mutex);
 }
 
+void client_array_delete_station(uint8_t bssid_addr[], uint8_t client_addr[]) {
+    client entry;
+
+    memcpy(entry.bssid_addr, bssid_addr, ETH_ALEN * sizeof(uint8_t));
+    memcpy(entry.client_addr, client_addr, ETH_ALEN * sizeof(uint8_t));
+
+    pthread_mutex_lock(&client_array_mutex);
+    client_array_delete(entry);
+    pthread_mutex_unlock(&client_array_mutex);
+}
+
+// Keep the stations of an ap alive that were not part of a delta update.
+void client_array_touch_bssid(uint8_t bssid_addr[]) {
+    time_t now = time(0);
+
+    pthread_mutex_lock(&client_array_mutex);
+    for (int i = 0; i <= client_entry_last; i++) {
+        if (mac_is_equal(client_array[i].bssid_addr, bssid_addr)) {
+            client_array[i].time = now;
+        }
+    }
+    pthread_mutex_unlock(&client_array_mutex);
+}
+
+// Drop the stations of an ap that were not refreshed since before.
+void client_array_remove_bssid_before(uint8_t bssid_addr[], time_t before) {
+    pthread_mutex_lock(&client_array_mutex);
+    for (int i = 0; i <= client_entry_last; i++) {
+        if (mac_is_equal(client_array[i].bssid_addr, bssid_addr) && client_array[i].time < before) {
+            client_array_delete(client_array[i]);
+            i--;
+        }
+    }
+    pthread_mutex_unlock(&client_array_mutex);
+}
+
+int client_array_count_bssid(uint8_t bssid_addr[]) {
+    int num = 0;
+
+    pthread_mutex_lock(&client_array_mutex);
+    for (int i = 0; i <= client_entry_last; i++) {
+        if (mac_is_equal(client_array[i].bssid_addr, bssid_addr)) {
+            num++;
+        }
+    }
+    pthread_mutex_unlock(&client_array_mutex);
+
+    return num;
+}
+
 void insert_macs_from_file() {
     FILE *fp;
     char *line = NULL;
@@ -1015,6 +1683,7 @@ int insert_to_maclist(uint8_t mac[]) {
     for (int i = 0; i < ETH_ALEN; ++i) {
         mac_list[mac_list_entry_last][i] = mac[i];
     }
+    verdict_set_maclisted(mac);
 
     return 0;
 }
@@ -0,0 +1,153 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libubox/utils.h>
+
+#include "base64.h"
+
+#define MAX_LEN 512
+#define BENCH_LEN 1024
+#define BENCH_ROUNDS 20000
+
+static void fill_random(unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = rand();
+    }
+}
+
+static void test_round_trip() {
+    unsigned char in[MAX_LEN], out[DAWN_B64_DECODE_LEN(DAWN_B64_ENCODE_LEN(MAX_LEN))];
+    char enc[DAWN_B64_ENCODE_LEN(MAX_LEN)];
+
+    for (size_t len = 0; len <= MAX_LEN; len++) {
+        fill_random(in, len);
+
+        int enc_len = dawn_b64_encode(in, len, enc, sizeof(enc));
+        assert(enc_len == (int) DAWN_B64_ENCODE_LEN(len) - 1);
+        assert(enc[enc_len] == '\0');
+
+        assert(dawn_b64_decode(enc, enc_len, out, sizeof(out)) == (int) len);
+        assert(memcmp(in, out, len) == 0);
+
+        // the senders count the terminator
+        assert(dawn_b64_decode(enc, enc_len + 1, out, sizeof(out)) == (int) len);
+    }
+}
+
+static void test_padding() {
+    static const char *plain[] = {"", "f", "fo", "foo", "foob", "fooba", "foobar"};
+    static const char *coded[] = {"", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy"};
+    char enc[16], dec[16];
+
+    for (size_t i = 0; i < sizeof(plain) / sizeof(plain[0]); i++) {
+        assert(dawn_b64_encode(plain[i], strlen(plain[i]), enc, sizeof(enc)) == (int) strlen(coded[i]));
+        assert(strcmp(enc, coded[i]) == 0);
+
+        assert(dawn_b64_decode(coded[i], strlen(coded[i]), dec, sizeof(dec)) == (int) strlen(plain[i]));
+        assert(strcmp(dec, plain[i]) == 0);
+    }
+}
+
+static void test_invalid() {
+    static const char *invalid[] = {
+            "Zg=",      // not a multiple of four
+            "Zm9",
+            "Zm9v!A==", // character outside the alphabet
+            "Zm 9",
+            "Zg=a",     // padding in the middle of a quad
+            "Z===",
+            "=Zg=",
+            "Zm\x80v",
+    };
+    char buf[16];
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        assert(dawn_b64_decode(invalid[i], strlen(invalid[i]), buf, sizeof(buf)) == -1);
+    }
+
+    // output buffers that are too small
+    assert(dawn_b64_encode("foo", 3, buf, DAWN_B64_ENCODE_LEN(3) - 1) == -1);
+    assert(dawn_b64_decode("Zm9v", 4, buf, DAWN_B64_DECODE_LEN(4) - 1) == -1);
+}
+
+// The udp peers may still decode with libubox, so the output has to be identical.
+static void test_libubox_compat() {
+    unsigned char in[MAX_LEN], out[MAX_LEN + 1];
+    char enc[DAWN_B64_ENCODE_LEN(MAX_LEN)], ubox_enc[B64_ENCODE_LEN(MAX_LEN)];
+
+    for (size_t len = 0; len <= MAX_LEN; len++) {
+        fill_random(in, len);
+
+        int enc_len = dawn_b64_encode(in, len, enc, sizeof(enc));
+        assert(b64_encode(in, len, ubox_enc, sizeof(ubox_enc)) == enc_len);
+        assert(strcmp(enc, ubox_enc) == 0);
+
+        assert(b64_decode(enc, out, sizeof(out)) == (int) len);
+        assert(memcmp(in, out, len) == 0);
+    }
+}
+
+static double elapsed_ns(struct timespec *start) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+// Not asserted, build machines are too noisy for that, only printed for comparison.
+static void bench() {
+    static unsigned char in[BENCH_LEN], out[DAWN_B64_DECODE_LEN(DAWN_B64_ENCODE_LEN(BENCH_LEN))];
+    static char enc[DAWN_B64_ENCODE_LEN(BENCH_LEN)];
+    struct timespec start;
+    volatile int sink = 0;
+    int enc_len;
+
+    fill_random(in, BENCH_LEN);
+    enc_len = dawn_b64_encode(in, BENCH_LEN, enc, sizeof(enc));
+    assert(dawn_b64_decode(enc, enc_len, out, sizeof(out)) == BENCH_LEN);
+    assert(b64_decode(enc, out, sizeof(out)) == BENCH_LEN);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        sink += dawn_b64_encode(in, BENCH_LEN, enc, sizeof(enc));
+    }
+    double dawn_enc = elapsed_ns(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        sink += b64_encode(in, BENCH_LEN, enc, sizeof(enc));
+    }
+    double ubox_enc = elapsed_ns(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        sink += dawn_b64_decode(enc, enc_len, out, sizeof(out));
+    }
+    double dawn_dec = elapsed_ns(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        sink += b64_decode(enc, out, sizeof(out));
+    }
+    double ubox_dec = elapsed_ns(&start);
+
+    printf("encode %d bytes: dawn %.0f ns, libubox %.0f ns\n", BENCH_LEN, dawn_enc / BENCH_ROUNDS,
+           ubox_enc / BENCH_ROUNDS);
+    printf("decode %d bytes: dawn %.0f ns, libubox %.0f ns\n", BENCH_LEN, dawn_dec / BENCH_ROUNDS,
+           ubox_dec / BENCH_ROUNDS);
+}
+
+int main() {
+    srand(1);
+
+    test_round_trip();
+    test_padding();
+    test_invalid();
+    test_libubox_compat();
+    bench();
+
+    printf("base64 tests passed\n");
+    return 0;
+}
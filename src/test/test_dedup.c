@@ -0,0 +1,66 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "dedup.h"
+#include "networksocket.h"
+
+#define PEER 0x1234
+#define STREAM_BULK 0
+#define STREAM_CONTROL 1
+
+// Bulk frames wait in the send queue while a burst of control frames, far more
+// than the window, is sent first. The bulk frames must still be accepted afterwards.
+static void test_control_overtakes_bulk() {
+    uint32_t bulk[16], control[4 * DEDUP_WINDOW];
+    int num_bulk = sizeof(bulk) / sizeof(bulk[0]);
+    int num_control = sizeof(control) / sizeof(control[0]);
+
+    // the sender numbers the frames when they are queued
+    for (int i = 0; i < num_bulk; i++) {
+        bulk[i] = dedup_next_seq(STREAM_BULK);
+    }
+    for (int i = 0; i < num_control; i++) {
+        control[i] = dedup_next_seq(STREAM_CONTROL);
+    }
+
+    // strict priority, the control frames leave first
+    for (int i = 0; i < num_control; i++) {
+        assert(!dedup_check(PEER, STREAM_CONTROL, control[i]));
+    }
+    for (int i = 0; i < num_bulk; i++) {
+        assert(!dedup_check(PEER, STREAM_BULK, bulk[i]));
+    }
+
+    // gossip delivers the same frames again
+    for (int i = 0; i < num_control; i++) {
+        assert(dedup_check(PEER, STREAM_CONTROL, control[i]));
+    }
+    for (int i = 0; i < num_bulk; i++) {
+        assert(dedup_check(PEER, STREAM_BULK, bulk[i]));
+    }
+}
+
+static void test_window() {
+    uint32_t first = dedup_next_seq(STREAM_BULK);
+
+    assert(!dedup_check(PEER + 1, STREAM_BULK, first));
+    for (int i = 0; i < DEDUP_WINDOW; i++) {
+        assert(!dedup_check(PEER + 1, STREAM_BULK, dedup_next_seq(STREAM_BULK)));
+    }
+
+    // the first frame fell out of the window
+    assert(dedup_check(PEER + 1, STREAM_BULK, first));
+    // frames without sequence number are never dropped
+    assert(!dedup_check(PEER + 1, STREAM_BULK, 0));
+    assert(!dedup_check(PEER + 1, STREAM_BULK, 0));
+}
+
+int main() {
+    node_id = 1;
+
+    test_control_overtakes_bulk();
+    test_window();
+
+    printf("dedup tests passed\n");
+    return 0;
+}
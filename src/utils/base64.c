@@ -0,0 +1,126 @@
+#include "base64.h"
+
+#include <stdint.h>
+
+static const char b64_enc_table[64] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define XX 0x80
+
+// Invalid characters have the high bit set, so one check per quad is enough.
+static const uint8_t b64_dec_table[256] = {
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,
+        52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, XX, XX, XX,
+        XX, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+        15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+        XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+        41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+        XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+int dawn_b64_encode(const void *src, size_t src_len, char *dst, size_t dst_size) {
+    const uint8_t *in = src;
+    char *out = dst;
+    size_t i;
+
+    if (dst_size < DAWN_B64_ENCODE_LEN(src_len)) {
+        return -1;
+    }
+
+    // three input bytes per iteration, no branches in the loop body
+    for (i = 0; i + 3 <= src_len; i += 3) {
+        uint32_t v = (uint32_t) in[i] << 16 | (uint32_t) in[i + 1] << 8 | in[i + 2];
+
+        out[0] = b64_enc_table[v >> 18];
+        out[1] = b64_enc_table[(v >> 12) & 0x3f];
+        out[2] = b64_enc_table[(v >> 6) & 0x3f];
+        out[3] = b64_enc_table[v & 0x3f];
+        out += 4;
+    }
+
+    if (i < src_len) {
+        uint32_t v = (uint32_t) in[i] << 16;
+        if (i + 1 < src_len) {
+            v |= (uint32_t) in[i + 1] << 8;
+        }
+
+        out[0] = b64_enc_table[v >> 18];
+        out[1] = b64_enc_table[(v >> 12) & 0x3f];
+        out[2] = i + 1 < src_len ? b64_enc_table[(v >> 6) & 0x3f] : '=';
+        out[3] = '=';
+        out += 4;
+    }
+
+    *out = '\0';
+    return out - dst;
+}
+
+int dawn_b64_decode(const char *src, size_t src_len, void *dst, size_t dst_size) {
+    const uint8_t *in = (const uint8_t *) src;
+    uint8_t *out = dst;
+    size_t i;
+    int pad = 0;
+
+    // tolerate a trailing terminator counted by the sender
+    while (src_len > 0 && in[src_len - 1] == '\0') {
+        src_len--;
+    }
+
+    if (src_len % 4 || dst_size < DAWN_B64_DECODE_LEN(src_len)) {
+        return -1;
+    }
+
+    if (src_len > 0 && in[src_len - 1] == '=') {
+        pad++;
+        if (in[src_len - 2] == '=') {
+            pad++;
+        }
+    }
+
+    // full quads, the last one may contain padding and is handled below
+    size_t full = pad ? src_len - 4 : src_len;
+    for (i = 0; i < full; i += 4) {
+        uint8_t a = b64_dec_table[in[i]];
+        uint8_t b = b64_dec_table[in[i + 1]];
+        uint8_t c = b64_dec_table[in[i + 2]];
+        uint8_t d = b64_dec_table[in[i + 3]];
+
+        if ((a | b | c | d) & XX) {
+            return -1;
+        }
+
+        uint32_t v = (uint32_t) a << 18 | (uint32_t) b << 12 | (uint32_t) c << 6 | d;
+        out[0] = v >> 16;
+        out[1] = v >> 8;
+        out[2] = v;
+        out += 3;
+    }
+
+    if (pad) {
+        uint8_t a = b64_dec_table[in[i]];
+        uint8_t b = b64_dec_table[in[i + 1]];
+        uint8_t c = pad == 1 ? b64_dec_table[in[i + 2]] : 0;
+
+        if ((a | b | c) & XX) {
+            return -1;
+        }
+
+        uint32_t v = (uint32_t) a << 18 | (uint32_t) b << 12 | (uint32_t) c << 6;
+        *out++ = v >> 16;
+        if (pad == 1) {
+            *out++ = v >> 8;
+        }
+    }
+
+    *out = '\0';
+    return out - (uint8_t *) dst;
+}
@@ -0,0 +1,66 @@
+#include "chan_util.h"
+
+#define CHAN_UTIL_BIN(v) ((v) * CHAN_UTIL_BINS / 256)
+
+// Samples needed before single spikes are clamped.
+#define CHAN_UTIL_MIN_SAMPLES 8
+
+void chan_util_add(struct chan_util_estimator *e, int sample, int period) {
+    if (sample < 0) {
+        sample = 0;
+    } else if (sample > 255) {
+        sample = 255;
+    }
+
+    // the first sample starts the average, there is nothing to smooth yet
+    if (e->num == 0) {
+        e->ewma = sample << 8;
+    } else {
+        int value = sample;
+
+        // a single busy sample should not make the ap look congested
+        if (e->num >= CHAN_UTIL_MIN_SAMPLES) {
+            int limit = chan_util_percentile(e, CHAN_UTIL_CLAMP_PERCENTILE);
+            if (value > limit) {
+                value = limit;
+            }
+        }
+
+        // alpha = 2 / (period + 1)
+        if (period < 1) {
+            period = 1;
+        }
+        e->ewma += ((value << 8) - e->ewma) * 2 / (period + 1);
+    }
+
+    // the raw sample goes into the window, so a lasting change raises the limit
+    if (e->num == CHAN_UTIL_WINDOW) {
+        e->hist[CHAN_UTIL_BIN(e->ring[e->head])]--;
+    } else {
+        e->num++;
+    }
+    e->ring[e->head] = (uint8_t) sample;
+    e->hist[CHAN_UTIL_BIN(sample)]++;
+    e->head = (e->head + 1) & (CHAN_UTIL_WINDOW - 1);
+}
+
+int chan_util_percentile(struct chan_util_estimator *e, int percentile) {
+    int rank = (e->num * percentile + 99) / 100;
+    int count = 0;
+
+    if (e->num == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < CHAN_UTIL_BINS; i++) {
+        count += e->hist[i];
+        if (count >= rank) {
+            return (i + 1) * 256 / CHAN_UTIL_BINS - 1;
+        }
+    }
+    return 255;
+}
+
+int chan_util_value(struct chan_util_estimator *e) {
+    return (e->ewma + 128) >> 8;
+}
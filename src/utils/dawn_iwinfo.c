@@ -2,7 +2,6 @@
 
 #include <limits.h>
 #include <iwinfo.h>
-#include <dirent.h>
 
 #include "utils.h"
 #include "ubus.h"
@@ -21,60 +20,251 @@ int get_bandwidth(const char *ifname, uint8_t *client_addr, float *rx_rate, floa
 
 #define IWINFO_ESSID_MAX_SIZE    32
 
-int compare_essid_iwinfo(__uint8_t *bssid_addr, __uint8_t *bssid_addr_to_compare) {
+// Station of a local interface as reported by the driver.
+struct sta_info {
+    uint8_t addr[ETH_ALEN];
+    uint8_t used;
+    int signal;
+    int thr;
+    float rx_rate;
+    float tx_rate;
+};
+
+static struct iwinfo_iface *iface_reg;
+static int iface_reg_num;
+static int iface_reg_size;
+
+static struct iwinfo_iface *iwinfo_iface_get(const char *ifname) {
+    for (int i = 0; i < iface_reg_num; i++) {
+        if (strcmp(iface_reg[i].ifname, ifname) == 0) {
+            return &iface_reg[i];
+        }
+    }
+    return NULL;
+}
+
+// Registered backend of an interface, unknown interfaces fall back to a lookup.
+static const struct iwinfo_ops *iwinfo_iface_backend(const char *ifname) {
+    struct iwinfo_iface *iface = iwinfo_iface_get(ifname);
+
+    return iface ? iface->iw : iwinfo_backend(ifname);
+}
+
+static int freq_to_band(int freq) {
+    if (freq >= 5925) {
+        return 6;
+    } else if (freq >= 4900) {
+        return 5;
+    } else if (freq >= 2400) {
+        return 2;
+    }
+    return 0;
+}
+
+struct iwinfo_iface *iwinfo_iface_register(const char *ifname) {
+    struct iwinfo_iface *iface = iwinfo_iface_get(ifname);
     const struct iwinfo_ops *iw;
 
-    char mac_buf[20];
-    char mac_buf_to_compare[20];
-    sprintf(mac_buf, MACSTR, MAC2STR(bssid_addr));
-    sprintf(mac_buf_to_compare, MACSTR, MAC2STR(bssid_addr_to_compare));
+    iw = iwinfo_backend(ifname);
+    if (!iw) {
+        fprintf(stderr, "No iwinfo backend for %s!\n", ifname);
+        return NULL;
+    }
+
+    if (!iface) {
+        if (iface_reg_num >= iface_reg_size) {
+            int size = iface_reg_size ? iface_reg_size * 2 : 16;
+            struct iwinfo_iface *reg = realloc(iface_reg, size * sizeof(struct iwinfo_iface));
 
-    DIR *dirp;
-    struct dirent *entry;
-    dirp = opendir(hostapd_dir_glob);  // error handling?
-    if (!dirp) {
-        fprintf(stderr, "[COMPARE ESSID] No hostapd sockets!\n");
-        return 0;
+            if (!reg) {
+                fprintf(stderr, "Failed to grow the interface registry!\n");
+                return NULL;
+            }
+            iface_reg = reg;
+            iface_reg_size = size;
+        }
+        iface = &iface_reg[iface_reg_num];
     }
 
-    char *essid = NULL;
-    char *essid_to_compare = NULL;
+    memset(iface, 0, sizeof(*iface));
+    strncpy(iface->ifname, ifname, IWINFO_IFNAME_LEN - 1);
+    iface->iw = iw;
+    get_bssid(ifname, iface->bssid_addr);
+    get_ssid(ifname, iface->ssid);
+    if (iw->frequency(ifname, &iface->freq)) {
+        iface->freq = 0;
+    }
+    iface->band = freq_to_band(iface->freq);
+    iface->ht = support_ht(ifname);
+    iface->vht = support_vht(ifname);
+    iface->chan_util = -1;
 
-    char buf_essid[IWINFO_ESSID_MAX_SIZE + 1] = {0};
-    char buf_essid_to_compare[IWINFO_ESSID_MAX_SIZE + 1] = {0};
+    if (iface == &iface_reg[iface_reg_num]) {
+        iface_reg_num++;
+    }
+    iwinfo_sta_cache_invalidate();
 
-    while ((entry = readdir(dirp)) != NULL && (essid == NULL || essid_to_compare == NULL)) {
-        if (entry->d_type == DT_SOCK) {
+    printf("Registered interface %s: " MACSTR " %s %d MHz\n", iface->ifname, MAC2STR(iface->bssid_addr),
+           iface->ssid, iface->freq);
+    return iface;
+}
 
-            iw = iwinfo_backend(entry->d_name);
+void iwinfo_iface_unregister(const char *ifname) {
+    struct iwinfo_iface *iface = iwinfo_iface_get(ifname);
 
-            static char buf_bssid[18] = {0};
-            if (iw->bssid(entry->d_name, buf_bssid))
-                snprintf(buf_bssid, sizeof(buf_bssid), "00:00:00:00:00:00");
+    if (!iface) {
+        return;
+    }
 
-            if (strcmp(mac_buf, buf_bssid) == 0) {
+    // keep the registry dense, the last entry takes the free slot
+    iface_reg_num--;
+    if (iface != &iface_reg[iface_reg_num]) {
+        *iface = iface_reg[iface_reg_num];
+    }
+    memset(&iface_reg[iface_reg_num], 0, sizeof(struct iwinfo_iface));
+    iwinfo_sta_cache_invalidate();
+}
 
-                if (iw->ssid(entry->d_name, buf_essid))
-                    memset(buf_essid, 0, sizeof(buf_essid));
-                essid = buf_essid;
-            }
+struct iwinfo_iface *iwinfo_iface_get_by_bssid(uint8_t *bssid_addr) {
+    for (int i = 0; i < iface_reg_num; i++) {
+        if (mac_is_equal(iface_reg[i].bssid_addr, bssid_addr)) {
+            return &iface_reg[i];
+        }
+    }
+    return NULL;
+}
+
+void iwinfo_survey_all() {
+    struct iwinfo_survey_entry survey;
+
+    for (int i = 0; i < iface_reg_num; i++) {
+        struct iwinfo_iface *iface = &iface_reg[i];
+        int shared = 0;
+        int freq;
+
+        // DFS and ACS move the radio, the survey counters of the old channel are no reference
+        if (!iface->iw->frequency(iface->ifname, &freq) && freq != iface->freq) {
+            printf("Interface %s moved from %d MHz to %d MHz\n", iface->ifname, iface->freq, freq);
+            iface->freq = freq;
+            iface->band = freq_to_band(freq);
+            iface->last_channel_time = 0;
+            iface->last_channel_time_busy = 0;
+        }
 
-            if (strcmp(mac_buf_to_compare, buf_bssid) == 0) {
-                if (iw->ssid(entry->d_name, buf_essid_to_compare))
-                    memset(buf_essid_to_compare, 0, sizeof(buf_essid_to_compare));
-                essid_to_compare = buf_essid_to_compare;
+        // the vaps of a radio report the same channel
+        for (int j = 0; j < i && iface->freq; j++) {
+            if (iface_reg[j].freq == iface->freq && iface_reg[j].chan_util >= 0) {
+                iface->chan_util = iface_reg[j].chan_util;
+                shared = 1;
+                break;
             }
         }
+        if (shared) {
+            continue;
+        }
+
+        if (iface->iw->survey(iface->ifname, &survey)) {
+            iface->chan_util = -1;
+            continue;
+        }
+
+        uint64_t dividend = survey.channel_time_busy - iface->last_channel_time_busy;
+        uint64_t divisor = survey.channel_time - iface->last_channel_time;
+
+        // the first survey only sets the reference
+        iface->chan_util = iface->last_channel_time && divisor ? (int) (dividend * 255 / divisor) : -1;
+        iface->last_channel_time = survey.channel_time;
+        iface->last_channel_time_busy = survey.channel_time_busy;
+    }
+    iwinfo_finish();
+}
+
+int iwinfo_iface_chan_util(const char *ifname) {
+    struct iwinfo_iface *iface = iwinfo_iface_get(ifname);
+
+    return iface ? iface->chan_util : -1;
+}
+
+// Open addressing table indexed by the station mac, filled once per client update.
+static struct sta_info sta_cache[STA_CACHE_LEN];
+static int sta_cache_num;
+static int sta_cache_valid;
+
+static struct sta_info *sta_cache_slot(const uint8_t *addr) {
+    uint32_t i = hash_fnv1a(addr, ETH_ALEN) & (STA_CACHE_LEN - 1);
+
+    while (sta_cache[i].used && !mac_is_equal((uint8_t *) addr, sta_cache[i].addr)) {
+        i = (i + 1) & (STA_CACHE_LEN - 1);
+    }
+    return &sta_cache[i];
+}
+
+static void sta_cache_add_iface(struct iwinfo_iface *iface) {
+    static char buf[IWINFO_BUFSIZE];
+    int len;
+
+    if (iface->iw->assoclist(iface->ifname, buf, &len) || len <= 0) {
+        return;
+    }
+
+    for (int i = 0; i < len; i += sizeof(struct iwinfo_assoclist_entry)) {
+        struct iwinfo_assoclist_entry *e = (struct iwinfo_assoclist_entry *) &buf[i];
+
+        // keep the table sparse, so lookups stay short
+        if (sta_cache_num >= STA_CACHE_LEN * 3 / 4) {
+            fprintf(stderr, "Station cache is full!\n");
+            return;
+        }
+
+        struct sta_info *sta = sta_cache_slot(e->mac);
+        if (!sta->used) {
+            sta_cache_num++;
+        }
+        memcpy(sta->addr, e->mac, ETH_ALEN);
+        sta->used = 1;
+        sta->signal = e->signal;
+        sta->thr = e->thr;
+        sta->rx_rate = e->rx_rate.rate / 1000;
+        sta->tx_rate = e->tx_rate.rate / 1000;
     }
-    closedir(dirp);
+}
+
+// Dump the assoclist of every registered interface, one nl80211 request per interface.
+static void sta_cache_fill() {
+    memset(sta_cache, 0, sizeof(sta_cache));
+    sta_cache_num = 0;
+    sta_cache_valid = 1;
+
+    for (int i = 0; i < iface_reg_num; i++) {
+        sta_cache_add_iface(&iface_reg[i]);
+    }
+    iwinfo_finish();
+}
+
+static struct sta_info *sta_cache_get(uint8_t *client_addr) {
+    if (!sta_cache_valid) {
+        sta_cache_fill();
+    }
+
+    struct sta_info *sta = sta_cache_slot(client_addr);
+    return sta->used ? sta : NULL;
+}
+
+void iwinfo_sta_cache_invalidate() {
+    sta_cache_valid = 0;
+}
 
-    printf("Comparing: %s with %s\n", essid, essid_to_compare);
+int compare_essid_iwinfo(__uint8_t *bssid_addr, __uint8_t *bssid_addr_to_compare) {
+    struct iwinfo_iface *iface = iwinfo_iface_get_by_bssid(bssid_addr);
+    struct iwinfo_iface *iface_to_compare = iwinfo_iface_get_by_bssid(bssid_addr_to_compare);
 
-    if (essid == NULL || essid_to_compare == NULL) {
+    printf("Comparing: %s with %s\n", iface ? iface->ssid : NULL, iface_to_compare ? iface_to_compare->ssid : NULL);
+
+    if (iface == NULL || iface_to_compare == NULL) {
         return -1;
     }
 
-    if (strcmp(essid, essid_to_compare) == 0) {
+    if (strcmp(iface->ssid, iface_to_compare->ssid) == 0) {
         return 0;
     }
 
@@ -82,27 +272,15 @@ int compare_essid_iwinfo(__uint8_t *bssid_addr, __uint8_t *bssid_addr_to_compare
 }
 
 int get_bandwidth_iwinfo(__uint8_t *client_addr, float *rx_rate, float *tx_rate) {
+    struct sta_info *sta = sta_cache_get(client_addr);
 
-    DIR *dirp;
-    struct dirent *entry;
-    dirp = opendir(hostapd_dir_glob);  // error handling?
-    if (!dirp) {
-        fprintf(stderr, "[BANDWITH INFO]No hostapd sockets!\n");
+    if (!sta) {
         return 0;
     }
 
-    int sucess = 0;
-
-    while ((entry = readdir(dirp)) != NULL) {
-        if (entry->d_type == DT_SOCK) {
-            if (get_bandwidth(entry->d_name, client_addr, rx_rate, tx_rate)) {
-                sucess = 1;
-                break;
-            }
-        }
-    }
-    closedir(dirp);
-    return sucess;
+    *rx_rate = sta->rx_rate;
+    *tx_rate = sta->tx_rate;
+    return 1;
 }
 
 int get_bandwidth(const char *ifname, uint8_t *client_addr, float *rx_rate, float *tx_rate) {
@@ -112,7 +290,7 @@ int get_bandwidth(const char *ifname, uint8_t *client_addr, float *rx_rate, floa
     struct iwinfo_assoclist_entry *e;
     const struct iwinfo_ops *iw;
 
-    iw = iwinfo_backend(ifname);
+    iw = iwinfo_iface_backend(ifname);
 
     if (iw->assoclist(ifname, buf, &len)) {
         printf("No information available\n");
@@ -138,26 +316,9 @@ int get_bandwidth(const char *ifname, uint8_t *client_addr, float *rx_rate, floa
 }
 
 int get_rssi_iwinfo(__uint8_t *client_addr) {
+    struct sta_info *sta = sta_cache_get(client_addr);
 
-    DIR *dirp;
-    struct dirent *entry;
-    dirp = opendir(hostapd_dir_glob);  // error handling?
-    if (!dirp) {
-        fprintf(stderr, "[RSSI INFO] No hostapd sockets!\n");
-        return INT_MIN;
-    }
-
-    int rssi = INT_MIN;
-
-    while ((entry = readdir(dirp)) != NULL) {
-        if (entry->d_type == DT_SOCK) {
-            rssi = get_rssi(entry->d_name, client_addr);
-            if (rssi != INT_MIN)
-                break;
-        }
-    }
-    closedir(dirp);
-    return rssi;
+    return sta ? sta->signal : INT_MIN;
 }
 
 int get_rssi(const char *ifname, uint8_t *client_addr) {
@@ -167,7 +328,7 @@ int get_rssi(const char *ifname, uint8_t *client_addr) {
     struct iwinfo_assoclist_entry *e;
     const struct iwinfo_ops *iw;
 
-    iw = iwinfo_backend(ifname);
+    iw = iwinfo_iface_backend(ifname);
 
     if (iw->assoclist(ifname, buf, &len)) {
         printf("No information available\n");
@@ -190,27 +351,34 @@ int get_rssi(const char *ifname, uint8_t *client_addr) {
     return INT_MIN;
 }
 
-int get_expected_throughput_iwinfo(__uint8_t *client_addr) {
+int iwinfo_iface_has_station(const char *ifname, uint8_t *client_addr) {
+    int i, len, ret = 0;
+    char buf[IWINFO_BUFSIZE];
+    struct iwinfo_assoclist_entry *e;
+    const struct iwinfo_ops *iw = iwinfo_iface_backend(ifname);
 
-    DIR *dirp;
-    struct dirent *entry;
-    dirp = opendir(hostapd_dir_glob);  // error handling?
-    if (!dirp) {
-        fprintf(stderr, "[RSSI INFO] No hostapd sockets!\n");
-        return INT_MIN;
+    if (!iw || iw->assoclist(ifname, buf, &len)) {
+        iwinfo_finish();
+        return -1;
     }
 
-    int exp_thr = INT_MIN;
+    for (i = 0; i < len; i += sizeof(struct iwinfo_assoclist_entry)) {
+        e = (struct iwinfo_assoclist_entry *) &buf[i];
 
-    while ((entry = readdir(dirp)) != NULL) {
-        if (entry->d_type == DT_SOCK) {
-            exp_thr = get_expected_throughput(entry->d_name, client_addr);
-            if (exp_thr != INT_MIN)
-                break;
+        if (mac_is_equal(client_addr, e->mac)) {
+            ret = 1;
+            break;
         }
     }
-    closedir(dirp);
-    return exp_thr;
+
+    iwinfo_finish();
+    return ret;
+}
+
+int get_expected_throughput_iwinfo(__uint8_t *client_addr) {
+    struct sta_info *sta = sta_cache_get(client_addr);
+
+    return sta ? sta->thr : INT_MIN;
 }
 
 int get_expected_throughput(const char *ifname, uint8_t *client_addr) {
@@ -220,7 +388,7 @@ int get_expected_throughput(const char *ifname, uint8_t *client_addr) {
     struct iwinfo_assoclist_entry *e;
     const struct iwinfo_ops *iw;
 
-    iw = iwinfo_backend(ifname);
+    iw = iwinfo_iface_backend(ifname);
 
     if (iw->assoclist(ifname, buf, &len)) {
         printf("No information available\n");
@@ -280,7 +448,7 @@ int get_channel_utilization(const char *ifname, uint64_t *last_channel_time, uin
     struct iwinfo_survey_entry survey_entry;
     int ret = 0;
 
-    iw = iwinfo_backend(ifname);
+    iw = iwinfo_iface_backend(ifname);
     if (iw->survey(ifname, &survey_entry))
         return 0;
 
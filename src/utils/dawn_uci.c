@@ -33,6 +33,9 @@ struct time_config_s uci_get_time_config() {
             ret.update_tcp_con = uci_lookup_option_int(uci_ctx, s, "update_tcp_con");
             ret.denied_req_threshold = uci_lookup_option_int(uci_ctx, s, "denied_req_threshold");
             ret.update_chan_util = uci_lookup_option_int(uci_ctx, s, "update_chan_util");
+            ret.tcp_heartbeat = uci_lookup_option_int(uci_ctx, s, "tcp_heartbeat");
+            ret.max_update_silence = uci_lookup_option_int(uci_ctx, s, "max_update_silence");
+            ret.reconcile_clients = uci_lookup_option_int(uci_ctx, s, "reconcile_clients");
             return ret;
         }
     }
@@ -75,6 +78,11 @@ struct probe_metric_s uci_get_dawn_metric() {
             ret.use_driver_recog = uci_lookup_option_int(uci_ctx, s, "use_driver_recog");
             ret.min_kick_count = uci_lookup_option_int(uci_ctx, s, "min_number_to_kick");
             ret.chan_util_avg_period = uci_lookup_option_int(uci_ctx, s, "chan_util_avg_period");
+            ret.rssi_update_delta = uci_lookup_option_int(uci_ctx, s, "rssi_update_delta");
+            ret.chan_util_update_delta = uci_lookup_option_int(uci_ctx, s, "chan_util_update_delta");
+            ret.use_btm = uci_lookup_option_int(uci_ctx, s, "use_btm");
+            ret.kick_rate = uci_lookup_option_int(uci_ctx, s, "kick_rate");
+            ret.kick_target_rate = uci_lookup_option_int(uci_ctx, s, "kick_target_rate");
             return ret;
         }
     }
@@ -101,6 +109,12 @@ struct network_config_s uci_get_dawn_network() {
             ret.use_symm_enc = uci_lookup_option_int(uci_ctx, s, "use_symm_enc");
             ret.collision_domain = uci_lookup_option_int(uci_ctx, s, "collision_domain");
             ret.bandwidth = uci_lookup_option_int(uci_ctx, s, "bandwidth");
+            ret.gossip_fanout = uci_lookup_option_int(uci_ctx, s, "gossip_fanout");
+            ret.gossip_ttl = uci_lookup_option_int(uci_ctx, s, "gossip_ttl");
+            ret.ssid_subscriptions = uci_lookup_option_int(uci_ctx, s, "ssid_subscriptions");
+            ret.peer_bulk_rate = uci_lookup_option_int(uci_ctx, s, "peer_bulk_rate");
+            ret.peer_control_rate = uci_lookup_option_int(uci_ctx, s, "peer_control_rate");
+            ret.recv_workers = uci_lookup_option_int(uci_ctx, s, "recv_workers");
             return ret;
         }
     }
@@ -0,0 +1,261 @@
+#include <libubox/uloop.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kick_scheduler.h"
+#include "ubus.h"
+#include "utils.h"
+
+struct kick_entry {
+    uint8_t client_addr[ETH_ALEN];
+    uint8_t bssid_addr[ETH_ALEN];
+    uint8_t target_addr[ETH_ALEN];
+    uint32_t id;
+    int score_gap;
+    uint64_t queued;
+    uint64_t refreshed;     // last time kick_clients still wanted the kick
+};
+
+// Kick budget of an ap as generic cell rate algorithm: a kick is allowed once
+// the theoretical arrival time is at most KICK_BURST - 1 intervals ahead.
+struct kick_bucket {
+    uint8_t bssid_addr[ETH_ALEN];
+    uint64_t tat;
+};
+
+// Sorted by score gap, largest first.
+static struct kick_entry kick_queue[KICK_QUEUE_LEN];
+static int kick_queue_num;
+
+static struct kick_bucket kick_source[KICK_BUCKETS];
+static struct kick_bucket kick_target[KICK_BUCKETS];
+
+static void kick_timer_cb(struct uloop_timeout *t);
+
+static struct uloop_timeout kick_timer = {
+        .cb = kick_timer_cb
+};
+
+static uint64_t kick_time_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int kick_source_interval() {
+    return 60000 / (dawn_metric.kick_rate > 0 ? dawn_metric.kick_rate : KICK_RATE_DEFAULT);
+}
+
+static int kick_target_interval() {
+    return 60000 / (dawn_metric.kick_target_rate > 0 ? dawn_metric.kick_target_rate : KICK_TARGET_RATE_DEFAULT);
+}
+
+// Kicks kick_clients did not confirm for three sweeps are stale.
+static uint64_t kick_queue_timeout() {
+    return timeout_config.update_client > 0 ? timeout_config.update_client * 3000 : 30000;
+}
+
+static struct kick_bucket *kick_bucket_get(struct kick_bucket *buckets, uint8_t bssid_addr[]) {
+    struct kick_bucket *oldest = &buckets[0];
+
+    for (int i = 0; i < KICK_BUCKETS; i++) {
+        if (mac_is_equal(buckets[i].bssid_addr, bssid_addr)) {
+            return &buckets[i];
+        }
+        if (buckets[i].tat < oldest->tat) {
+            oldest = &buckets[i];
+        }
+    }
+
+    // the bucket idle the longest has its full budget anyway
+    memcpy(oldest->bssid_addr, bssid_addr, ETH_ALEN);
+    oldest->tat = 0;
+    return oldest;
+}
+
+// Earliest time the bucket allows a kick.
+static uint64_t kick_bucket_next(struct kick_bucket *k, int interval) {
+    uint64_t tolerance = (uint64_t) (KICK_BURST - 1) * interval;
+
+    return k->tat > tolerance ? k->tat - tolerance : 0;
+}
+
+static void kick_bucket_take(struct kick_bucket *k, int interval, uint64_t now) {
+    k->tat = (k->tat > now ? k->tat : now) + interval;
+}
+
+static void kick_queue_delete(int i) {
+    memmove(&kick_queue[i], &kick_queue[i + 1], (kick_queue_num - i - 1) * sizeof(struct kick_entry));
+    kick_queue_num--;
+}
+
+static int kick_queue_find(uint8_t client_addr[]) {
+    for (int i = 0; i < kick_queue_num; i++) {
+        if (mac_is_equal(kick_queue[i].client_addr, client_addr)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void kick_timer_arm() {
+    if (kick_queue_num > 0 && !kick_timer.pending) {
+        uloop_timeout_set(&kick_timer, KICK_INTERVAL + rand() % KICK_JITTER);
+    }
+}
+
+static void kick_run(struct kick_entry *e) {
+    char mac_buf[20];
+
+    pthread_mutex_lock(&client_array_mutex);
+    pthread_mutex_lock(&probe_array_mutex);
+
+    // the client may have left since it was queued
+    if (is_connected(e->bssid_addr, e->client_addr)) {
+        sprintf(mac_buf, MACSTR, MAC2STR(e->client_addr));
+        printf("Kicking client %s, score gap %d\n", mac_buf, e->score_gap);
+
+        // here we should send a messsage to set the probe.count for all aps to the min that there is no delay between switching
+        // the hearing map is full...
+        send_set_probe(e->client_addr, e->bssid_addr);
+
+        // ask the client to roam, it is only deauthenticated if it does not follow
+        if (dawn_metric.use_btm <= 0 || send_bss_transition_request(e->id, e->client_addr, e->bssid_addr)) {
+            client entry;
+
+            memcpy(entry.bssid_addr, e->bssid_addr, ETH_ALEN);
+            memcpy(entry.client_addr, e->client_addr, ETH_ALEN);
+            del_client_interface(e->id, e->client_addr, NO_MORE_STAS, 1, 1000);
+            client_array_delete(entry);
+        }
+    }
+
+    pthread_mutex_unlock(&probe_array_mutex);
+    pthread_mutex_unlock(&client_array_mutex);
+}
+
+// Run the first kick in queue order whose own and target ap have budget left, at most one per run.
+static void kick_timer_cb(struct uloop_timeout *t) {
+    uint64_t now = kick_time_ms();
+    int source_interval = kick_source_interval();
+    int target_interval = kick_target_interval();
+
+    for (int i = 0; i < kick_queue_num; i++) {
+        if (now - kick_queue[i].refreshed > kick_queue_timeout()) {
+            kick_queue_delete(i--);
+        }
+    }
+
+    for (int i = 0; i < kick_queue_num; i++) {
+        struct kick_bucket *source = kick_bucket_get(kick_source, kick_queue[i].bssid_addr);
+        struct kick_bucket *target = kick_bucket_get(kick_target, kick_queue[i].target_addr);
+
+        if (kick_bucket_next(source, source_interval) > now || kick_bucket_next(target, target_interval) > now) {
+            continue;
+        }
+
+        kick_bucket_take(source, source_interval, now);
+        kick_bucket_take(target, target_interval, now);
+
+        struct kick_entry e = kick_queue[i];
+        kick_queue_delete(i);
+        kick_run(&e);
+        break;
+    }
+
+    kick_timer_arm();
+}
+
+void kick_queue_add(uint32_t id, uint8_t bssid_addr[], uint8_t client_addr[], uint8_t target_addr[], int score_gap) {
+    uint64_t now = kick_time_ms();
+    uint64_t queued = now;
+    int i = kick_queue_find(client_addr);
+
+    if (i >= 0) {
+        queued = kick_queue[i].queued;
+        kick_queue_delete(i);
+    }
+
+    for (i = 0; i < kick_queue_num && kick_queue[i].score_gap >= score_gap; i++);
+
+    if (i == KICK_QUEUE_LEN) {
+        return;
+    }
+    if (kick_queue_num == KICK_QUEUE_LEN) {
+        kick_queue_num--;
+    }
+
+    memmove(&kick_queue[i + 1], &kick_queue[i], (kick_queue_num - i) * sizeof(struct kick_entry));
+    kick_queue_num++;
+
+    memcpy(kick_queue[i].client_addr, client_addr, ETH_ALEN);
+    memcpy(kick_queue[i].bssid_addr, bssid_addr, ETH_ALEN);
+    memcpy(kick_queue[i].target_addr, target_addr, ETH_ALEN);
+    kick_queue[i].id = id;
+    kick_queue[i].score_gap = score_gap;
+    kick_queue[i].queued = queued;
+    kick_queue[i].refreshed = now;
+
+    kick_timer_arm();
+}
+
+void kick_queue_remove(uint8_t client_addr[]) {
+    int i = kick_queue_find(client_addr);
+
+    if (i >= 0) {
+        kick_queue_delete(i);
+    }
+}
+
+int build_kick_queue_overview(struct blob_buf *b) {
+    struct kick_bucket source[KICK_BUCKETS], target[KICK_BUCKETS];
+    uint64_t now = kick_time_ms();
+    uint64_t run = now;
+    int source_interval = kick_source_interval();
+    int target_interval = kick_target_interval();
+    char mac_buf[20];
+    void *tbl, *entry;
+
+    if (kick_timer.pending) {
+        run += uloop_timeout_remaining(&kick_timer);
+    }
+
+    // play the queue through on copies of the budgets, later runs are assumed without jitter
+    memcpy(source, kick_source, sizeof(source));
+    memcpy(target, kick_target, sizeof(target));
+
+    blob_buf_init(b, 0);
+    blobmsg_add_u32(b, "kick_rate", 60000 / source_interval);
+    blobmsg_add_u32(b, "kick_target_rate", 60000 / target_interval);
+
+    tbl = blobmsg_open_table(b, "queue");
+    for (int i = 0; i < kick_queue_num; i++) {
+        struct kick_bucket *s = kick_bucket_get(source, kick_queue[i].bssid_addr);
+        struct kick_bucket *t = kick_bucket_get(target, kick_queue[i].target_addr);
+        uint64_t eta = run;
+
+        if (kick_bucket_next(s, source_interval) > eta) {
+            eta = kick_bucket_next(s, source_interval);
+        }
+        if (kick_bucket_next(t, target_interval) > eta) {
+            eta = kick_bucket_next(t, target_interval);
+        }
+        kick_bucket_take(s, source_interval, eta);
+        kick_bucket_take(t, target_interval, eta);
+        run = eta + KICK_INTERVAL;
+
+        sprintf(mac_buf, MACSTR, MAC2STR(kick_queue[i].client_addr));
+        entry = blobmsg_open_table(b, mac_buf);
+        blobmsg_add_macaddr(b, "bssid", kick_queue[i].bssid_addr);
+        blobmsg_add_macaddr(b, "target", kick_queue[i].target_addr);
+        blobmsg_add_u32(b, "score_gap", kick_queue[i].score_gap);
+        blobmsg_add_u32(b, "queued", now - kick_queue[i].queued);
+        blobmsg_add_u32(b, "eta", eta - now);
+        blobmsg_close_table(b, entry);
+    }
+    blobmsg_close_table(b, tbl);
+
+    return 0;
+}
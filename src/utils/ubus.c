@@ -3,8 +3,12 @@
 #include <libubox/blobmsg_json.h>
 #include <libubox/uloop.h>
 #include <libubus.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifndef ETH_ALEN
 #define ETH_ALEN 6
@@ -22,6 +26,8 @@
 #include "dawn_iwinfo.h"
 #include "datastorage.h"
 #include "tcpsocket.h"
+#include "chan_util.h"
+#include "kick_scheduler.h"
 
 static struct ubus_context *ctx = NULL;
 
@@ -31,7 +37,10 @@ static struct blob_buf network_buf;
 static struct blob_buf data_buf;
 static struct blob_buf b_probe;
 static struct blob_buf b_domain;
+static struct blob_buf b_delta;
+static struct blob_buf b_sync;
 static struct blob_buf b_notify;
+static struct blob_buf b_event;
 
 void update_clients(struct uloop_timeout *t);
 
@@ -52,27 +61,141 @@ struct uloop_timeout channel_utilization_timer = {
         .cb = update_channel_utilization
 };
 
-#define MAX_HOSTAPD_SOCKETS 10
 #define MAX_INTERFACE_NAME 64
 
+// Buckets of the hostapd socket lookups by ubus id and subscriber object id, a power of two.
+#define HOSTAPD_HASH_SIZE 64
+#define CACHE_LINE_SIZE 64
+
+// While hostapd_dir is watched the periodic rescan is only a safety net (s).
+#define HOSTAPD_RESCAN_INTERVAL 60
+
+static struct uloop_fd hostapd_dir_fd = {
+        .fd = -1
+};
+static struct ubus_event_handler hostapd_object_event;
+
+// Deadline of a call to hostapd or umdns (ms), the request is aborted afterwards.
+#define UBUS_CALL_TIMEOUT 1000
+
+// Asynchronous ubus call with its own deadline.
+struct ubus_async_req {
+    struct ubus_request req;
+    struct uloop_timeout timeout;
+    const char *method;
+    ubus_complete_handler_t complete_cb;
+};
+
+// Notifies whose logging and forwarding waits until hostapd got its answer.
+// Initial size of the queue, it grows during probe bursts.
+#define NOTIFY_DEFER_LEN 64
+
+struct notify_deferred {
+    char method[16];
+    struct blob_attr *msg;
+    uint8_t forward;
+};
+
+static struct notify_deferred *notify_deferred;
+static int notify_deferred_num;
+static int notify_deferred_size;
+static void notify_deferred_cb(struct uloop_timeout *t);
+static struct uloop_timeout notify_deferred_timer = {
+        .cb = notify_deferred_cb
+};
+
+// Pending BSS transition requests, one per steered client.
+#define BTM_PENDING_LEN 32
+// A client that is still connected this long (ms) after the request is deauthenticated.
+// Leaving is seen from the disassoc and deauth notifies, the interface is only checked once at the timeout.
+#define BTM_ROAM_TIMEOUT 5000
+
+// BSS transition request that waits for the client to leave.
+struct btm_pending {
+    uint8_t used;
+    uint8_t accepted;
+    uint8_t dialog_token;
+    uint8_t client_addr[ETH_ALEN];
+    uint8_t bssid_addr[ETH_ALEN];
+    uint32_t id;
+    char iface_name[MAX_INTERFACE_NAME];
+    uint64_t sent;
+    struct uloop_timeout timer;
+};
+
+static struct btm_pending btm_pending[BTM_PENDING_LEN];
+static uint8_t btm_dialog_token;
+
+static struct {
+    uint32_t requests;
+    uint32_t accepted;      // positive response of the client
+    uint32_t rejected;      // negative response or hostapd could not send the request
+    uint32_t ignored;       // no roam until the timeout
+    uint32_t roamed;
+    uint32_t deauths;       // fallback after a reject or timeout
+    uint64_t latency_sum;   // ms from the request until the client left, of all roams
+    uint32_t latency_max;
+} btm_stats;
+
+// Default of reconcile_clients (s), the full client table is fetched from hostapd this often.
+#define CLIENT_RECONCILE_DEFAULT 60
+
+// The full client table is sent this often (s), the updates in between only carry the changes.
+// Counted in wall time, so a lost delta is repaired no matter how often hostapd is asked.
+#define CLIENTS_FULL_SYNC_INTERVAL 60
+
+// Station as it was last sent to the other nodes.
+struct sta_fingerprint {
+    uint8_t client_addr[ETH_ALEN];
+    uint32_t hash;
+    struct blob_attr *attr; // only valid while building the delta
+};
+
+// Fields used by every notify come first, so they share a cache line.
 struct hostapd_sock_entry{
     uint32_t id;
     uint32_t obj_id;
-    char iface_name[MAX_INTERFACE_NAME];
+    struct hostapd_sock_entry *id_next;
+    struct hostapd_sock_entry *obj_next;
     uint8_t bssid_addr[ETH_ALEN];
-    char ssid[SSID_MAX_LEN];
     uint8_t ht;
     uint8_t vht;
-    uint64_t last_channel_time;
-    uint64_t last_channel_time_busy;
-    int chan_util_samples_sum;
-    int chan_util_num_sample_periods;
-    int chan_util_average;
+    uint8_t get_clients_pending;
+    char ssid[SSID_MAX_LEN];
+    uint32_t freq;
+    char iface_name[MAX_INTERFACE_NAME];
+    struct chan_util_estimator chan_util;
+    int chan_util_average;  // published, smoothed channel utilization
+    struct sta_fingerprint *sent_sta;
+    int sent_sta_num;
+    int sent_sta_size;
+    time_t full_sync_time;  // last time the full client table was sent
+    int sent_chan_util;     // channel utilization last sent to the other nodes
+    time_t sent_time;
     struct ubus_subscriber subscriber;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// Bssid and ssid of the local interfaces for the network threads, which must not
+// touch the hostapd table. Rebuilt by the uloop thread and swapped under the lock.
+struct local_iface {
+    uint8_t bssid_addr[ETH_ALEN];
+    char ssid[SSID_MAX_LEN];
+};
+
+struct local_ifaces {
+    int num;
+    struct local_iface iface[];
 };
 
-struct hostapd_sock_entry* hostapd_sock_arr[MAX_HOSTAPD_SOCKETS];
+static struct local_ifaces *local_ifaces;
+static pthread_mutex_t local_ifaces_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Grows with the number of interfaces, the hash tables point into the same entries.
+struct hostapd_sock_entry **hostapd_sock_arr;
 int hostapd_sock_last = -1;
+static int hostapd_sock_size;
+static struct hostapd_sock_entry *hostapd_id_hash[HOSTAPD_HASH_SIZE];
+static struct hostapd_sock_entry *hostapd_obj_hash[HOSTAPD_HASH_SIZE];
 
 enum {
     NETWORK_METHOD,
@@ -145,6 +268,7 @@ enum {
     CLIENT_TABLE_NUM_STA,
     CLIENT_TABLE_COL_DOMAIN,
     CLIENT_TABLE_BANDWIDTH,
+    CLIENT_TABLE_REMOVED,
     __CLIENT_TABLE_MAX,
 };
 
@@ -159,6 +283,7 @@ static const struct blobmsg_policy client_table_policy[__CLIENT_TABLE_MAX] = {
         [CLIENT_TABLE_NUM_STA] = {.name = "num_sta", .type = BLOBMSG_TYPE_INT32},
         [CLIENT_TABLE_COL_DOMAIN] = {.name = "collision_domain", .type = BLOBMSG_TYPE_INT32},
         [CLIENT_TABLE_BANDWIDTH] = {.name = "bandwidth", .type = BLOBMSG_TYPE_INT32},
+        [CLIENT_TABLE_REMOVED] = {.name = "removed", .type = BLOBMSG_TYPE_ARRAY},
 };
 
 enum {
@@ -210,6 +335,17 @@ static const struct blobmsg_policy dawn_umdns_policy[__DAWN_UMDNS_MAX] = {
         [DAWN_UMDNS_PORT] = {.name = "port", .type = BLOBMSG_TYPE_INT32},
 };
 
+enum {
+    UBUS_OBJECT_EVENT_ID,
+    UBUS_OBJECT_EVENT_PATH,
+    __UBUS_OBJECT_EVENT_MAX,
+};
+
+static const struct blobmsg_policy ubus_object_event_policy[__UBUS_OBJECT_EVENT_MAX] = {
+        [UBUS_OBJECT_EVENT_ID] = {.name = "id", .type = BLOBMSG_TYPE_INT32},
+        [UBUS_OBJECT_EVENT_PATH] = {.name = "path", .type = BLOBMSG_TYPE_STRING},
+};
+
 /* Function Definitions */
 static void hostapd_handle_remove(struct ubus_context *ctx,
                                   struct ubus_subscriber *s, uint32_t id);
@@ -235,13 +371,36 @@ static int get_network(struct ubus_context *ctx, struct ubus_object *obj,
                        struct ubus_request_data *req, const char *method,
                        struct blob_attr *msg);
 
+static int get_peers(struct ubus_context *ctx, struct ubus_object *obj,
+                     struct ubus_request_data *req, const char *method,
+                     struct blob_attr *msg);
+
+static int get_roam_stats(struct ubus_context *ctx, struct ubus_object *obj,
+                          struct ubus_request_data *req, const char *method,
+                          struct blob_attr *msg);
+
+static int get_kick_queue(struct ubus_context *ctx, struct ubus_object *obj,
+                          struct ubus_request_data *req, const char *method,
+                          struct blob_attr *msg);
+
 static int handle_set_probe(struct blob_attr *msg);
 
+enum {
+    TOPIC_BSSID,
+    TOPIC_SSID,
+    __TOPIC_MAX,
+};
+
+static const struct blobmsg_policy topic_policy[__TOPIC_MAX] = {
+        [TOPIC_BSSID] = {.name = "bssid", .type = BLOBMSG_TYPE_STRING},
+        [TOPIC_SSID] = {.name = "ssid", .type = BLOBMSG_TYPE_STRING},
+};
+
 static int parse_add_mac_to_file(struct blob_attr *msg);
 
 int hostapd_array_check_id(uint32_t id);
 
-void hostapd_array_insert(struct hostapd_sock_entry* entry);
+int hostapd_array_insert(struct hostapd_sock_entry* entry);
 
 struct hostapd_sock_entry* hostapd_array_get_entry(uint32_t id);
 
@@ -253,73 +412,266 @@ static void ubus_add_oject();
 
 static void respond_to_notify(uint32_t id);
 
+static void btm_client_left(uint8_t bssid_addr[], uint8_t client_addr[]);
+
+static void handle_bss_transition_response(struct blob_attr *msg);
+
+static void ubus_async_complete(struct ubus_request *req, int ret) {
+    struct ubus_async_req *r = container_of(req, struct ubus_async_req, req);
+
+    uloop_timeout_cancel(&r->timeout);
+    if (ret) {
+        fprintf(stderr, "Failed to invoke %s on %08x: %s\n", r->method, req->peer, ubus_strerror(ret));
+    }
+    if (r->complete_cb) {
+        r->complete_cb(req, ret);
+    }
+    free(r);
+}
+
+static void ubus_async_timeout(struct uloop_timeout *t) {
+    struct ubus_async_req *r = container_of(t, struct ubus_async_req, timeout);
+
+    // aborting does not run the completion callback
+    ubus_abort_request(ctx, &r->req);
+    ubus_async_complete(&r->req, UBUS_STATUS_TIMEOUT);
+}
+
+// Start a call and return right away, data_cb and complete_cb run from the uloop.
+// complete_cb is called exactly once, also if the deadline passes. priv is passed in req->priv.
+static int ubus_invoke_deadline(uint32_t id, const char *method, struct blob_attr *msg,
+                                ubus_data_handler_t data_cb, ubus_complete_handler_t complete_cb, int timeout,
+                                void *priv) {
+    struct ubus_async_req *r = calloc(1, sizeof(struct ubus_async_req));
+    int ret;
+
+    if (!r) {
+        return UBUS_STATUS_UNKNOWN_ERROR;
+    }
+
+    // the message is sent right away, so the caller may reuse its blob_buf
+    ret = ubus_invoke_async(ctx, id, method, msg, &r->req);
+    if (ret) {
+        fprintf(stderr, "Failed to invoke %s on %08x: %s\n", method, id, ubus_strerror(ret));
+        free(r);
+        return ret;
+    }
+
+    r->method = method;
+    r->complete_cb = complete_cb;
+    r->req.priv = priv;
+    r->req.data_cb = data_cb;
+    r->req.complete_cb = ubus_async_complete;
+    r->timeout.cb = ubus_async_timeout;
+    uloop_timeout_set(&r->timeout, timeout);
+    ubus_complete_request_async(ctx, &r->req);
+
+    return 0;
+}
+
 void add_client_update_timer(time_t time) {
     uloop_timeout_set(&client_timer, time);
 }
 
+static inline uint32_t hostapd_hash(uint32_t id) {
+    return (id * 2654435761u) >> 16 & (HOSTAPD_HASH_SIZE - 1);
+}
+
 struct hostapd_sock_entry* hostapd_array_get_entry_by_object_id(uint32_t id) {
-    for (int i = 0; i <= hostapd_sock_last; i++) {
-        if (hostapd_sock_arr[i]->subscriber.obj.id == id) {
-            return hostapd_sock_arr[i];
-        }
+    struct hostapd_sock_entry *entry = hostapd_obj_hash[hostapd_hash(id)];
+
+    while (entry && entry->obj_id != id) {
+        entry = entry->obj_next;
     }
-    return NULL;
+    return entry;
 }
 
 struct hostapd_sock_entry* hostapd_array_get_entry(uint32_t id) {
+    struct hostapd_sock_entry *entry = hostapd_id_hash[hostapd_hash(id)];
+
+    while (entry && entry->id != id) {
+        entry = entry->id_next;
+    }
+    return entry;
+}
+
+// Publish the interfaces after the hostapd table changed, only called from the uloop.
+static void local_ifaces_update() {
+    struct local_ifaces *ifaces, *old;
+
+    ifaces = malloc(sizeof(*ifaces) + (hostapd_sock_last + 1) * sizeof(struct local_iface));
+    if (!ifaces) {
+        fprintf(stderr, "Failed to publish the local interfaces!\n");
+        return;
+    }
+
+    ifaces->num = hostapd_sock_last + 1;
     for (int i = 0; i <= hostapd_sock_last; i++) {
-        if (hostapd_sock_arr[i]->id == id) {
-            return hostapd_sock_arr[i];
+        memcpy(ifaces->iface[i].bssid_addr, hostapd_sock_arr[i]->bssid_addr, ETH_ALEN);
+        memcpy(ifaces->iface[i].ssid, hostapd_sock_arr[i]->ssid, SSID_MAX_LEN);
+    }
+
+    pthread_mutex_lock(&local_ifaces_mutex);
+    old = local_ifaces;
+    local_ifaces = ifaces;
+    pthread_mutex_unlock(&local_ifaces_mutex);
+
+    free(old);
+}
+
+int get_local_ssid_topics(uint32_t *topics, int max) {
+    int n = 0;
+
+    pthread_mutex_lock(&local_ifaces_mutex);
+    for (int i = 0; local_ifaces && i < local_ifaces->num; i++) {
+        uint32_t topic = ssid_topic(local_ifaces->iface[i].ssid);
+        int known = 0;
+
+        for (int j = 0; j < n; j++) {
+            known |= topics[j] == topic;
+        }
+        if (!known && n < max) {
+            topics[n++] = topic;
         }
     }
-    return NULL;
+    pthread_mutex_unlock(&local_ifaces_mutex);
+
+    return n;
 }
 
-int hostapd_array_check_id(uint32_t id) {
-    for (int i = 0; i <= hostapd_sock_last; i++) {
-        if (hostapd_sock_arr[i]->id == id) {
-            return 1;
+int serves_ssid(const char *ssid) {
+    int ret = 0;
+
+    pthread_mutex_lock(&local_ifaces_mutex);
+    // nothing subscribed yet, we do not know what is relevant
+    if (!local_ifaces || local_ifaces->num == 0) {
+        ret = 1;
+    }
+    for (int i = 0; !ret && i < local_ifaces->num; i++) {
+        ret = strcmp(local_ifaces->iface[i].ssid, ssid) == 0;
+    }
+    pthread_mutex_unlock(&local_ifaces_mutex);
+
+    return ret;
+}
+
+int get_local_bssids(uint8_t bssids[][ETH_ALEN], int max) {
+    int n = 0;
+
+    pthread_mutex_lock(&local_ifaces_mutex);
+    for (int i = 0; local_ifaces && i < local_ifaces->num && n < max; i++) {
+        memcpy(bssids[n++], local_ifaces->iface[i].bssid_addr, ETH_ALEN);
+    }
+    pthread_mutex_unlock(&local_ifaces_mutex);
+
+    return n;
+}
+
+int is_local_bssid(uint8_t bssid_addr[]) {
+    int ret = 0;
+
+    pthread_mutex_lock(&local_ifaces_mutex);
+    for (int i = 0; local_ifaces && i < local_ifaces->num && !ret; i++) {
+        ret = mac_is_equal(local_ifaces->iface[i].bssid_addr, bssid_addr);
+    }
+    pthread_mutex_unlock(&local_ifaces_mutex);
+
+    return ret;
+}
+
+// Topic of a local interface, 0 if the bssid is not local.
+static uint32_t local_bssid_topic(uint8_t *bssid_addr) {
+    uint32_t topic = 0;
+
+    pthread_mutex_lock(&local_ifaces_mutex);
+    for (int i = 0; local_ifaces && i < local_ifaces->num; i++) {
+        if (mac_is_equal(local_ifaces->iface[i].bssid_addr, bssid_addr)) {
+            topic = ssid_topic(local_ifaces->iface[i].ssid);
+            break;
         }
     }
-    return 0;
+    pthread_mutex_unlock(&local_ifaces_mutex);
+
+    return topic;
 }
 
-void hostapd_array_insert(struct hostapd_sock_entry* entry) {
-    if (hostapd_sock_last < MAX_HOSTAPD_SOCKETS) {
-        hostapd_sock_last++;
-        hostapd_sock_arr[hostapd_sock_last] = entry;
+int hostapd_array_check_id(uint32_t id) {
+    return hostapd_array_get_entry(id) != NULL;
+}
+
+// Returns -1 if the table can not grow, the entry is not tracked then.
+int hostapd_array_insert(struct hostapd_sock_entry* entry) {
+    if (hostapd_sock_last + 1 >= hostapd_sock_size) {
+        int size = hostapd_sock_size ? hostapd_sock_size * 2 : 16;
+        struct hostapd_sock_entry **arr = realloc(hostapd_sock_arr, size * sizeof(*arr));
+
+        if (!arr) {
+            fprintf(stderr, "Failed to grow the hostapd socket table!\n");
+            return -1;
+        }
+        hostapd_sock_arr = arr;
+        hostapd_sock_size = size;
     }
 
+    hostapd_sock_last++;
+    hostapd_sock_arr[hostapd_sock_last] = entry;
+
+    // the object id is known once the subscriber is registered
+    entry->obj_id = entry->subscriber.obj.id;
+    entry->id_next = hostapd_id_hash[hostapd_hash(entry->id)];
+    hostapd_id_hash[hostapd_hash(entry->id)] = entry;
+    entry->obj_next = hostapd_obj_hash[hostapd_hash(entry->obj_id)];
+    hostapd_obj_hash[hostapd_hash(entry->obj_id)] = entry;
+
     for (int i = 0; i <= hostapd_sock_last; i++) {
         printf("%d: %d\n", i, hostapd_sock_arr[i]->id);
     }
+
+    local_ifaces_update();
+    return 0;
 }
 
 void hostapd_array_delete(uint32_t id) {
-    int i = 0;
-    int found_in_array = 0;
+    struct hostapd_sock_entry *entry = hostapd_array_get_entry(id);
+    struct hostapd_sock_entry **p;
 
-    if (hostapd_sock_last == -1) {
+    if (!entry) {
         return;
     }
 
-    for (i = 0; i <= hostapd_sock_last; i++) {
-        if (hostapd_sock_arr[i]->id == id) {
-            found_in_array = 1;
+    for (p = &hostapd_id_hash[hostapd_hash(entry->id)]; *p != entry; p = &(*p)->id_next);
+    *p = entry->id_next;
+    for (p = &hostapd_obj_hash[hostapd_hash(entry->obj_id)]; *p != entry; p = &(*p)->obj_next);
+    *p = entry->obj_next;
 
-            // in thisfunction we are freeing the struct
-            free(hostapd_sock_arr[i]);
+    for (int i = 0; i <= hostapd_sock_last; i++) {
+        if (hostapd_sock_arr[i] == entry) {
+            memmove(&hostapd_sock_arr[i], &hostapd_sock_arr[i + 1], (hostapd_sock_last - i) * sizeof(*hostapd_sock_arr));
+            hostapd_sock_last--;
             break;
         }
     }
+    local_ifaces_update();
 
-    for (int j = i; j <= hostapd_sock_last; j++) {
-        hostapd_sock_arr[j] = hostapd_sock_arr[j + 1];
+    // the peers keep sending the state of an ssid that is no longer served otherwise
+    if (network_config.network_option == 2) {
+        tcp_announce_topics();
     }
 
-    if (hostapd_sock_last > -1 && found_in_array) {
-        hostapd_sock_last--;
+    // in thisfunction we are freeing the struct
+    iwinfo_iface_unregister(entry->iface_name);
+    free(entry->sent_sta);
+    free(entry);
+}
+
+static struct hostapd_sock_entry *hostapd_entry_alloc() {
+    void *entry;
+
+    if (posix_memalign(&entry, CACHE_LINE_SIZE, sizeof(struct hostapd_sock_entry))) {
+        return NULL;
     }
+    memset(entry, 0, sizeof(struct hostapd_sock_entry));
+    return entry;
 }
 
 void blobmsg_add_macaddr(struct blob_buf *buf, const char *name, const uint8_t *addr) {
@@ -331,12 +683,12 @@ void blobmsg_add_macaddr(struct blob_buf *buf, const char *name, const uint8_t *
 }
 
 
-static int decide_function(probe_entry *prob_req, int req_type) {
-    if (mac_in_maclist(prob_req->client_addr)) {
+static int decide_function(uint8_t bssid_addr[], uint8_t client_addr[], struct verdict *v, int req_type) {
+    if (v->maclisted) {
         return 1;
     }
 
-    if (prob_req->counter < dawn_metric.min_probe_count) {
+    if (v->counter < dawn_metric.min_probe_count) {
         return 0;
     }
 
@@ -352,13 +704,64 @@ static int decide_function(probe_entry *prob_req, int req_type) {
         return 1;
     }
 
-    if (better_ap_available(prob_req->bssid_addr, prob_req->client_addr, 0)) {
+    if (better_ap_available_cached(bssid_addr, client_addr)) {
         return 0;
     }
 
     return 1;
 }
 
+// Work hostapd does not have to wait for, done once the notify is answered.
+static void notify_deferred_run(const char *method, struct blob_attr *msg, int forward) {
+    char *str = blobmsg_format_json(msg, true);
+
+    printf("METHOD new: %s : %s\n", method, str);
+    free(str);
+
+    if (forward) {
+        send_blob_attr_via_network(msg, (char *) method);
+    }
+}
+
+static void notify_deferred_cb(struct uloop_timeout *t) {
+    for (int i = 0; i < notify_deferred_num; i++) {
+        struct notify_deferred *d = &notify_deferred[i];
+
+        notify_deferred_run(d->method, d->msg, d->forward);
+        free(d->msg);
+    }
+    notify_deferred_num = 0;
+
+    verdict_cache_refresh();
+}
+
+static void notify_defer(const char *method, struct blob_attr *msg, int forward) {
+    if (notify_deferred_num >= notify_deferred_size) {
+        int new_size = notify_deferred_size ? notify_deferred_size * 2 : NOTIFY_DEFER_LEN;
+        struct notify_deferred *tmp = realloc(notify_deferred, new_size * sizeof(*tmp));
+
+        // hostapd waits a bit longer then, but nothing is lost
+        if (!tmp) {
+            notify_deferred_run(method, msg, forward);
+            return;
+        }
+        notify_deferred = tmp;
+        notify_deferred_size = new_size;
+    }
+
+    struct notify_deferred *d = &notify_deferred[notify_deferred_num];
+    d->msg = blob_memdup(msg);
+    if (!d->msg) {
+        notify_deferred_run(method, msg, forward);
+        return;
+    }
+    strncpy(d->method, method, sizeof(d->method) - 1);
+    d->method[sizeof(d->method) - 1] = '\0';
+    d->forward = forward;
+    notify_deferred_num++;
+
+    uloop_timeout_set(&notify_deferred_timer, 0);
+}
 
 static void hostapd_handle_remove(struct ubus_context *ctx,
                                   struct ubus_subscriber *s, uint32_t id) {
@@ -448,25 +851,18 @@ int parse_to_probe_req(struct blob_attr *msg, probe_entry *prob_req) {
 }
 
 static int handle_auth_req(struct blob_attr *msg) {
-
-    print_probe_array();
     auth_entry auth_req;
-    parse_to_auth_req(msg, &auth_req);
+    struct verdict v;
 
-    printf("AUTH Entry: ");
-    print_auth_entry(auth_req);
+    parse_to_auth_req(msg, &auth_req);
+    verdict_lookup(auth_req.bssid_addr, auth_req.client_addr, &v);
 
-    if (mac_in_maclist(auth_req.client_addr)) {
+    if (v.maclisted) {
         return WLAN_STATUS_SUCCESS;
     }
 
-    probe_entry tmp = probe_array_get_entry(auth_req.bssid_addr, auth_req.client_addr);
-
-    printf("Entry found\n");
-    print_probe_entry(tmp);
-
     // block if entry was not already found in probe database
-    if (!(mac_is_equal(tmp.bssid_addr, auth_req.bssid_addr) && mac_is_equal(tmp.client_addr, auth_req.client_addr))) {
+    if (!v.known) {
         printf("DENY AUTH!\n");
 
         if (dawn_metric.use_driver_recog) {
@@ -475,7 +871,7 @@ static int handle_auth_req(struct blob_attr *msg) {
         return dawn_metric.deny_auth_reason;
     }
 
-    if (!decide_function(&tmp, REQ_TYPE_AUTH)) {
+    if (!decide_function(auth_req.bssid_addr, auth_req.client_addr, &v, REQ_TYPE_AUTH)) {
         printf("DENY AUTH\n");
         if (dawn_metric.use_driver_recog) {
             insert_to_denied_req_array(auth_req, 1);
@@ -489,24 +885,18 @@ static int handle_auth_req(struct blob_attr *msg) {
 }
 
 static int handle_assoc_req(struct blob_attr *msg) {
-
-    print_probe_array();
     auth_entry auth_req;
+    struct verdict v;
+
     parse_to_auth_req(msg, &auth_req);
-    printf("ASSOC Entry: ");
-    print_auth_entry(auth_req);
+    verdict_lookup(auth_req.bssid_addr, auth_req.client_addr, &v);
 
-    if (mac_in_maclist(auth_req.client_addr)) {
+    if (v.maclisted) {
         return WLAN_STATUS_SUCCESS;
     }
 
-    probe_entry tmp = probe_array_get_entry(auth_req.bssid_addr, auth_req.client_addr);
-
-    printf("Entry found\n");
-    print_probe_entry(tmp);
-
     // block if entry was not already found in probe database
-    if (!(mac_is_equal(tmp.bssid_addr, auth_req.bssid_addr) && mac_is_equal(tmp.client_addr, auth_req.client_addr))) {
+    if (!v.known) {
         printf("DENY ASSOC!\n");
         if (dawn_metric.use_driver_recog) {
             insert_to_denied_req_array(auth_req, 1);
@@ -514,7 +904,7 @@ static int handle_assoc_req(struct blob_attr *msg) {
         return dawn_metric.deny_assoc_reason;
     }
 
-    if (!decide_function(&tmp, REQ_TYPE_ASSOC)) {
+    if (!decide_function(auth_req.bssid_addr, auth_req.client_addr, &v, REQ_TYPE_ASSOC)) {
         printf("DENY ASSOC\n");
         if (dawn_metric.use_driver_recog) {
             insert_to_denied_req_array(auth_req, 1);
@@ -529,13 +919,22 @@ static int handle_assoc_req(struct blob_attr *msg) {
 static int handle_probe_req(struct blob_attr *msg) {
     probe_entry prob_req;
     probe_entry tmp_prob_req;
+    struct verdict v;
 
-    if (parse_to_probe_req(msg, &prob_req) == 0) {
-        tmp_prob_req = insert_to_array(prob_req, 1);
-        send_blob_attr_via_network(msg, "probe");
+    if (parse_to_probe_req(msg, &prob_req) != 0) {
+        notify_defer("probe", msg, 0);
+        return WLAN_STATUS_SUCCESS;
     }
+    notify_defer("probe", msg, 1);
+
+    tmp_prob_req = insert_to_array(prob_req, 1);
 
-    if (!decide_function(&tmp_prob_req, REQ_TYPE_PROBE)) {
+    // the probe was just inserted, so only the maclist is looked up
+    verdict_lookup(tmp_prob_req.bssid_addr, tmp_prob_req.client_addr, &v);
+    v.known = 1;
+    v.counter = tmp_prob_req.counter;
+
+    if (!decide_function(tmp_prob_req.bssid_addr, tmp_prob_req.client_addr, &v, REQ_TYPE_PROBE)) {
         return WLAN_STATUS_AP_UNABLE_TO_HANDLE_NEW_STA; // no reason needed...
     }
     return WLAN_STATUS_SUCCESS;
@@ -573,6 +972,158 @@ static int handle_set_probe(struct blob_attr *msg) {
     return 0;
 }
 
+// Probes only carry the bssid, the ssid is known once the ap sent its client table.
+static int network_msg_relevant_bssid(uint8_t *bssid_addr) {
+    if (network_config.ssid_subscriptions <= 0) {
+        return 1;
+    }
+
+    ap ap_entry = ap_array_get_ap(bssid_addr);
+    if (!mac_is_equal(ap_entry.bssid_addr, bssid_addr)) {
+        return 1;
+    }
+    return serves_ssid((char *) ap_entry.ssid);
+}
+
+enum {
+    SYNC_DIGEST_CLIENTS,
+    SYNC_DIGEST_PROBES,
+    SYNC_DIGEST_LOCAL,
+    __SYNC_DIGEST_MAX,
+};
+
+static const struct blobmsg_policy sync_digest_policy[__SYNC_DIGEST_MAX] = {
+        [SYNC_DIGEST_CLIENTS] = {.name = "clients", .type = BLOBMSG_TYPE_INT32},
+        [SYNC_DIGEST_PROBES] = {.name = "probes", .type = BLOBMSG_TYPE_INT32},
+        [SYNC_DIGEST_LOCAL] = {.name = "local", .type = BLOBMSG_TYPE_INT8},
+};
+
+enum {
+    SYNC_TABLE_CONTINUED,
+    __SYNC_TABLE_MAX,
+};
+
+static const struct blobmsg_policy sync_table_policy[__SYNC_TABLE_MAX] = {
+        [SYNC_TABLE_CONTINUED] = {.name = "continued", .type = BLOBMSG_TYPE_INT8},
+};
+
+enum {
+    SYNC_DIGESTS,
+    SYNC_TABLES,
+    SYNC_PROBES,
+    __SYNC_MAX,
+};
+
+static const struct blobmsg_policy sync_policy[__SYNC_MAX] = {
+        [SYNC_DIGESTS] = {.name = "digests", .type = BLOBMSG_TYPE_TABLE},
+        [SYNC_TABLES] = {.name = "tables", .type = BLOBMSG_TYPE_ARRAY},
+        [SYNC_PROBES] = {.name = "probes", .type = BLOBMSG_TYPE_ARRAY},
+};
+
+static void send_sync_chunk(struct blob_buf *b) {
+    char *str = build_network_msg(b->head, "syncdata");
+
+    if (send_tcp_reply(str)) {
+        fprintf(stderr, "Could not send a sync chunk of %d bytes to the peer!\n", (int) strlen(str));
+    }
+    free(str);
+}
+
+// A peer joined and sent the digests of its database, answer with everything it misses.
+static int handle_sync_req(struct blob_attr *msg) {
+    static struct sync_digest digests[ARRAY_AP_LEN];
+    struct blob_attr *tb[__SYNC_MAX];
+    struct blob_attr *attr;
+    int num_digests = 0;
+    int rem;
+
+    blobmsg_parse(sync_policy, __SYNC_MAX, tb, blob_data(msg), blob_len(msg));
+
+    if (tb[SYNC_DIGESTS]) {
+        blobmsg_for_each_attr(attr, tb[SYNC_DIGESTS], rem) {
+            struct blob_attr *tb_digest[__SYNC_DIGEST_MAX];
+
+            if (num_digests >= ARRAY_AP_LEN) {
+                break;
+            }
+
+            blobmsg_parse(sync_digest_policy, __SYNC_DIGEST_MAX, tb_digest, blobmsg_data(attr), blobmsg_data_len(attr));
+            if (!tb_digest[SYNC_DIGEST_CLIENTS] || !tb_digest[SYNC_DIGEST_PROBES] ||
+                hwaddr_aton(blobmsg_name(attr), digests[num_digests].bssid_addr)) {
+                continue;
+            }
+            digests[num_digests].clients = blobmsg_get_u32(tb_digest[SYNC_DIGEST_CLIENTS]);
+            digests[num_digests].probes = blobmsg_get_u32(tb_digest[SYNC_DIGEST_PROBES]);
+            digests[num_digests].local = tb_digest[SYNC_DIGEST_LOCAL] && blobmsg_get_u8(tb_digest[SYNC_DIGEST_LOCAL]);
+            num_digests++;
+        }
+    }
+
+    int num_aps = build_sync_data(&b_sync, digests, num_digests, send_sync_chunk);
+    printf("Peer missed %d aps, sent them\n", num_aps);
+
+    return 0;
+}
+
+static int handle_sync_data(struct blob_attr *msg) {
+    struct blob_attr *tb[__SYNC_MAX];
+    struct blob_attr *attr, *cur;
+    int rem, rem_attr;
+
+    blobmsg_parse(sync_policy, __SYNC_MAX, tb, blob_data(msg), blob_len(msg));
+
+    // the parsers expect a message head, so every entry is copied into its own buffer
+    if (tb[SYNC_TABLES]) {
+        blobmsg_for_each_attr(attr, tb[SYNC_TABLES], rem) {
+            struct blob_attr *tb_topic[__TOPIC_MAX];
+            struct blob_attr *tb_table[__SYNC_TABLE_MAX];
+            uint8_t bssid_addr[ETH_ALEN];
+
+            blobmsg_parse(topic_policy, __TOPIC_MAX, tb_topic, blobmsg_data(attr), blobmsg_data_len(attr));
+            if (network_config.ssid_subscriptions > 0 && tb_topic[TOPIC_SSID] &&
+                !serves_ssid(blobmsg_get_string(tb_topic[TOPIC_SSID]))) {
+                continue;
+            }
+
+            // hostapd is the authority for the own aps, the copy of the peer may be from before a restart
+            if (tb_topic[TOPIC_BSSID] && hwaddr_aton(blobmsg_data(tb_topic[TOPIC_BSSID]), bssid_addr) == 0 &&
+                is_local_bssid(bssid_addr)) {
+                continue;
+            }
+
+            blob_buf_init(&b_sync, 0);
+            blobmsg_for_each_attr(cur, attr, rem_attr) {
+                blobmsg_add_blob(&b_sync, cur);
+            }
+
+            // the rest of a large table must not replace its first part
+            blobmsg_parse(sync_table_policy, __SYNC_TABLE_MAX, tb_table, blobmsg_data(attr), blobmsg_data_len(attr));
+            if (tb_table[SYNC_TABLE_CONTINUED] && blobmsg_get_u8(tb_table[SYNC_TABLE_CONTINUED])) {
+                parse_to_clients_delta(b_sync.head);
+            } else {
+                parse_to_clients(b_sync.head, 0, 0);
+            }
+        }
+    }
+
+    if (tb[SYNC_PROBES]) {
+        blobmsg_for_each_attr(attr, tb[SYNC_PROBES], rem) {
+            probe_entry entry;
+
+            blob_buf_init(&b_sync, 0);
+            blobmsg_for_each_attr(cur, attr, rem_attr) {
+                blobmsg_add_blob(&b_sync, cur);
+            }
+            if (parse_to_probe_req(b_sync.head, &entry) == 0 && !is_local_bssid(entry.bssid_addr) &&
+                network_msg_relevant_bssid(entry.bssid_addr)) {
+                insert_to_array(entry, 0);
+            }
+        }
+    }
+
+    return 0;
+}
+
 int handle_network_msg(char *msg) {
     struct blob_attr *tb[__NETWORK_MAX];
     char *method;
@@ -607,11 +1158,30 @@ int handle_network_msg(char *msg) {
 
     if (strncmp(method, "probe", 5) == 0) {
         probe_entry entry;
-        if (parse_to_probe_req(data_buf.head, &entry) == 0) {
+        if (parse_to_probe_req(data_buf.head, &entry) == 0 && network_msg_relevant_bssid(entry.bssid_addr)) {
             insert_to_array(entry, 0);
         }
     } else if (strncmp(method, "clients", 5) == 0) {
-        parse_to_clients(data_buf.head, 0, 0);
+        struct blob_attr *tb_topic[__TOPIC_MAX];
+        blobmsg_parse(topic_policy, __TOPIC_MAX, tb_topic, blob_data(data_buf.head), blob_len(data_buf.head));
+
+        if (network_config.ssid_subscriptions > 0 && tb_topic[TOPIC_SSID] &&
+            !serves_ssid(blobmsg_get_string(tb_topic[TOPIC_SSID]))) {
+            return 0;
+        }
+
+        // the sender serves this ap, directed control messages go there
+        uint8_t bssid_addr[ETH_ALEN];
+        if (network_config.network_option == 2 && tb_topic[TOPIC_BSSID] &&
+            hwaddr_aton(blobmsg_data(tb_topic[TOPIC_BSSID]), bssid_addr) == 0) {
+            tcp_set_bssid_owner(bssid_addr);
+        }
+
+        if (strcmp(method, "clientsdelta") == 0) {
+            parse_to_clients_delta(data_buf.head);
+        } else {
+            parse_to_clients(data_buf.head, 0, 0);
+        }
     } else if (strncmp(method, "deauth", 5) == 0) {
         printf("METHOD DEAUTH\n");
         handle_deauth_req(data_buf.head);
@@ -620,29 +1190,69 @@ int handle_network_msg(char *msg) {
         handle_set_probe(data_buf.head);
     } else if (strncmp(method, "addmac", 5) == 0) {
         parse_add_mac_to_file(data_buf.head);
+    } else if (strcmp(method, "syncreq") == 0) {
+        handle_sync_req(data_buf.head);
+    } else if (strcmp(method, "syncdata") == 0) {
+        handle_sync_data(data_buf.head);
     }
 
     return 0;
 }
 
 
-int send_blob_attr_via_network(struct blob_attr *msg, char *method) {
+static uint32_t network_msg_topic(struct blob_attr *msg, const char *method) {
+    struct blob_attr *tb[__TOPIC_MAX];
+    uint8_t bssid_addr[ETH_ALEN];
 
-    if (!msg) {
-        return -1;
+    if (strcmp(method, "probe") != 0 && strcmp(method, "clients") != 0 && strcmp(method, "clientsdelta") != 0) {
+        return 0;
+    }
+
+    blobmsg_parse(topic_policy, __TOPIC_MAX, tb, blob_data(msg), blob_len(msg));
+
+    if (tb[TOPIC_SSID]) {
+        return ssid_topic(blobmsg_get_string(tb[TOPIC_SSID]));
+    }
+
+    if (tb[TOPIC_BSSID] && hwaddr_aton(blobmsg_data(tb[TOPIC_BSSID]), bssid_addr) == 0) {
+        return local_bssid_topic(bssid_addr);
+    }
+    return 0;
+}
+
+static int network_msg_class(const char *method) {
+    // state updates are refreshed periodically, losing one is cheap
+    if (strcmp(method, "probe") == 0 || strcmp(method, "clients") == 0 || strcmp(method, "clientsdelta") == 0) {
+        return TCP_MSG_BULK;
     }
+    return TCP_MSG_CONTROL;
+}
 
+char *build_network_msg(struct blob_attr *msg, char *method) {
     char *data_str;
     char *str;
+
     data_str = blobmsg_format_json(msg, true);
     blob_buf_init(&b_send_network, 0);
     blobmsg_add_string(&b_send_network, "method", method);
     blobmsg_add_string(&b_send_network, "data", data_str);
 
     str = blobmsg_format_json(b_send_network.head, true);
+    free(data_str);
+
+    return str;
+}
+
+int send_blob_attr_via_network(struct blob_attr *msg, char *method) {
+
+    if (!msg) {
+        return -1;
+    }
+
+    char *str = build_network_msg(msg, method);
 
     if (network_config.network_option == 2) {
-        send_tcp(str);
+        send_tcp(str, network_msg_class(method), network_msg_topic(msg, method));
     } else {
         if (network_config.use_symm_enc) {
             send_string_enc(str);
@@ -651,43 +1261,139 @@ int send_blob_attr_via_network(struct blob_attr *msg, char *method) {
         }
     }
 
-    free(data_str);
     free(str);
 
     return 0;
 }
 
-static int hostapd_notify(struct ubus_context *ctx, struct ubus_object *obj,
-                          struct ubus_request_data *req, const char *method,
-                          struct blob_attr *msg) {
-    char *str;
-    str = blobmsg_format_json(msg, true);
-    printf("METHOD new: %s : %s\n", method, str);
-    free(str);
+int send_blob_attr_to_bssids(struct blob_attr *msg, char *method, uint8_t bssids[][ETH_ALEN], int num_bssids) {
 
-    struct hostapd_sock_entry *entry;
-    struct ubus_subscriber *subscriber;
+    if (!msg) {
+        return -1;
+    }
 
-    subscriber = container_of(obj, struct ubus_subscriber, obj);
-    entry = container_of(subscriber, struct hostapd_sock_entry, subscriber);
+    // udp only reaches everyone at once
+    if (network_config.network_option == 2 && num_bssids > 0) {
+        char *str = build_network_msg(msg, method);
+        int sent = send_tcp_directed(str, network_msg_class(method), bssids, num_bssids);
 
-    struct blob_attr *cur; int rem;
-    blob_buf_init(&b_notify, 0);
-    blobmsg_for_each_attr(cur, msg, rem){
-        blobmsg_add_blob(&b_notify, cur);
+        free(str);
+        if (sent > 0) {
+            return 0;
+        }
+    }
+
+    return send_blob_attr_via_network(msg, method);
+}
+
+// Station that hostapd let associate, added right away instead of waiting for get_clients.
+// Only this station is sent to the other nodes, once hostapd got its answer.
+static void client_event_connect(struct hostapd_sock_entry *entry, struct blob_attr *msg, uint8_t authorized) {
+    hostapd_notify_entry notify_req;
+    client client_entry;
+    char mac_buf[20];
+    void *tbl, *sta;
+
+    if (parse_to_hostapd_notify(msg, &notify_req)) {
+        return;
+    }
+
+    memset(&client_entry, 0, sizeof(client_entry));
+    memcpy(client_entry.bssid_addr, entry->bssid_addr, ETH_ALEN);
+    memcpy(client_entry.client_addr, notify_req.client_addr, ETH_ALEN);
+    client_entry.freq = entry->freq;
+    client_entry.ht_supported = entry->ht;
+    client_entry.vht_supported = entry->vht;
+    client_entry.auth = 1;
+    client_entry.assoc = 1;
+    client_entry.authorized = authorized;
+    insert_client_to_array(client_entry);
+
+    blob_buf_init(&b_event, 0);
+    blobmsg_add_macaddr(&b_event, "bssid", entry->bssid_addr);
+    blobmsg_add_string(&b_event, "ssid", entry->ssid);
+    blobmsg_add_u32(&b_event, "freq", entry->freq);
+    blobmsg_add_u8(&b_event, "ht_supported", entry->ht);
+    blobmsg_add_u8(&b_event, "vht_supported", entry->vht);
+    blobmsg_add_u32(&b_event, "channel_utilization", entry->chan_util_average);
+    blobmsg_add_u32(&b_event, "collision_domain", network_config.collision_domain);
+    blobmsg_add_u32(&b_event, "bandwidth", network_config.bandwidth);
+    blobmsg_add_u32(&b_event, "num_sta", client_array_count_bssid(entry->bssid_addr));
+
+    tbl = blobmsg_open_table(&b_event, "clients");
+    sprintf(mac_buf, MACSTR, MAC2STR(notify_req.client_addr));
+    sta = blobmsg_open_table(&b_event, mac_buf);
+    blobmsg_add_u8(&b_event, "auth", 1);
+    blobmsg_add_u8(&b_event, "assoc", 1);
+    blobmsg_add_u8(&b_event, "authorized", authorized);
+    blobmsg_close_table(&b_event, sta);
+    blobmsg_close_table(&b_event, tbl);
+
+    notify_defer("clientsdelta", b_event.head, 1);
+}
+
+static int hostapd_notify(struct ubus_context *ctx, struct ubus_object *obj,
+                          struct ubus_request_data *req, const char *method,
+                          struct blob_attr *msg) {
+    struct hostapd_sock_entry *entry;
+    struct ubus_subscriber *subscriber;
+
+    subscriber = container_of(obj, struct ubus_subscriber, obj);
+    entry = container_of(subscriber, struct hostapd_sock_entry, subscriber);
+
+    struct blob_attr *cur; int rem;
+    blob_buf_init(&b_notify, 0);
+    blobmsg_for_each_attr(cur, msg, rem){
+        blobmsg_add_blob(&b_notify, cur);
     }
 
     blobmsg_add_macaddr(&b_notify, "bssid", entry->bssid_addr);
     blobmsg_add_string(&b_notify, "ssid", entry->ssid);
 
+    // hostapd waits for the verdict, log and forward afterwards
     if (strncmp(method, "probe", 5) == 0) {
         return handle_probe_req(b_notify.head);
     } else if (strncmp(method, "auth", 4) == 0) {
+        notify_defer(method, b_notify.head, 0);
         return handle_auth_req(b_notify.head);
     } else if (strncmp(method, "assoc", 5) == 0) {
-        return handle_assoc_req(b_notify.head);
-    } else if (strncmp(method, "deauth", 6) == 0) {
-        send_blob_attr_via_network(b_notify.head, "deauth");
+        notify_defer(method, b_notify.head, 0);
+        int ret = handle_assoc_req(b_notify.head);
+        if (ret == WLAN_STATUS_SUCCESS) {
+            client_event_connect(entry, b_notify.head, 0);
+        }
+        return ret;
+    } else if (strncmp(method, "sta-authorized", 14) == 0) {
+        notify_defer(method, b_notify.head, 0);
+        client_event_connect(entry, b_notify.head, 1);
+        return 0;
+    }
+
+    char *str = blobmsg_format_json(msg, true);
+    printf("METHOD new: %s : %s\n", method, str);
+    free(str);
+
+    if (strncmp(method, "bss-transition-response", 23) == 0) {
+        handle_bss_transition_response(b_notify.head);
+        return 0;
+    }
+
+    // a disassociated station is gone just like a deauthenticated one
+    if (strncmp(method, "deauth", 6) == 0 || strncmp(method, "disassoc", 8) == 0) {
+        hostapd_notify_entry notify_req;
+        uint8_t targets[NOTIFY_MAX_TARGETS][ETH_ALEN];
+        int num_targets = 0;
+
+        if (parse_to_hostapd_notify(b_notify.head, &notify_req) == 0) {
+            btm_client_left(entry->bssid_addr, notify_req.client_addr);
+
+            pthread_mutex_lock(&probe_array_mutex);
+            num_targets = probe_array_best_bssids(notify_req.client_addr, entry->bssid_addr, targets,
+                                                  NOTIFY_MAX_TARGETS);
+            pthread_mutex_unlock(&probe_array_mutex);
+        }
+
+        send_blob_attr_to_bssids(b_notify.head, "deauth", targets, num_targets);
         return handle_deauth_req(b_notify.head);
     }
     return 0;
@@ -698,6 +1404,7 @@ static int add_subscriber(char *name) {
     char subscribe_name[300];
     int ret;
     struct hostapd_sock_entry *hostapd_entry;
+    struct iwinfo_iface *iface;
     uint32_t id = 0;
 
 
@@ -714,27 +1421,48 @@ static int add_subscriber(char *name) {
         return 0;
     }
 
-    hostapd_entry = calloc(1, sizeof(struct hostapd_sock_entry));
+    hostapd_entry = hostapd_entry_alloc();
+    if (!hostapd_entry) {
+        return -1;
+    }
     hostapd_entry->id = id;
     hostapd_entry->subscriber.remove_cb = hostapd_handle_remove;
     hostapd_entry->subscriber.cb = hostapd_notify;
 
+    iface = iwinfo_iface_register(name);
+    if (!iface) {
+        free(hostapd_entry);
+        return -1;
+    }
+
     strcpy(hostapd_entry->iface_name, name);
-    get_bssid(name, hostapd_entry->bssid_addr);
-    get_ssid(name, hostapd_entry->ssid);
+    memcpy(hostapd_entry->bssid_addr, iface->bssid_addr, ETH_ALEN);
+    strncpy(hostapd_entry->ssid, iface->ssid, SSID_MAX_LEN);
+    hostapd_entry->freq = iface->freq;
 
     // TODO: here we need to add ht and vht supported!!!
     // actually we wanted to use an ubus call but for now we can use libiwinfo
-    hostapd_entry->ht = (uint8_t) support_ht(name);
-    hostapd_entry->vht = (uint8_t) support_vht(name);
+    hostapd_entry->ht = (uint8_t) iface->ht;
+    hostapd_entry->vht = (uint8_t) iface->vht;
 
 
     ret = ubus_register_subscriber(ctx, &hostapd_entry->subscriber);
     ret = ubus_subscribe( ctx, &hostapd_entry->subscriber, id);
 
-    hostapd_array_insert(hostapd_entry);
+    // notifies must not arrive for an entry nobody tracks
+    if (hostapd_array_insert(hostapd_entry)) {
+        ubus_unsubscribe(ctx, &hostapd_entry->subscriber, id);
+        ubus_unregister_subscriber(ctx, &hostapd_entry->subscriber);
+        iwinfo_iface_unregister(name);
+        free(hostapd_entry);
+        return -1;
+    }
     fprintf(stderr, "Watching object %08x: %s\n", id, ubus_strerror(ret));
 
+    if (network_config.network_option == 2) {
+        tcp_announce_topics();
+    }
+
     respond_to_notify(id);
 
     return 0;
@@ -762,6 +1490,80 @@ static int subscribe_to_hostapd_interfaces(const char *hostapd_dir) {
     return 0;
 }
 
+// hostapd creates its control socket when an interface comes up.
+// The ubus object may be registered a bit later, hostapd_object_add_cb catches that case.
+static void hostapd_dir_cb(struct uloop_fd *u, unsigned int events) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while ((len = read(u->fd, buf, sizeof(buf))) > 0) {
+        const struct inotify_event *ev;
+
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *) p;
+
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                // directory is gone, the rescan timer sets up the watch again
+                fprintf(stderr, "Lost watch on %s\n", hostapd_dir_glob);
+                uloop_fd_delete(u);
+                close(u->fd);
+                u->fd = -1;
+                uloop_timeout_set(&hostapd_timer, timeout_config.update_hostapd * 1000);
+                return;
+            }
+
+            if (ev->len && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                add_subscriber((char *) ev->name);
+            }
+        }
+    }
+}
+
+static int watch_hostapd_dir(const char *hostapd_dir) {
+    int fd;
+
+    if (hostapd_dir_fd.fd >= 0) {
+        return 0;
+    }
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    if (inotify_add_watch(fd, hostapd_dir, IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        fprintf(stderr, "Failed to watch %s\n", hostapd_dir);
+        close(fd);
+        return -1;
+    }
+
+    hostapd_dir_fd.fd = fd;
+    hostapd_dir_fd.cb = hostapd_dir_cb;
+    uloop_fd_add(&hostapd_dir_fd, ULOOP_READ);
+    return 0;
+}
+
+// Removed objects are reported to the subscriber by hostapd_handle_remove.
+static void hostapd_object_add_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+                                  const char *type, struct blob_attr *msg) {
+    struct blob_attr *tb[__UBUS_OBJECT_EVENT_MAX];
+    const char *path;
+
+    blobmsg_parse(ubus_object_event_policy, __UBUS_OBJECT_EVENT_MAX, tb, blob_data(msg), blob_len(msg));
+
+    if (!tb[UBUS_OBJECT_EVENT_PATH]) {
+        return;
+    }
+
+    path = blobmsg_get_string(tb[UBUS_OBJECT_EVENT_PATH]);
+    if (strncmp(path, "hostapd.", 8) != 0 || strlen(path + 8) >= MAX_INTERFACE_NAME) {
+        return;
+    }
+
+    add_subscriber((char *) path + 8);
+}
+
 int dawn_init_ubus(const char *ubus_socket, const char *hostapd_dir) {
     uloop_init();
     signal(SIGPIPE, SIG_IGN);
@@ -779,6 +1581,12 @@ int dawn_init_ubus(const char *ubus_socket, const char *hostapd_dir) {
     // set dawn metric
     dawn_metric = uci_get_dawn_metric();
 
+    // attach new interfaces as soon as hostapd registers them
+    hostapd_object_event.cb = hostapd_object_add_cb;
+    if (ubus_register_event_handler(ctx, &hostapd_object_event, "ubus.object.add")) {
+        fprintf(stderr, "Failed to listen for ubus objects\n");
+    }
+
     uloop_timeout_add(&hostapd_timer);
 
     // remove probe
@@ -886,6 +1694,54 @@ dump_client_table(struct blob_attr *head, int len, const char *bssid_addr, uint3
     return station_count;
 }
 
+static ap parse_to_ap(struct blob_attr **tb, int num_stations) {
+    ap ap_entry;
+    hwaddr_aton(blobmsg_data(tb[CLIENT_TABLE_BSSID]), ap_entry.bssid_addr);
+    ap_entry.freq = blobmsg_get_u32(tb[CLIENT_TABLE_FREQ]);
+
+    if(tb[CLIENT_TABLE_HT]){
+        ap_entry.ht = blobmsg_get_u8(tb[CLIENT_TABLE_HT]);
+    } else {
+        ap_entry.ht = false;
+    }
+
+    if(tb[CLIENT_TABLE_VHT]){
+        ap_entry.vht = blobmsg_get_u8(tb[CLIENT_TABLE_VHT]);
+    } else
+    {
+        ap_entry.vht = false;
+    }
+
+    if(tb[CLIENT_TABLE_CHAN_UTIL]) {
+        ap_entry.channel_utilization = blobmsg_get_u32(tb[CLIENT_TABLE_CHAN_UTIL]);
+    } else // if this is not existing set to 0?
+    {
+        ap_entry.channel_utilization = 0;
+    }
+
+    if(tb[CLIENT_TABLE_SSID]) {
+        strcpy((char *) ap_entry.ssid, blobmsg_get_string(tb[CLIENT_TABLE_SSID]));
+    }
+
+    if (tb[CLIENT_TABLE_COL_DOMAIN]) {
+        ap_entry.collision_domain = blobmsg_get_u32(tb[CLIENT_TABLE_COL_DOMAIN]);
+    } else {
+        ap_entry.collision_domain = -1;
+    }
+
+    if (tb[CLIENT_TABLE_BANDWIDTH]) {
+        ap_entry.bandwidth = blobmsg_get_u32(tb[CLIENT_TABLE_BANDWIDTH]);
+    } else {
+        ap_entry.bandwidth = -1;
+    }
+
+    ap_entry.station_count = num_stations;
+
+    insert_to_ap_array(ap_entry);
+
+    return ap_entry;
+}
+
 int parse_to_clients(struct blob_attr *msg, int do_kick, uint32_t id) {
     struct blob_attr *tb[__CLIENT_TABLE_MAX];
 
@@ -904,59 +1760,189 @@ int parse_to_clients(struct blob_attr *msg, int do_kick, uint32_t id) {
     blobmsg_parse(client_table_policy, __CLIENT_TABLE_MAX, tb, blob_data(msg), blob_len(msg));
 
     if (tb[CLIENT_TABLE] && tb[CLIENT_TABLE_BSSID] && tb[CLIENT_TABLE_FREQ]) {
+        time_t refreshed = time(0);
         int num_stations = 0;
          num_stations = dump_client_table(blobmsg_data(tb[CLIENT_TABLE]), blobmsg_data_len(tb[CLIENT_TABLE]),
                           blobmsg_data(tb[CLIENT_TABLE_BSSID]), blobmsg_get_u32(tb[CLIENT_TABLE_FREQ]),
                           blobmsg_get_u8(tb[CLIENT_TABLE_HT]), blobmsg_get_u8(tb[CLIENT_TABLE_VHT]));
-        ap ap_entry;
-        hwaddr_aton(blobmsg_data(tb[CLIENT_TABLE_BSSID]), ap_entry.bssid_addr);
-        ap_entry.freq = blobmsg_get_u32(tb[CLIENT_TABLE_FREQ]);
+        ap ap_entry = parse_to_ap(tb, num_stations);
 
-        if(tb[CLIENT_TABLE_HT]){
-            ap_entry.ht = blobmsg_get_u8(tb[CLIENT_TABLE_HT]);
-        } else {
-            ap_entry.ht = false;
-        }
+        // the full table replaces everything we know about this ap
+        client_array_remove_bssid_before(ap_entry.bssid_addr, refreshed);
 
-        if(tb[CLIENT_TABLE_VHT]){
-            ap_entry.vht = blobmsg_get_u8(tb[CLIENT_TABLE_VHT]);
-        } else
-        {
-            ap_entry.vht = false;
+        if (do_kick && dawn_metric.kicking) {
+            kick_clients(ap_entry.bssid_addr, id);
         }
+    }
+    return 0;
+}
 
-        if(tb[CLIENT_TABLE_CHAN_UTIL]) {
-            ap_entry.channel_utilization = blobmsg_get_u32(tb[CLIENT_TABLE_CHAN_UTIL]);
-        } else // if this is not existing set to 0?
-        {
-            ap_entry.channel_utilization = 0;
-        }
+int parse_to_clients_delta(struct blob_attr *msg) {
+    struct blob_attr *tb[__CLIENT_TABLE_MAX];
+    struct blob_attr *attr;
+    uint8_t bssid_addr[ETH_ALEN];
+    uint8_t client_addr[ETH_ALEN];
+    int rem;
+
+    if (!msg || blob_len(msg) <= 0) {
+        return -1;
+    }
+
+    blobmsg_parse(client_table_policy, __CLIENT_TABLE_MAX, tb, blob_data(msg), blob_len(msg));
+
+    if (!tb[CLIENT_TABLE_BSSID] || !tb[CLIENT_TABLE_FREQ] || !tb[CLIENT_TABLE_NUM_STA] ||
+        hwaddr_aton(blobmsg_data(tb[CLIENT_TABLE_BSSID]), bssid_addr)) {
+        return -1;
+    }
 
-        if(tb[CLIENT_TABLE_SSID]) {
-            strcpy((char *) ap_entry.ssid, blobmsg_get_string(tb[CLIENT_TABLE_SSID]));
+    if (tb[CLIENT_TABLE_REMOVED]) {
+        blobmsg_for_each_attr(attr, tb[CLIENT_TABLE_REMOVED], rem) {
+            if (hwaddr_aton(blobmsg_get_string(attr), client_addr) == 0) {
+                client_array_delete_station(bssid_addr, client_addr);
+            }
         }
+    }
 
-        if (tb[CLIENT_TABLE_COL_DOMAIN]) {
-            ap_entry.collision_domain = blobmsg_get_u32(tb[CLIENT_TABLE_COL_DOMAIN]);
-        } else {
-            ap_entry.collision_domain = -1;
+    // unchanged stations are not part of the delta
+    client_array_touch_bssid(bssid_addr);
+
+    if (tb[CLIENT_TABLE]) {
+        dump_client_table(blobmsg_data(tb[CLIENT_TABLE]), blobmsg_data_len(tb[CLIENT_TABLE]),
+                          blobmsg_data(tb[CLIENT_TABLE_BSSID]), blobmsg_get_u32(tb[CLIENT_TABLE_FREQ]),
+                          blobmsg_get_u8(tb[CLIENT_TABLE_HT]), blobmsg_get_u8(tb[CLIENT_TABLE_VHT]));
+    }
+
+    parse_to_ap(tb, blobmsg_get_u32(tb[CLIENT_TABLE_NUM_STA]));
+
+    return 0;
+}
+
+static int sta_fingerprint_cmp(const void *a, const void *b) {
+    return memcmp(((const struct sta_fingerprint *) a)->client_addr,
+                  ((const struct sta_fingerprint *) b)->client_addr, ETH_ALEN);
+}
+
+// Fingerprint the stations of a client table, sorted by mac.
+static int collect_sta_fingerprints(struct blob_attr *clients, struct sta_fingerprint **sta, int *size) {
+    struct blob_attr *attr;
+    int num = 0;
+    int rem;
+
+    blobmsg_for_each_attr(attr, clients, rem) {
+        if (num >= *size) {
+            int new_size = *size ? *size * 2 : 16;
+            struct sta_fingerprint *tmp = realloc(*sta, new_size * sizeof(**sta));
+            if (!tmp) {
+                break;
+            }
+            *sta = tmp;
+            *size = new_size;
         }
 
-        if (tb[CLIENT_TABLE_BANDWIDTH]) {
-            ap_entry.bandwidth = blobmsg_get_u32(tb[CLIENT_TABLE_BANDWIDTH]);
-        } else {
-            ap_entry.bandwidth = -1;
+        struct sta_fingerprint *fp = &(*sta)[num];
+        if (hwaddr_aton(blobmsg_name(attr), fp->client_addr)) {
+            continue;
         }
+        fp->hash = hash_fnv1a(blobmsg_data(attr), blobmsg_data_len(attr));
+        fp->attr = attr;
+        num++;
+    }
 
-        ap_entry.station_count = num_stations;
+    qsort(*sta, num, sizeof(**sta), sta_fingerprint_cmp);
+    return num;
+}
 
-        insert_to_ap_array(ap_entry);
+// Send only the stations that changed since the last update plus the ap metrics.
+// Returns -1 if the full table has to be sent instead.
+static int send_clients_delta(struct hostapd_sock_entry *entry, struct blob_attr *msg) {
+    static struct sta_fingerprint *cur;
+    static int cur_size;
+    struct blob_attr *tb[__CLIENT_TABLE_MAX];
+    char mac_buf[20];
+    void *list;
 
-        if (do_kick && dawn_metric.kicking) {
-            kick_clients(ap_entry.bssid_addr, id);
+    blobmsg_parse(client_table_policy, __CLIENT_TABLE_MAX, tb, blob_data(msg), blob_len(msg));
+    if (!tb[CLIENT_TABLE] || !tb[CLIENT_TABLE_FREQ]) {
+        return -1;
+    }
+    entry->freq = blobmsg_get_u32(tb[CLIENT_TABLE_FREQ]);
+
+    int num = collect_sta_fingerprints(tb[CLIENT_TABLE], &cur, &cur_size);
+    int changes = 0;
+    time_t now = time(0);
+    int full = now - entry->full_sync_time >= CLIENTS_FULL_SYNC_INTERVAL;
+
+    if (!full) {
+        blob_buf_init(&b_delta, 0);
+        blobmsg_add_macaddr(&b_delta, "bssid", entry->bssid_addr);
+        blobmsg_add_string(&b_delta, "ssid", entry->ssid);
+        blobmsg_add_u32(&b_delta, "freq", blobmsg_get_u32(tb[CLIENT_TABLE_FREQ]));
+        blobmsg_add_u8(&b_delta, "ht_supported", entry->ht);
+        blobmsg_add_u8(&b_delta, "vht_supported", entry->vht);
+        blobmsg_add_u32(&b_delta, "channel_utilization", entry->chan_util_average);
+        blobmsg_add_u32(&b_delta, "collision_domain", network_config.collision_domain);
+        blobmsg_add_u32(&b_delta, "bandwidth", network_config.bandwidth);
+        blobmsg_add_u32(&b_delta, "num_sta", num);
+
+        // merge the sorted lists: new or changed stations
+        list = blobmsg_open_table(&b_delta, "clients");
+        for (int i = 0, j = 0; i < num; i++) {
+            while (j < entry->sent_sta_num && sta_fingerprint_cmp(&entry->sent_sta[j], &cur[i]) < 0) {
+                j++;
+            }
+            if (j < entry->sent_sta_num && sta_fingerprint_cmp(&entry->sent_sta[j], &cur[i]) == 0 &&
+                entry->sent_sta[j].hash == cur[i].hash) {
+                continue;
+            }
+            blobmsg_add_blob(&b_delta, cur[i].attr);
+            changes++;
+        }
+        blobmsg_close_table(&b_delta, list);
+
+        // stations that are gone
+        list = blobmsg_open_array(&b_delta, "removed");
+        for (int i = 0, j = 0; j < entry->sent_sta_num; j++) {
+            while (i < num && sta_fingerprint_cmp(&cur[i], &entry->sent_sta[j]) < 0) {
+                i++;
+            }
+            if (i < num && sta_fingerprint_cmp(&cur[i], &entry->sent_sta[j]) == 0) {
+                continue;
+            }
+            sprintf(mac_buf, MACSTR, MAC2STR(entry->sent_sta[j].client_addr));
+            blobmsg_add_string(&b_delta, NULL, mac_buf);
+            changes++;
+        }
+        blobmsg_close_array(&b_delta, list);
+
+        // nothing the other nodes do not know yet, only refresh after the silence interval
+        if (changes || dawn_metric.chan_util_update_delta <= 0 ||
+            abs(entry->chan_util_average - entry->sent_chan_util) >= dawn_metric.chan_util_update_delta ||
+            now - entry->sent_time >= update_silence()) {
+            send_blob_attr_via_network(b_delta.head, "clientsdelta");
+            entry->sent_chan_util = entry->chan_util_average;
+            entry->sent_time = now;
         }
+    } else {
+        entry->sent_chan_util = entry->chan_util_average;
+        entry->sent_time = now;
+        entry->full_sync_time = now;
+    }
+
+    // remember what the other nodes know now
+    if (num > entry->sent_sta_size) {
+        struct sta_fingerprint *tmp = realloc(entry->sent_sta, num * sizeof(*tmp));
+        if (!tmp) {
+            entry->sent_sta_num = 0;
+            entry->full_sync_time = 0;
+            return -1;
+        }
+        entry->sent_sta = tmp;
+        entry->sent_sta_size = num;
     }
-    return 0;
+    memcpy(entry->sent_sta, cur, num * sizeof(*cur));
+    entry->sent_sta_num = num;
+
+    return full ? -1 : 0;
 }
 
 static void ubus_get_clients_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
@@ -971,7 +1957,7 @@ static void ubus_get_clients_cb(struct ubus_request *req, int type, struct blob_
     blobmsg_add_u32(&b_domain, "bandwidth", network_config.bandwidth);
 
     struct hostapd_sock_entry *entry = hostapd_array_get_entry(req->peer);
-    if(entry->id != req->peer)
+    if(!entry)
     {
         fprintf(stderr, "Failed to find hostapd sock entry in callback with id %d\n", req->peer);
         return;
@@ -982,10 +1968,11 @@ static void ubus_get_clients_cb(struct ubus_request *req, int type, struct blob_
     blobmsg_add_u8(&b_domain, "ht_supported", entry->ht);
     blobmsg_add_u8(&b_domain, "vht_supported", entry->vht);
 
-    //int channel_util = get_channel_utilization(entry->iface_name, &entry->last_channel_time, &entry->last_channel_time_busy);
     blobmsg_add_u32(&b_domain, "channel_utilization", entry->chan_util_average);
 
-    send_blob_attr_via_network(b_domain.head, "clients");
+    if (send_clients_delta(entry, b_domain.head) < 0) {
+        send_blob_attr_via_network(b_domain.head, "clients");
+    }
     parse_to_clients(b_domain.head, 1, req->peer);
 
     print_client_array();
@@ -994,32 +1981,125 @@ static void ubus_get_clients_cb(struct ubus_request *req, int type, struct blob_
     free(data_str);
 }
 
+static void ubus_get_clients_complete(struct ubus_request *req, int ret) {
+    struct hostapd_sock_entry *entry = hostapd_array_get_entry(req->peer);
+
+    if (entry) {
+        entry->get_clients_pending = 0;
+    }
+}
+
+// All interfaces are asked at once, a hanging hostapd only delays its own clients.
 static int ubus_get_clients() {
     for (int i = 0; i <= hostapd_sock_last; i++) {
-        int timeout = 1;
-        ubus_invoke(ctx, hostapd_sock_arr[i]->id, "get_clients", NULL, ubus_get_clients_cb, NULL, timeout * 1000);
+        if (hostapd_sock_arr[i]->get_clients_pending) {
+            continue;
+        }
+        if (ubus_invoke_deadline(hostapd_sock_arr[i]->id, "get_clients", NULL, ubus_get_clients_cb,
+                                 ubus_get_clients_complete, UBUS_CALL_TIMEOUT, NULL) == 0) {
+            hostapd_sock_arr[i]->get_clients_pending = 1;
+        }
     }
     return 0;
 }
 
+static time_t reconcile_interval() {
+    return timeout_config.reconcile_clients > 0 ? timeout_config.reconcile_clients : CLIENT_RECONCILE_DEFAULT;
+}
+
+// Own ap entry in the layout of a "clients" message, without the stations.
+static void add_ap_event(struct hostapd_sock_entry *entry, int num) {
+    blob_buf_init(&b_event, 0);
+    blobmsg_add_macaddr(&b_event, "bssid", entry->bssid_addr);
+    blobmsg_add_string(&b_event, "ssid", entry->ssid);
+    blobmsg_add_u32(&b_event, "freq", entry->freq);
+    blobmsg_add_u8(&b_event, "ht_supported", entry->ht);
+    blobmsg_add_u8(&b_event, "vht_supported", entry->vht);
+    blobmsg_add_u32(&b_event, "channel_utilization", entry->chan_util_average);
+    blobmsg_add_u32(&b_event, "collision_domain", network_config.collision_domain);
+    blobmsg_add_u32(&b_event, "bandwidth", network_config.bandwidth);
+    blobmsg_add_u32(&b_event, "num_sta", num);
+}
+
+// Refresh the own ap entries and kick from the client table the notifies keep up to date.
+static void update_clients_from_table() {
+    time_t now = time(0);
+
+    for (int i = 0; i <= hostapd_sock_last; i++) {
+        struct hostapd_sock_entry *entry = hostapd_sock_arr[i];
+        int num = client_array_count_bssid(entry->bssid_addr);
+        void *tbl;
+
+        // the full table from the notify driven client array, in case a delta got lost
+        if (now - entry->full_sync_time >= CLIENTS_FULL_SYNC_INTERVAL) {
+            add_ap_event(entry, num);
+            client_array_add_table(&b_event, entry->bssid_addr);
+            send_blob_attr_via_network(b_event.head, "clients");
+            entry->sent_chan_util = entry->chan_util_average;
+            entry->sent_time = now;
+            entry->full_sync_time = now;
+        }
+
+        // the own ap entry is refreshed locally, the stations are already known
+        add_ap_event(entry, num);
+        tbl = blobmsg_open_table(&b_event, "clients");
+        blobmsg_close_table(&b_event, tbl);
+
+        parse_to_clients_delta(b_event.head);
+
+        // stations were already announced when they came and went
+        if (dawn_metric.chan_util_update_delta <= 0 ||
+            abs(entry->chan_util_average - entry->sent_chan_util) >= dawn_metric.chan_util_update_delta ||
+            now - entry->sent_time >= update_silence()) {
+            send_blob_attr_via_network(b_event.head, "clientsdelta");
+            entry->sent_chan_util = entry->chan_util_average;
+            entry->sent_time = now;
+        }
+
+        if (dawn_metric.kicking) {
+            kick_clients(entry->bssid_addr, entry->id);
+        }
+    }
+}
+
 void update_clients(struct uloop_timeout *t) {
-    ubus_get_clients();
+    static time_t last_reconcile;
+    time_t now = time(0);
+
+    // new sweep, station info is fetched fresh once
+    iwinfo_sta_cache_invalidate();
+
+    // the full table from hostapd only repairs what the notifies missed
+    if (now - last_reconcile >= reconcile_interval()) {
+        last_reconcile = now;
+        ubus_get_clients();
+    } else {
+        update_clients_from_table();
+    }
     // maybe to much?! don't set timer again...
     uloop_timeout_set(&client_timer, timeout_config.update_client * 1000);
 }
 
 void update_channel_utilization(struct uloop_timeout *t) {
+    // one survey per radio for all interfaces
+    iwinfo_survey_all();
+
     for (int i = 0; i <= hostapd_sock_last; i++) {
+        struct hostapd_sock_entry *entry = hostapd_sock_arr[i];
+        struct iwinfo_iface *iface = iwinfo_iface_get_by_bssid(entry->bssid_addr);
+        int sample = iwinfo_iface_chan_util(entry->iface_name);
 
-        hostapd_sock_arr[i]->chan_util_samples_sum += get_channel_utilization(hostapd_sock_arr[i]->iface_name, &hostapd_sock_arr[i]->last_channel_time, &hostapd_sock_arr[i]->last_channel_time_busy);
-        hostapd_sock_arr[i]->chan_util_num_sample_periods++;
+        // announced by update_clients_from_table, keep it current after channel switches
+        if (iface && iface->freq) {
+            entry->freq = iface->freq;
+        }
 
-        if(hostapd_sock_arr[i]->chan_util_num_sample_periods > dawn_metric.chan_util_avg_period)
-        {
-            hostapd_sock_arr[i]->chan_util_average = hostapd_sock_arr[i]->chan_util_samples_sum / hostapd_sock_arr[i]->chan_util_num_sample_periods;
-            hostapd_sock_arr[i]->chan_util_samples_sum = 0;
-            hostapd_sock_arr[i]->chan_util_num_sample_periods = 0;
+        if (sample < 0) {
+            continue;
         }
+
+        chan_util_add(&entry->chan_util, sample, dawn_metric.chan_util_avg_period);
+        entry->chan_util_average = chan_util_value(&entry->chan_util);
     }
     uloop_timeout_set(&channel_utilization_timer, timeout_config.update_chan_util * 1000);
 }
@@ -1035,8 +2115,15 @@ void start_umdns_update() {
 }
 
 void update_hostapd_sockets(struct uloop_timeout *t) {
+    time_t interval = timeout_config.update_hostapd;
+
+    // watch first, so no interface appears between the scan and the watch
+    if (watch_hostapd_dir(hostapd_dir_glob) == 0 && interval < HOSTAPD_RESCAN_INTERVAL) {
+        interval = HOSTAPD_RESCAN_INTERVAL;
+    }
+
     subscribe_to_hostapd_interfaces(hostapd_dir_glob);
-    uloop_timeout_set(&hostapd_timer, timeout_config.update_hostapd * 1000);
+    uloop_timeout_set(&hostapd_timer, interval * 1000);
 }
 
 void del_client_all_interfaces(const uint8_t *client_addr, uint32_t reason, uint8_t deauth, uint32_t ban_time) {
@@ -1047,8 +2134,7 @@ void del_client_all_interfaces(const uint8_t *client_addr, uint32_t reason, uint
     blobmsg_add_u32(&b, "ban_time", ban_time);
 
     for (int i = 0; i <= hostapd_sock_last; i++) {
-        int timeout = 1;
-        ubus_invoke(ctx, hostapd_sock_arr[i]->id, "del_client", b.head, NULL, NULL, timeout * 1000);
+        ubus_invoke_deadline(hostapd_sock_arr[i]->id, "del_client", b.head, NULL, NULL, UBUS_CALL_TIMEOUT, NULL);
     }
 }
 
@@ -1060,8 +2146,298 @@ void del_client_interface(uint32_t id, const uint8_t *client_addr, uint32_t reas
     blobmsg_add_u8(&b, "deauth", deauth);
     blobmsg_add_u32(&b, "ban_time", ban_time);
 
-    int timeout = 1;
-    ubus_invoke(ctx, id, "del_client", b.head, NULL, NULL, timeout * 1000);
+    ubus_invoke_deadline(id, "del_client", b.head, NULL, NULL, UBUS_CALL_TIMEOUT, NULL);
+}
+
+static uint64_t ubus_time_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct btm_pending *btm_pending_get(uint8_t client_addr[]) {
+    for (int i = 0; i < BTM_PENDING_LEN; i++) {
+        if (btm_pending[i].used && mac_is_equal(btm_pending[i].client_addr, client_addr)) {
+            return &btm_pending[i];
+        }
+    }
+    return NULL;
+}
+
+static struct btm_pending *btm_pending_get_token(uint8_t dialog_token) {
+    for (int i = 0; i < BTM_PENDING_LEN; i++) {
+        if (btm_pending[i].used && btm_pending[i].dialog_token == dialog_token) {
+            return &btm_pending[i];
+        }
+    }
+    return NULL;
+}
+
+static void btm_pending_release(struct btm_pending *p) {
+    uloop_timeout_cancel(&p->timer);
+    p->used = 0;
+}
+
+static void btm_roamed(struct btm_pending *p) {
+    uint64_t latency = ubus_time_ms() - p->sent;
+    char mac_buf[20];
+
+    btm_stats.roamed++;
+    btm_stats.latency_sum += latency;
+    if (latency > btm_stats.latency_max) {
+        btm_stats.latency_max = latency;
+    }
+
+    sprintf(mac_buf, MACSTR, MAC2STR(p->client_addr));
+    printf("Client %s left after the BSS transition request in %llu ms\n", mac_buf, (unsigned long long) latency);
+
+    // do not steer it again before hostapd reports it gone
+    client_array_delete_station(p->bssid_addr, p->client_addr);
+    btm_pending_release(p);
+}
+
+// The client did not follow the request, kick it the old way.
+static void btm_deauth(struct btm_pending *p) {
+    char mac_buf[20];
+
+    sprintf(mac_buf, MACSTR, MAC2STR(p->client_addr));
+    printf("Client %s did not roam, deauthenticating it\n", mac_buf);
+
+    btm_stats.deauths++;
+    del_client_interface(p->id, p->client_addr, NO_MORE_STAS, 1, 1000);
+    client_array_delete_station(p->bssid_addr, p->client_addr);
+    btm_pending_release(p);
+}
+
+static void btm_timeout_cb(struct uloop_timeout *t) {
+    struct btm_pending *p = container_of(t, struct btm_pending, timer);
+
+    // the client roamed, but the notify got lost
+    if (iwinfo_iface_has_station(p->iface_name, p->client_addr) == 0) {
+        btm_roamed(p);
+        return;
+    }
+
+    btm_stats.ignored++;
+    btm_deauth(p);
+}
+
+static void btm_request_complete(struct ubus_request *req, int ret) {
+    struct btm_pending *p = btm_pending_get_token((uint8_t) (uintptr_t) req->priv);
+
+    // hostapd refuses clients without BSS transition support
+    if (ret && p) {
+        btm_stats.rejected++;
+        btm_deauth(p);
+    }
+}
+
+static void btm_client_left(uint8_t bssid_addr[], uint8_t client_addr[]) {
+    struct btm_pending *p = btm_pending_get(client_addr);
+
+    if (p && mac_is_equal(p->bssid_addr, bssid_addr)) {
+        btm_roamed(p);
+    }
+}
+
+enum {
+    BTM_RESPONSE_ADDR,
+    BTM_RESPONSE_DIALOG_TOKEN,
+    BTM_RESPONSE_STATUS_CODE,
+    __BTM_RESPONSE_MAX,
+};
+
+static const struct blobmsg_policy btm_response_policy[__BTM_RESPONSE_MAX] = {
+        [BTM_RESPONSE_ADDR] = {.name = "address", .type = BLOBMSG_TYPE_STRING},
+        [BTM_RESPONSE_DIALOG_TOKEN] = {.name = "dialog-token", .type = BLOBMSG_TYPE_INT8},
+        [BTM_RESPONSE_STATUS_CODE] = {.name = "status-code", .type = BLOBMSG_TYPE_INT8},
+};
+
+static void handle_bss_transition_response(struct blob_attr *msg) {
+    struct blob_attr *tb[__BTM_RESPONSE_MAX];
+    struct btm_pending *p;
+    uint8_t client_addr[ETH_ALEN];
+
+    blobmsg_parse(btm_response_policy, __BTM_RESPONSE_MAX, tb, blob_data(msg), blob_len(msg));
+
+    if (!tb[BTM_RESPONSE_ADDR] || !tb[BTM_RESPONSE_STATUS_CODE] ||
+        hwaddr_aton(blobmsg_data(tb[BTM_RESPONSE_ADDR]), client_addr)) {
+        return;
+    }
+
+    p = btm_pending_get(client_addr);
+    if (!p || p->accepted ||
+        (tb[BTM_RESPONSE_DIALOG_TOKEN] && blobmsg_get_u8(tb[BTM_RESPONSE_DIALOG_TOKEN]) != p->dialog_token)) {
+        return;
+    }
+
+    if (blobmsg_get_u8(tb[BTM_RESPONSE_STATUS_CODE]) == WLAN_STATUS_SUCCESS) {
+        btm_stats.accepted++;
+        p->accepted = 1;
+    } else {
+        btm_stats.rejected++;
+        btm_deauth(p);
+    }
+}
+
+// Operating class and channel of a frequency (IEEE 802.11 Annex E, global classes).
+static int freq_to_op_class(uint32_t freq, uint8_t *op_class, uint8_t *channel) {
+    if (freq == 2484) {
+        *op_class = 82;
+        *channel = 14;
+    } else if (freq >= 2412 && freq <= 2472) {
+        *op_class = 81;
+        *channel = (freq - 2407) / 5;
+    } else if (freq >= 5955 && freq <= 7115) {
+        *op_class = 131;
+        *channel = (freq - 5950) / 5;
+    } else if (freq >= 5180 && freq <= 5845) {
+        *channel = (freq - 5000) / 5;
+        if (*channel <= 48) {
+            *op_class = 115;
+        } else if (*channel <= 64) {
+            *op_class = 118;
+        } else if (*channel <= 144) {
+            *op_class = 121;
+        } else {
+            *op_class = 125;
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Neighbor report element without the header, hex encoded as hostapd expects it:
+// bssid, bssid information, operating class, channel, phy type and the candidate preference.
+static int btm_neighbor_report(char *buf, uint8_t bssid_addr[], uint8_t preference) {
+    ap candidate = ap_array_get_ap(bssid_addr);
+    uint8_t op_class, channel, phy_type;
+    // reachable, same security and key scope, ht and vht capabilities
+    uint32_t info = 0x0f;
+
+    if (!mac_is_equal(candidate.bssid_addr, bssid_addr) ||
+        freq_to_op_class(candidate.freq, &op_class, &channel)) {
+        return -1;
+    }
+
+    if (candidate.ht) {
+        info |= 1 << 11;
+    }
+    if (candidate.vht) {
+        info |= 1 << 12;
+    }
+    phy_type = candidate.vht ? 9 : candidate.ht ? 7 : 0;
+
+    // the candidate preference is subelement 3 with a length of 1
+    sprintf(buf, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x0301%02x",
+            MAC2STR(bssid_addr), info & 0xff, (info >> 8) & 0xff, (info >> 16) & 0xff, info >> 24,
+            op_class, channel, phy_type, preference);
+    return 0;
+}
+
+int send_bss_transition_request(uint32_t id, uint8_t client_addr[], uint8_t bssid_addr[]) {
+    uint8_t candidates[BTM_MAX_CANDIDATES][ETH_ALEN];
+    struct hostapd_sock_entry *entry = hostapd_array_get_entry(id);
+    struct btm_pending *p;
+    char report[40];
+    void *neighbors;
+    int num_candidates, num_reports = 0;
+
+    if (btm_pending_get(client_addr)) {
+        return 0;
+    }
+
+    p = NULL;
+    for (int i = 0; i < BTM_PENDING_LEN && !p; i++) {
+        if (!btm_pending[i].used) {
+            p = &btm_pending[i];
+        }
+    }
+
+    num_candidates = probe_array_best_bssids(client_addr, bssid_addr, candidates, BTM_MAX_CANDIDATES);
+    if (!entry || !p || num_candidates == 0) {
+        return -1;
+    }
+
+    // 0 means no dialog token to hostapd
+    if (++btm_dialog_token == 0) {
+        btm_dialog_token = 1;
+    }
+
+    blob_buf_init(&b, 0);
+    blobmsg_add_macaddr(&b, "addr", client_addr);
+    blobmsg_add_u8(&b, "disassociation_imminent", 1);
+    blobmsg_add_u32(&b, "disassociation_timer", 0);
+    // in beacon intervals of roughly 100 ms
+    blobmsg_add_u32(&b, "validity_period", BTM_ROAM_TIMEOUT / 100);
+    blobmsg_add_u8(&b, "abridged", 1);
+    blobmsg_add_u32(&b, "dialog_token", btm_dialog_token);
+
+    // the list is sorted by eval_probe_metric, the best candidate gets the highest preference
+    neighbors = blobmsg_open_array(&b, "neighbors");
+    for (int i = 0; i < num_candidates; i++) {
+        if (btm_neighbor_report(report, candidates[i], 255 - i) == 0) {
+            blobmsg_add_string(&b, NULL, report);
+            num_reports++;
+        }
+    }
+    blobmsg_close_array(&b, neighbors);
+
+    if (num_reports == 0 ||
+        ubus_invoke_deadline(id, "bss_transition_request", b.head, NULL, btm_request_complete, UBUS_CALL_TIMEOUT,
+                             (void *) (uintptr_t) btm_dialog_token)) {
+        return -1;
+    }
+
+    memset(p, 0, sizeof(*p));
+    p->used = 1;
+    p->dialog_token = btm_dialog_token;
+    memcpy(p->client_addr, client_addr, ETH_ALEN);
+    memcpy(p->bssid_addr, bssid_addr, ETH_ALEN);
+    p->id = id;
+    strncpy(p->iface_name, entry->iface_name, sizeof(p->iface_name) - 1);
+    p->sent = ubus_time_ms();
+    p->timer.cb = btm_timeout_cb;
+    uloop_timeout_set(&p->timer, BTM_ROAM_TIMEOUT);
+
+    btm_stats.requests++;
+    return 0;
+}
+
+int build_roam_overview(struct blob_buf *b) {
+    uint64_t now = ubus_time_ms();
+    char mac_buf[20];
+    void *tbl, *sta;
+
+    blob_buf_init(b, 0);
+    blobmsg_add_u32(b, "requests", btm_stats.requests);
+    blobmsg_add_u32(b, "accepted", btm_stats.accepted);
+    blobmsg_add_u32(b, "rejected", btm_stats.rejected);
+    blobmsg_add_u32(b, "ignored", btm_stats.ignored);
+    blobmsg_add_u32(b, "roamed", btm_stats.roamed);
+    blobmsg_add_u32(b, "deauths", btm_stats.deauths);
+    blobmsg_add_u32(b, "success_rate",
+                    btm_stats.requests ? btm_stats.roamed * 100 / btm_stats.requests : 0);
+    blobmsg_add_u32(b, "latency_avg",
+                    btm_stats.roamed ? btm_stats.latency_sum / btm_stats.roamed : 0);
+    blobmsg_add_u32(b, "latency_max", btm_stats.latency_max);
+
+    tbl = blobmsg_open_table(b, "pending");
+    for (int i = 0; i < BTM_PENDING_LEN; i++) {
+        if (!btm_pending[i].used) {
+            continue;
+        }
+        sprintf(mac_buf, MACSTR, MAC2STR(btm_pending[i].client_addr));
+        sta = blobmsg_open_table(b, mac_buf);
+        blobmsg_add_macaddr(b, "bssid", btm_pending[i].bssid_addr);
+        blobmsg_add_u8(b, "accepted", btm_pending[i].accepted);
+        blobmsg_add_u32(b, "age", now - btm_pending[i].sent);
+        blobmsg_close_table(b, sta);
+    }
+    blobmsg_close_table(b, tbl);
+    return 0;
 }
 
 static void ubus_umdns_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
@@ -1098,6 +2474,11 @@ static void ubus_umdns_cb(struct ubus_request *req, int type, struct blob_attr *
     }
 }
 
+// Browse once the update is done, also if it failed, the old cache is better than nothing.
+static void ubus_umdns_update_complete(struct ubus_request *req, int ret) {
+    ubus_invoke_deadline(req->peer, "browse", NULL, ubus_umdns_cb, NULL, UBUS_CALL_TIMEOUT, NULL);
+}
+
 int ubus_call_umdns() {
     u_int32_t id;
     if (ubus_lookup_id(ctx, "umdns", &id)) {
@@ -1105,11 +2486,7 @@ int ubus_call_umdns() {
         return -1;
     }
 
-    int timeout = 1;
-    ubus_invoke(ctx, id, "update", NULL, NULL, NULL, timeout * 1000);
-    ubus_invoke(ctx, id, "browse", NULL, ubus_umdns_cb, NULL, timeout * 1000);
-
-    return 0;
+    return ubus_invoke_deadline(id, "update", NULL, NULL, ubus_umdns_update_complete, UBUS_CALL_TIMEOUT, NULL);
 }
 
 int ubus_send_probe_via_network(struct probe_entry_s probe_entry) {
@@ -1127,12 +2504,15 @@ int ubus_send_probe_via_network(struct probe_entry_s probe_entry) {
     return 0;
 }
 
-int send_set_probe(uint8_t client_addr[]) {
+int send_set_probe(uint8_t client_addr[], uint8_t bssid_addr[]) {
+    uint8_t targets[NOTIFY_MAX_TARGETS][ETH_ALEN];
+    int num_targets = probe_array_best_bssids(client_addr, bssid_addr, targets, NOTIFY_MAX_TARGETS);
+
     blob_buf_init(&b_probe, 0);
     blobmsg_add_macaddr(&b_probe, "bssid", client_addr);
     blobmsg_add_macaddr(&b_probe, "address", client_addr);
 
-    send_blob_attr_via_network(b_probe.head, "setprobe");
+    send_blob_attr_to_bssids(b_probe.head, "setprobe", targets, num_targets);
 
     return 0;
 }
@@ -1149,7 +2529,10 @@ static const struct blobmsg_policy add_del_policy[__ADD_DEL_MAC_MAX] = {
 static const struct ubus_method dawn_methods[] = {
         UBUS_METHOD("add_mac", add_mac, add_del_policy),
         UBUS_METHOD_NOARG("get_hearing_map", get_hearing_map),
-        UBUS_METHOD_NOARG("get_network", get_network)
+        UBUS_METHOD_NOARG("get_network", get_network),
+        UBUS_METHOD_NOARG("get_peers", get_peers),
+        UBUS_METHOD_NOARG("get_roam_stats", get_roam_stats),
+        UBUS_METHOD_NOARG("get_kick_queue", get_kick_queue)
         //UBUS_METHOD_NOARG("get_aps");
         //UBUS_METHOD_NOARG("get_clients");
 };
@@ -1225,6 +2608,42 @@ static int get_network(struct ubus_context *ctx, struct ubus_object *obj,
     return 0;
 }
 
+static int get_peers(struct ubus_context *ctx, struct ubus_object *obj,
+                     struct ubus_request_data *req, const char *method,
+                     struct blob_attr *msg) {
+    int ret;
+
+    build_tcp_peer_overview(&b);
+    ret = ubus_send_reply(ctx, req, b.head);
+    if (ret)
+        fprintf(stderr, "Failed to send reply: %s\n", ubus_strerror(ret));
+    return 0;
+}
+
+static int get_roam_stats(struct ubus_context *ctx, struct ubus_object *obj,
+                          struct ubus_request_data *req, const char *method,
+                          struct blob_attr *msg) {
+    int ret;
+
+    build_roam_overview(&b);
+    ret = ubus_send_reply(ctx, req, b.head);
+    if (ret)
+        fprintf(stderr, "Failed to send reply: %s\n", ubus_strerror(ret));
+    return 0;
+}
+
+static int get_kick_queue(struct ubus_context *ctx, struct ubus_object *obj,
+                          struct ubus_request_data *req, const char *method,
+                          struct blob_attr *msg) {
+    int ret;
+
+    build_kick_queue_overview(&b);
+    ret = ubus_send_reply(ctx, req, b.head);
+    if (ret)
+        fprintf(stderr, "Failed to send reply: %s\n", ubus_strerror(ret));
+    return 0;
+}
+
 static void ubus_add_oject() {
     int ret;
 
@@ -1237,13 +2656,8 @@ static void respond_to_notify(uint32_t id) {
     // This is needed to respond to the ubus notify ...
     // Maybe we need to disable on shutdown...
     // But it is not possible when we disable the notify that other daemons are running that relay on this notify...
-    int ret;
-
     blob_buf_init(&b, 0);
     blobmsg_add_u32(&b, "notify_response", 1);
 
-    int timeout = 1;
-    ret = ubus_invoke(ctx, id, "notify_response", b.head, NULL, NULL, timeout * 1000);
-    if (ret)
-        fprintf(stderr, "Failed to invoke: %s\n", ubus_strerror(ret));
+    ubus_invoke_deadline(id, "notify_response", b.head, NULL, NULL, UBUS_CALL_TIMEOUT, NULL);
 }
\ No newline at end of file
@@ -77,4 +77,33 @@ void write_mac_to_file(char *path, uint8_t addr[]) {
     fprintf(f, "%s\n", mac_buf);
 
     fclose(f);
-}
\ No newline at end of file
+}
+char *reserve_buf(char **buf, size_t *size, size_t needed) {
+    if (needed > *size) {
+        char *tmp = realloc(*buf, needed);
+        if (!tmp) {
+            return NULL;
+        }
+        *buf = tmp;
+        *size = needed;
+    }
+    return *buf;
+}
+
+uint32_t hash_fnv1a(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t hash = 2166136261U;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+uint32_t ssid_topic(const char *ssid) {
+    uint32_t hash = hash_fnv1a(ssid, strlen(ssid));
+
+    // 0 means no topic
+    return hash ? hash : 1;
+}